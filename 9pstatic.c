@@ -13,6 +13,10 @@ struct message *message_new(void) {
     struct message *msg = GC_NEW(struct message);
     assert(msg != NULL);
     msg->raw = NULL;
+    msg->sendfd = -1;
+    msg->sendoffset = 0;
+    msg->sendcount = 0;
+    msg->sendraw = NULL;
     msg->tag = ALLOCTAG;
     return msg;
 }
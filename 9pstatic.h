@@ -71,7 +71,7 @@ enum qidtypes {
 #define RREAD_DATA_OFFSET 11
 #define RSREAD_DATA_OFFSET 11
 #define TWRITE_DATA_OFFSET 23
-#define TSWRITE_DATA_OFFSET 23
+#define TSWRITE_DATA_OFFSET 31
 #define REREVOKE_SIZE_FIXED 12
 #define TEGRANT_SIZE_FIXED 12
 #define TEMIGRATE_SIZE_FIXED 9
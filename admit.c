@@ -0,0 +1,148 @@
+#include <stdlib.h>
+#include "types.h"
+#include "9p.h"
+#include "list.h"
+#include "connection.h"
+#include "transaction.h"
+#include "config.h"
+#include "dispatch.h"
+#include "admit.h"
+#include "worker.h"
+#include "pool.h"
+
+/* connections with requests waiting, in the order of their turns */
+static List *admit_ready = NULL;
+static List *admit_ready_tail = NULL;
+static int admit_active = 0;
+
+static u32 admit_cost(Message *msg) {
+    switch (msg->id) {
+        case TREAD:     return 1 + msg->msg.tread.count / BLOCK_SIZE;
+        case TWRITE:    return 1 + msg->msg.twrite.count / BLOCK_SIZE;
+        default:        return 1;
+    }
+}
+
+static void admit_run(Worker *worker, Transaction *trans);
+
+/* start as many waiting requests as the limit allows */
+static void admit_schedule(void) {
+    while (admit_active < ADMIT_MAX_ACTIVE && !null(admit_ready)) {
+        Connection *conn = car(admit_ready);
+        Transaction *trans = car(conn->admit_queue);
+        u32 cost = admit_cost(trans->in);
+        List *elt;
+
+        if (conn->admit_deficit < cost) {
+            /* its turn is over, so top it up and send it to the back */
+            conn->admit_deficit += ADMIT_QUANTUM;
+            if (!null(cdr(admit_ready))) {
+                List *turn = admit_ready;
+                admit_ready = cdr(turn);
+                setcdr(turn, NULL);
+                setcdr(admit_ready_tail, turn);
+                admit_ready_tail = turn;
+            }
+            continue;
+        }
+
+        conn->admit_deficit -= cost;
+        elt = conn->admit_queue;
+        conn->admit_queue = cdr(elt);
+        conn->admit_queued--;
+        pool_cons_free(elt);
+        if (null(conn->admit_queue)) {
+            /* an idle connection does not save up its allowance */
+            conn->admit_queue_tail = NULL;
+            conn->admit_deficit = 0;
+            elt = admit_ready;
+            admit_ready = cdr(elt);
+            if (null(admit_ready))
+                admit_ready_tail = NULL;
+            pool_cons_free(elt);
+        }
+
+        admit_active++;
+        worker_create((void (*)(Worker *, void *)) admit_run, trans);
+    }
+}
+
+static void admit_run(Worker *worker, Transaction *trans) {
+    dispatch(worker, trans);
+
+    /* the reply has been queued and nothing refers to the request any more;
+     * the reply itself still belongs to the transport */
+    pool_message_free(trans->in);
+    trans_free(trans);
+
+    admit_active--;
+    admit_schedule();
+}
+
+/* dispatch a new request, or queue it on its connection if too many client
+ * requests are already in progress; called with the big lock held */
+void admit_request(Transaction *trans) {
+    Connection *conn = trans->conn;
+    List *elt;
+
+    if (conn->type != CONN_CLIENT_IN) {
+        worker_create((void (*)(Worker *, void *)) dispatch, trans);
+        return;
+    }
+
+    elt = pool_cons(trans, NULL);
+    if (null(conn->admit_queue)) {
+        /* the connection joins the back of the line */
+        List *turn = pool_cons(conn, NULL);
+        if (null(admit_ready))
+            admit_ready = turn;
+        else
+            setcdr(admit_ready_tail, turn);
+        admit_ready_tail = turn;
+
+        conn->admit_queue = elt;
+    } else {
+        setcdr(conn->admit_queue_tail, elt);
+    }
+    conn->admit_queue_tail = elt;
+    conn->admit_queued++;
+
+    admit_schedule();
+}
+
+/* forget the requests waiting on a connection that is closing */
+void admit_drop(Connection *conn) {
+    List *prev = NULL;
+    List *cur;
+
+    if (null(conn->admit_queue))
+        return;
+
+    for (cur = admit_ready; car(cur) != conn; cur = cdr(cur))
+        prev = cur;
+
+    if (null(prev))
+        admit_ready = cdr(cur);
+    else
+        setcdr(prev, cdr(cur));
+    if (admit_ready_tail == cur)
+        admit_ready_tail = prev;
+    pool_cons_free(cur);
+
+    while (!null(conn->admit_queue)) {
+        List *elt = conn->admit_queue;
+        Transaction *trans = car(elt);
+        conn->admit_queue = cdr(elt);
+        pool_message_free(trans->in);
+        trans_free(trans);
+        pool_cons_free(elt);
+    }
+
+    conn->admit_queue = conn->admit_queue_tail = NULL;
+    conn->admit_queued = 0;
+    conn->admit_deficit = 0;
+}
+
+int admit_active_count(void) {
+    return admit_active;
+}
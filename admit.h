@@ -0,0 +1,23 @@
+#ifndef _ADMIT_H_
+#define _ADMIT_H_
+
+#include "types.h"
+#include "connection.h"
+#include "transaction.h"
+#include "config.h"
+
+/* Admission control
+ * Client requests are dispatched only while fewer than ADMIT_MAX_ACTIVE of
+ * them are in progress.  The rest wait in a queue on their connection, and
+ * connections with waiting requests take turns by deficit round robin: each
+ * turn adds ADMIT_QUANTUM to a connection's allowance, and a request costs
+ * one plus a unit for each block it reads or writes, so a client streaming
+ * large reads and writes cannot crowd out one doing small operations.
+ * Requests from other envoys and storage servers are always dispatched at
+ * once, since admitted transactions may be waiting for them to finish. */
+
+void admit_request(Transaction *trans);
+void admit_drop(Connection *conn);
+int admit_active_count(void);
+
+#endif
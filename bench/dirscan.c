@@ -0,0 +1,103 @@
+/* Microbenchmark for name lookups in directory blocks
+ *
+ * Packs a full block of entries with 1-60 byte names, then finds a spread of
+ * them two ways: by decoding the block and comparing names one by one, as
+ * lookups used to, and with dir_scan_block, which searches the packed block
+ * in place.  dir.c is included directly to reach its static functions.
+ *
+ * Build with "make bench" and run bench/dirscan.
+ */
+#include <time.h>
+#include "dir.c"
+
+#define DIRSCAN_MAX_NAME 60
+#define DIRSCAN_KEYS 100
+#define DIRSCAN_UNPACK_LOOKUPS 200000
+#define DIRSCAN_SCAN_LOOKUPS 2000000
+
+static double dirscan_seconds(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* fill a block with entries whose names have random lengths and letters */
+static List *dirscan_entries(void) {
+    List *entries = NULL;
+    u32 i;
+
+    srand(3);
+    for (i = 0; ; i++) {
+        struct direntry *elt = GC_NEW(struct direntry);
+        u32 len = 1 + rand() % DIRSCAN_MAX_NAME;
+        u32 j;
+
+        assert(elt != NULL);
+        elt->filename = GC_MALLOC_ATOMIC(len + 16);
+        assert(elt->filename != NULL);
+        j = sprintf(elt->filename, "f%u-", i);
+        while (j < len)
+            elt->filename[j++] = 'a' + rand() % 26;
+        elt->filename[j] = 0;
+        elt->oid = i;
+        elt->cow = rand() % 2;
+
+        if (dir_entries_size(cons(elt, entries)) > BLOCK_SIZE)
+            break;
+        entries = cons(elt, entries);
+    }
+
+    return reverse(entries);
+}
+
+int main(int argc, char **argv) {
+    u8 block[BLOCK_SIZE];
+    struct dir_key keys[DIRSCAN_KEYS];
+    List *entries, *elt;
+    u32 count, nentries, nkeys, step, i;
+    long hits = 0;
+    double start;
+
+    GC_init();
+
+    entries = dirscan_entries();
+    nentries = length(entries);
+    count = dir_pack_entries(entries, block);
+
+    /* look up names from all over the block */
+    step = nentries > DIRSCAN_KEYS ? nentries / DIRSCAN_KEYS : 1;
+    nkeys = 0;
+    for (elt = entries, i = 0; !null(elt) && nkeys < DIRSCAN_KEYS;
+            elt = cdr(elt), i++)
+    {
+        struct direntry *entry = car(elt);
+        if (i % step != 0)
+            continue;
+        keys[nkeys].name = entry->filename;
+        keys[nkeys].len = strlen(entry->filename);
+        nkeys++;
+    }
+
+    printf("block: %u entries, %u bytes, scan width %d\n",
+            nentries, count, DIR_SCAN_WIDTH);
+
+    start = dirscan_seconds();
+    for (i = 0; i < DIRSCAN_UNPACK_LOOKUPS; i++) {
+        List *decoded = dir_unpack_entries(count, block);
+        hits += dir_entries_find(decoded, keys[i % nkeys].name) != NULL;
+    }
+    printf("unpack+strcmp: %.0f ns/lookup\n",
+            (dirscan_seconds() - start) / DIRSCAN_UNPACK_LOOKUPS * 1e9);
+
+    start = dirscan_seconds();
+    for (i = 0; i < DIRSCAN_SCAN_LOOKUPS; i++)
+        hits += dir_scan_block(count, block, &keys[i % nkeys]) >= 0;
+    printf("scan in place: %.0f ns/lookup\n",
+            (dirscan_seconds() - start) / DIRSCAN_SCAN_LOOKUPS * 1e9);
+
+    /* every key is in the block */
+    assert(hits == DIRSCAN_UNPACK_LOOKUPS + DIRSCAN_SCAN_LOOKUPS);
+
+    return 0;
+}
@@ -0,0 +1,150 @@
+/* Microbenchmark for the hashtables
+ *
+ * Times inserts, hits, misses and removals on 200k-entry tables keyed by
+ * strings (hashed with string_hash) and by u32s (hashed with u32_hash, which
+ * goes through generic_hash), touching the keys in a scattered order.  The
+ * tables start small, as most in the tree do, so inserts include growing.
+ * A second pass checks random set, remove and get operations against a
+ * plain array.
+ *
+ * Build with "make bench" and run bench/hashtable.
+ */
+#include <assert.h>
+#include <gc/gc.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "types.h"
+#include "9p.h"
+#include "hashtable.h"
+#include "util.h"
+
+#define HASH_BENCH_ENTRIES 200000
+#define HASH_BENCH_INITIAL 64
+#define HASH_BENCH_CHECK_OPS 400000
+#define HASH_BENCH_CHECK_KEYS 5000
+
+static double bench_seconds(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* a random permutation of 0..n-1 */
+static u32 *bench_order(u32 n) {
+    u32 *order = GC_MALLOC_ATOMIC(sizeof(u32) * n);
+    u32 i;
+
+    assert(order != NULL);
+    for (i = 0; i < n; i++)
+        order[i] = i;
+    for (i = n - 1; i > 0; i--) {
+        u32 j = rand() % (i + 1);
+        u32 tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+
+    return order;
+}
+
+static void bench_report(char *name, char *op, double start, u32 ops) {
+    printf("%-6s %-7s %4.0f ns/op\n", name, op,
+            (bench_seconds() - start) / ops * 1e9);
+}
+
+/* keys holds the entries followed by as many keys that are never added */
+static void bench_table(char *name, Hashfunc hash, Cmpfunc cmp, void **keys) {
+    Hashtable *table = hash_create(HASH_BENCH_INITIAL, hash, cmp);
+    u32 *order = bench_order(HASH_BENCH_ENTRIES);
+    u32 found = 0;
+    double start;
+    u32 i;
+
+    start = bench_seconds();
+    for (i = 0; i < HASH_BENCH_ENTRIES; i++)
+        hash_set(table, keys[order[i]], keys[order[i]]);
+    bench_report(name, "insert", start, HASH_BENCH_ENTRIES);
+
+    order = bench_order(HASH_BENCH_ENTRIES);
+    start = bench_seconds();
+    for (i = 0; i < HASH_BENCH_ENTRIES; i++)
+        found += hash_get(table, keys[order[i]]) != NULL;
+    bench_report(name, "hit", start, HASH_BENCH_ENTRIES);
+
+    start = bench_seconds();
+    for (i = 0; i < HASH_BENCH_ENTRIES; i++)
+        found += hash_get(table, keys[HASH_BENCH_ENTRIES + order[i]]) != NULL;
+    bench_report(name, "miss", start, HASH_BENCH_ENTRIES);
+
+    order = bench_order(HASH_BENCH_ENTRIES);
+    start = bench_seconds();
+    for (i = 0; i < HASH_BENCH_ENTRIES; i++)
+        hash_remove(table, keys[order[i]]);
+    bench_report(name, "remove", start, HASH_BENCH_ENTRIES);
+
+    assert(found == HASH_BENCH_ENTRIES);
+    assert(hash_count(table) == 0);
+}
+
+/* random operations on a small key space, compared against an array */
+static void bench_check(u32 **keys) {
+    Hashtable *table = hash_create(4, (Hashfunc) u32_hash, (Cmpfunc) u32_cmp);
+    u32 *model = GC_MALLOC_ATOMIC(sizeof(u32) * HASH_BENCH_CHECK_KEYS);
+    int count = 0;
+    u32 i;
+
+    assert(model != NULL);
+    memset(model, 0, sizeof(u32) * HASH_BENCH_CHECK_KEYS);
+
+    for (i = 0; i < HASH_BENCH_CHECK_OPS; i++) {
+        u32 k = rand() % HASH_BENCH_CHECK_KEYS;
+        u32 *value = hash_get(table, keys[k]);
+
+        assert(model[k] ? value != NULL && *value == k : value == NULL);
+        if (rand() % 3 == 0) {
+            hash_remove(table, keys[k]);
+            count -= model[k];
+            model[k] = 0;
+        } else {
+            hash_set(table, keys[k], keys[k]);
+            count += !model[k];
+            model[k] = 1;
+        }
+        assert(hash_count(table) == count);
+    }
+
+    printf("checked %d random operations\n", HASH_BENCH_CHECK_OPS);
+}
+
+int main(int argc, char **argv) {
+    char **strings;
+    u32 **numbers;
+    char name[64];
+    u32 i;
+
+    GC_init();
+    srand(1);
+
+    strings = GC_MALLOC(sizeof(char *) * HASH_BENCH_ENTRIES * 2);
+    numbers = GC_MALLOC(sizeof(u32 *) * HASH_BENCH_ENTRIES * 2);
+    assert(strings != NULL && numbers != NULL);
+
+    for (i = 0; i < HASH_BENCH_ENTRIES * 2; i++) {
+        sprintf(name, "/home/user%u/src/file%u.c", i % 97, i);
+        strings[i] = stringcopy(name);
+        numbers[i] = GC_NEW_ATOMIC(u32);
+        assert(numbers[i] != NULL);
+        *numbers[i] = i;
+    }
+
+    bench_table("string", (Hashfunc) string_hash, (Cmpfunc) strcmp,
+            (void **) strings);
+    bench_table("u32", (Hashfunc) u32_hash, (Cmpfunc) u32_cmp,
+            (void **) numbers);
+    bench_check(numbers);
+
+    return 0;
+}
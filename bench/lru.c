@@ -0,0 +1,165 @@
+/* Microbenchmark for the LRU caches
+ *
+ * Replays the access patterns of the two busiest caches on 1024-entry
+ * caches, once with each policy:
+ *
+ *   claims: a hot set of 400 paths mixed with a stream of cold ones, each
+ *     looked up before it is added, with occasional removals and a tenth of
+ *     the paths pinned by the resurrect callback, as claims in use are
+ *   walks: every prefix of a path looked up in turn, added on a miss, and
+ *     the completed walk removed again
+ *
+ * Build with "make bench" and run bench/lru.
+ */
+#include <assert.h>
+#include <gc/gc.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "types.h"
+#include "9p.h"
+#include "hashtable.h"
+#include "util.h"
+#include "lru.h"
+
+#define LRU_BENCH_SIZE 1024
+#define LRU_BENCH_HOT 400
+#define LRU_BENCH_COLD 100000
+#define LRU_BENCH_OPS 2000000
+#define LRU_BENCH_WALKS 600
+#define LRU_BENCH_DEPTH 6
+#define LRU_BENCH_FANOUT 12
+
+struct bench_item {
+    char *key;
+    int pinned;
+};
+
+static int bench_resurrect(struct bench_item *item) {
+    return item->pinned;
+}
+
+static double bench_seconds(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static struct bench_item *bench_item_new(char *key, int pinned) {
+    struct bench_item *item = GC_NEW(struct bench_item);
+    assert(item != NULL);
+    item->key = key;
+    item->pinned = pinned;
+    return item;
+}
+
+static Lru *bench_lru_new(enum lru_policy policy) {
+    return lru_new(LRU_BENCH_SIZE, policy,
+            (Hashfunc) string_hash,
+            (Cmpfunc) strcmp,
+            (int (*)(void *)) bench_resurrect,
+            NULL);
+}
+
+static void bench_report(char *name, Lru *lru, u32 ops, double start) {
+    printf("%-7s %-5s %4.0f ns/op, %2.0f%% hits\n", name,
+            lru->policy == LRU_2Q ? "2q" : "plain",
+            (bench_seconds() - start) / ops * 1e9,
+            100.0 * lru->hits / (lru->hits + lru->misses));
+}
+
+static void bench_claims(enum lru_policy policy, struct bench_item **hot,
+        struct bench_item **cold)
+{
+    Lru *lru = bench_lru_new(policy);
+    u32 next_cold = 0;
+    double start;
+    u32 i;
+
+    srand(7);
+    start = bench_seconds();
+    for (i = 0; i < LRU_BENCH_OPS; i++) {
+        struct bench_item *item;
+
+        if (rand() % 4 != 0)
+            item = hot[rand() % LRU_BENCH_HOT];
+        else
+            item = cold[next_cold++ % LRU_BENCH_COLD];
+
+        if (lru_get(lru, item->key) == NULL)
+            lru_add(lru, item->key, item);
+        if (rand() % 64 == 0)
+            lru_remove(lru, hot[rand() % LRU_BENCH_HOT]->key);
+    }
+    bench_report("claims", lru, LRU_BENCH_OPS, start);
+}
+
+static void bench_walks(enum lru_policy policy, char ***walks, u32 nwalks) {
+    Lru *lru = bench_lru_new(policy);
+    u32 ops = 0;
+    double start;
+    u32 i, j;
+
+    srand(11);
+    start = bench_seconds();
+    for (i = 0; ops < LRU_BENCH_OPS; i++) {
+        char **prefixes = walks[rand() % nwalks];
+
+        for (j = 0; j < LRU_BENCH_DEPTH; j++, ops++) {
+            if (lru_get(lru, prefixes[j]) == NULL)
+                lru_add(lru, prefixes[j], bench_item_new(prefixes[j], 0));
+        }
+
+        /* the finished walk is dropped again */
+        lru_remove(lru, prefixes[LRU_BENCH_DEPTH - 1]);
+        ops++;
+    }
+    bench_report("walks", lru, ops, start);
+}
+
+int main(int argc, char **argv) {
+    struct bench_item **hot, **cold;
+    char ***walks;
+    u32 nwalks = LRU_BENCH_WALKS;
+    char name[64];
+    u32 i, j;
+
+    GC_init();
+
+    hot = GC_MALLOC(sizeof(struct bench_item *) * LRU_BENCH_HOT);
+    cold = GC_MALLOC(sizeof(struct bench_item *) * LRU_BENCH_COLD);
+    walks = GC_MALLOC(sizeof(char **) * nwalks);
+    assert(hot != NULL && cold != NULL && walks != NULL);
+
+    for (i = 0; i < LRU_BENCH_HOT; i++) {
+        sprintf(name, "/home/hot/dir%u/file%u", i % 20, i);
+        hot[i] = bench_item_new(stringcopy(name), i % 10 == 0);
+    }
+    for (i = 0; i < LRU_BENCH_COLD; i++) {
+        sprintf(name, "/archive/dir%u/file%u", i % 500, i);
+        cold[i] = bench_item_new(stringcopy(name), 0);
+    }
+
+    /* walks down a tree whose upper levels are shared between them */
+    srand(5);
+    for (i = 0; i < nwalks; i++) {
+        char path[256] = "";
+
+        walks[i] = GC_MALLOC(sizeof(char *) * LRU_BENCH_DEPTH);
+        assert(walks[i] != NULL);
+        for (j = 0; j < LRU_BENCH_DEPTH; j++) {
+            u32 fanout = j < 3 ? LRU_BENCH_FANOUT / (3 - j) : 1000;
+            sprintf(path + strlen(path), "/d%u", (u32) rand() % fanout);
+            walks[i][j] = stringcopy(path);
+        }
+    }
+
+    bench_claims(LRU_PLAIN, hot, cold);
+    bench_claims(LRU_2Q, hot, cold);
+    bench_walks(LRU_PLAIN, walks, nwalks);
+    bench_walks(LRU_2Q, walks, nwalks);
+
+    return 0;
+}
@@ -22,29 +22,77 @@
 Lru *claim_cache;
 
 int claim_cmp(const Claim *a, const Claim *b) {
+    if (a == b)
+        return 0;
     return strcmp(a->pathname, b->pathname);
 }
 
-int claim_key_cmp(const char *key, const Claim *elt) {
-    return strcmp(key, elt->pathname);
+u32 claim_hash(const Claim *a) {
+    return a->hash;
 }
 
-u32 claim_hash(const Claim *a) {
-    return string_hash(a->pathname);
+/* the hash of the pathname of a child of the given claim */
+static u32 claim_child_hash(Claim *parent, char *name) {
+    u32 hash = parent->hash;
+    if (strcmp(parent->pathname, "/"))
+        hash = string_hash_continue(hash, "/");
+    return string_hash_continue(hash, name);
+}
+
+static void claim_set_pathname(Claim *claim, char *pathname) {
+    claim->pathname = pathname;
+    claim->hash = string_hash(pathname);
+    claim->name = intern_name(filename(pathname));
 }
 
 void claim_link_child(Claim *parent, Claim *child) {
     assert(child->parent == NULL);
-    parent->children =
-        insertinorder((Cmpfunc) claim_cmp, parent->children, child);
+
+    child->prevsibling = NULL;
+    child->nextsibling = parent->children;
+    if (parent->children != NULL)
+        parent->children->prevsibling = child;
+    parent->children = child;
     child->parent = parent;
+
+    /* index the children once a scan would be slow */
+    if (parent->childindex == NULL &&
+            ++parent->childcount >= CLAIM_CHILD_INDEX_MIN)
+    {
+        Claim *elt;
+        parent->childindex = hash_create(
+                CLAIM_CHILD_INDEX_MIN * 2,
+                (Hashfunc) string_hash,
+                (Cmpfunc) strcmp);
+        for (elt = parent->children; elt != NULL; elt = elt->nextsibling)
+            hash_set(parent->childindex, elt->name, elt);
+    } else if (parent->childindex != NULL) {
+        parent->childcount++;
+        hash_set(parent->childindex, child->name, child);
+    }
 }
 
 void claim_unlink_child(Claim *child) {
-    assert(child->parent != NULL);
-    child->parent->children =
-        removeinorder((Cmpfunc) claim_cmp, child->parent->children, child);
+    Claim *parent = child->parent;
+
+    assert(parent != NULL);
+
+    if (child->prevsibling == NULL)
+        parent->children = child->nextsibling;
+    else
+        child->prevsibling->nextsibling = child->nextsibling;
+    if (child->nextsibling != NULL)
+        child->nextsibling->prevsibling = child->prevsibling;
+    child->prevsibling = child->nextsibling = NULL;
     child->parent = NULL;
+
+    parent->childcount--;
+    if (parent->childindex != NULL) {
+        if (parent->children == NULL)
+            parent->childindex = NULL;
+        else
+            hash_remove(parent->childindex, child->name);
+    }
 }
 
 Claim *claim_new_root(char *pathname, enum claim_access access, u64 oid) {
@@ -59,12 +107,16 @@ Claim *claim_new_root(char *pathname, enum claim_access access, u64 oid) {
     claim->lease = NULL;
     claim->parent = NULL;
     claim->children = NULL;
+    claim->prevsibling = NULL;
+    claim->nextsibling = NULL;
+    claim->childcount = 0;
+    claim->childindex = NULL;
 
     claim->lastupdate = 0.0;
     claim->urgencycount = 0;
     claim->urgency = NULL;
 
-    claim->pathname = pathname;
+    claim_set_pathname(claim, pathname);
     claim->access = access;
     claim->oid = oid;
     claim->info = NULL;
@@ -84,12 +136,18 @@ Claim *claim_new(Claim *parent, char *name, enum claim_access access, u64 oid) {
 
     claim->lease = parent->lease;
     claim->children = NULL;
+    claim->prevsibling = NULL;
+    claim->nextsibling = NULL;
+    claim->childcount = 0;
+    claim->childindex = NULL;
 
     claim->lastupdate = 0.0;
     claim->urgencycount = 0;
     claim->urgency = NULL;
 
     claim->pathname = concatname(parent->pathname, name);
+    claim->hash = claim_child_hash(parent, name);
+    claim->name = intern_name(name);
     claim->access = access;
     claim->oid = oid;
     claim->info = NULL;
@@ -104,7 +162,7 @@ void claim_delete(Claim *claim) {
     List *fids;
 
     assert(claim->lock != NULL);
-    assert(null(claim->children));
+    assert(claim->children == NULL);
     assert(!claim->deleted);
     assert(claim->parent != NULL);
 
@@ -114,9 +172,13 @@ void claim_delete(Claim *claim) {
     claim->pathname = NULL;
     claim->deleted = 1;
 
+    mutex_lock(claim->lease->lock, LOCK_RANK_LEASE);
+    for (fids = claim->fids; !null(fids); fids = cdr(fids))
+        hash_remove(claim->lease->fids, car(fids));
+    mutex_unlock(claim->lease->lock, LOCK_RANK_LEASE);
+
     for (fids = claim->fids; !null(fids); fids = cdr(fids)) {
         Fid *fid = car(fids);
-        hash_remove(claim->lease->fids, fid);
         fid->pathname = NULL;
         fid_link_deleted(fid);
     }
@@ -125,7 +187,8 @@ void claim_delete(Claim *claim) {
 }
 
 void claim_clear_descendents(Claim *claim) {
-    List *allclaims = hash_tolist(claim->lease->claim_cache);
+    List *allclaims =
+        lease_table_list(claim->lease, claim->lease->claim_cache);
     char *prefix = claim->pathname;
 
     for ( ; !null(allclaims); allclaims = cdr(allclaims)) {
@@ -152,7 +215,7 @@ void claim_release(Claim *claim) {
 
     /* delete up the tree as far as we can */
     while (claim->lock == NULL && null(claim->fids) &&
-            null(claim->children) && claim->parent != NULL)
+            claim->children == NULL && claim->parent != NULL)
     {
         Claim *parent = claim->parent;
         claim_unlink_child(claim);
@@ -163,23 +226,55 @@ void claim_release(Claim *claim) {
 /*****************************************************************************/
 /* High-level functions */
 
+static Claim *claim_find_live_child(Claim *parent, char *atom) {
+    Claim *child;
+
+    if (parent->childindex != NULL)
+        return hash_get(parent->childindex, atom);
+
+    for (child = parent->children; child != NULL; child = child->nextsibling)
+        if (child->name == atom)
+            return child;
+
+    return NULL;
+}
+
+static Claim *claim_lookup_probe(Lease *lease, Claim *probe) {
+    Claim *claim;
+
+    mutex_lock(lease->lock, LOCK_RANK_LEASE);
+    claim = hash_get(lease->claim_cache, probe);
+    mutex_unlock(lease->lock, LOCK_RANK_LEASE);
+
+    if (claim != NULL)
+        assert(lru_get(claim_cache, probe) == claim);
+    return claim;
+}
+
 Claim *claim_get_child(Worker *worker, Claim *parent, char *name) {
-    char *targetpath = concatname(parent->pathname, name);
-    Claim *claim = NULL;
+    char *atom = name_atom_find(name);
+    struct claim probe;
+    Claim *claim;
 
-    if (lease_get_remote(targetpath) != NULL) {
-        /* the child isn't part of this lease */
-    } else if ((claim = findinorder((Cmpfunc) claim_key_cmp,
-                    parent->children, targetpath)) != NULL)
-    {
-        /* it's already on a live path */
-        reserve(worker, LOCK_CLAIM, claim);
+    /* anything on a live path is part of this lease, so check there before
+     * building the full pathname.  A name with no atom is not held by any
+     * claim, so it can't be a live child. */
+    if (atom != NULL && (claim = claim_find_live_child(parent, atom)) != NULL) {
+        reserve_wait(worker, LOCK_CLAIM, claim,
+                claim->parent == parent && !claim->deleted &&
+                claim->name == atom);
         return claim;
-    } else if ((claim = claim_lookup_from_cache(parent->lease,
-                    targetpath)) != NULL)
-    {
+    }
+
+    probe.pathname = concatname(parent->pathname, name);
+    probe.hash = claim_child_hash(parent, name);
+
+    if (lease_get_remote(probe.pathname) != NULL) {
+        /* the child isn't part of this lease */
+    } else if ((claim = claim_lookup_probe(parent->lease, &probe)) != NULL) {
         /* it's in the cache */
-        reserve(worker, LOCK_CLAIM, claim);
+        reserve_wait(worker, LOCK_CLAIM, claim,
+                claim_lookup_probe(parent->lease, &probe) == claim);
         claim_link_child(parent, claim);
     } else if ((claim = dir_find_claim(worker, parent, name)) != NULL) {
         /* found through a directory search */
@@ -196,8 +291,9 @@ Claim *claim_get_parent(Worker *worker, Claim *child) {
 
     /* is the parent within the same lease? */
     if (child->parent != NULL) {
-        reserve(worker, LOCK_CLAIM, child->parent);
-        return child->parent;
+        Claim *parent = child->parent;
+        reserve_wait(worker, LOCK_CLAIM, parent, child->parent == parent);
+        return parent;
     }
 
     return NULL;
@@ -219,7 +315,7 @@ Claim *claim_find(Worker *worker, char *targetname) {
     pathparts = splitpath(targetname + strlen(lease->pathname));
 
     claim = lease->claim;
-    reserve(worker, LOCK_CLAIM, claim);
+    reserve_wait(worker, LOCK_CLAIM, claim, lease->claim == claim);
 
     while (claim != NULL && !null(pathparts) &&
             strcmp(targetname, claim->pathname))
@@ -267,7 +363,7 @@ void claim_thaw(Worker *worker, Claim *claim) {
 
         if (child != NULL) {
             u64 oldoid = dir_change_oid(worker, claim,
-                    filename(child->pathname), child->oid, 0);
+                    child->name, child->oid, 0);
             assert(oldoid != NOOID);
         }
 
@@ -283,19 +379,24 @@ void claim_thaw(Worker *worker, Claim *claim) {
 void claim_add_to_cache(Claim *claim) {
     /* note: important to do the lru_add first, as it may contain a stale entry
      * and try to do a hash_remove when clearing it */
-    lru_add(claim_cache, claim->pathname, claim);
-    hash_set(claim->lease->claim_cache, claim->pathname, claim);
+    lru_add(claim_cache, claim, claim);
+
+    mutex_lock(claim->lease->lock, LOCK_RANK_LEASE);
+    hash_set(claim->lease->claim_cache, claim, claim);
+    mutex_unlock(claim->lease->lock, LOCK_RANK_LEASE);
 }
 
 void claim_remove_from_cache(Claim *claim) {
-    lru_remove(claim_cache, claim->pathname);
+    lru_remove(claim_cache, claim);
 }
 
 Claim *claim_lookup_from_cache(Lease *lease, char *pathname) {
-    Claim *claim = hash_get(lease->claim_cache, pathname);
-    if (claim != NULL)
-        assert(lru_get(claim_cache, pathname) == claim);
-    return claim;
+    struct claim probe;
+
+    probe.pathname = pathname;
+    probe.hash = string_hash(pathname);
+
+    return claim_lookup_probe(lease, &probe);
 }
 
 void claim_rename(Claim *claim, char *pathname) {
@@ -307,7 +408,7 @@ void claim_rename(Claim *claim, char *pathname) {
 
     /* change the name and update the cache index */
     claim_remove_from_cache(claim);
-    claim->pathname = pathname;
+    claim_set_pathname(claim, pathname);
     claim_add_to_cache(claim);
 
     /* update the fids */
@@ -320,15 +421,19 @@ void claim_rename(Claim *claim, char *pathname) {
         claim_link_child(parent, claim);
 
     if (claim->info != NULL)
-        claim->info->name = filename(pathname);
+        claim->info->name = claim->name;
 }
 
 static void claim_cache_cleanup(Claim *claim) {
-    hash_remove(claim->lease->claim_cache, claim->pathname);
+    Lease *lease = claim->lease;
+
+    mutex_lock(lease->lock, LOCK_RANK_LEASE);
+    hash_remove(lease->claim_cache, claim);
+    mutex_unlock(lease->lock, LOCK_RANK_LEASE);
 }
 
 static int claim_cache_resurrect(Claim *claim) {
-    return claim->parent != NULL || !null(claim->children) ||
+    return claim->parent != NULL || claim->children != NULL ||
         !strcmp(claim->pathname, claim->lease->pathname);
 }
 
@@ -430,8 +535,9 @@ Claim *claim_update_territory_move(Claim *claim, Connection *conn) {
 void claim_state_init(void) {
     claim_cache = lru_new(
             CLAIM_LRU_SIZE,
-            (Hashfunc) string_hash,
-            (Cmpfunc) strcmp,
+            claim_cache_policy,
+            (Hashfunc) claim_hash,
+            (Cmpfunc) claim_cmp,
             (int (*)(void *)) claim_cache_resurrect,
             (void (*)(void *)) claim_cache_cleanup);
 }
@@ -5,6 +5,7 @@
 #include "types.h"
 #include "9p.h"
 #include "list.h"
+#include "hashtable.h"
 #include "connection.h"
 #include "worker.h"
 #include "lru.h"
@@ -52,18 +53,27 @@ struct claim {
 
     /* the context */
     Lease *lease;
-    /* tree structure */
+    /* tree structure: the children are linked through their sibling
+     * pointers, and once there are enough of them they are also indexed by
+     * name */
     Claim *parent;
-    /* an ordered list of children */
-    List *children;
+    Claim *children;
+    Claim *prevsibling;
+    Claim *nextsibling;
+    int childcount;
+    Hashtable *childindex;
 
     /* who has been accessing this node (or its descendents) recently? */
     double lastupdate;
     int urgencycount;
     double *urgency;
 
-    /* the full system path of this object */
+    /* the full system path of this object and its last component, interned */
     char *pathname;
+    char *name;
+    /* the hash of pathname, which is built up from the parent's so lookups
+     * never rehash the whole path */
+    u32 hash;
     /* the level of access we have to this object */
     enum claim_access {
         ACCESS_WRITEABLE,
@@ -126,7 +136,6 @@ Claim *claim_lookup_from_cache(Lease *lease, char *pathname);
 void lease_flush_claim_cache(Lease *lease);
 
 int claim_cmp(const Claim *a, const Claim *b);
-int claim_key_cmp(const char *key, const Claim *elt);
 u32 claim_hash(const Claim *a);
 void claim_link_child(Claim *parent, Claim *child);
 void claim_unlink_child(Claim *child);
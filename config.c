@@ -5,6 +5,8 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
+#include <errno.h>
+#include <string.h>
 #include <getopt.h>
 #include "types.h"
 #include "9p.h"
@@ -12,11 +14,17 @@
 #include "connection.h"
 #include "util.h"
 #include "config.h"
+#include "lru.h"
 
 /* values that are configured at startup time */
 
 int GLOBAL_MAX_SIZE = 1024 * 32 + TSWRITE_DATA_OFFSET + STORAGE_SLUSH + 1;
 int PORT;
+int reactor_count = 1;
+int queue_max_messages = 256;
+int queue_max_bytes = 1024 * 1024;
+int disk_uring = 0;
+char *local_socket_dir;
 int isstorage;
 char *objectroot;
 Address *my_address;
@@ -31,6 +39,9 @@ double ter_idle = 5.0;
 double ter_maxtime = 120.0;
 double ter_mintime = 5.0;
 double ter_rate = 0.0;
+int claim_cache_policy = LRU_PLAIN;
+int walk_cache_policy = LRU_PLAIN;
+int dir_cache_policy = LRU_PLAIN;
 int DEBUG = 0;
 int DEBUG_VERBOSE = 0;
 int DEBUG_AUDIT = 0;
@@ -42,6 +53,35 @@ int DEBUG_PAYLOAD = 0;
 int DEBUG_TRANSFER = 0;
 u64 root_oid;
 
+/* local storage sockets go in a directory of each user's own by default */
+static char *default_socket_dir(void) {
+    char *dir = GC_MALLOC_ATOMIC(strlen(LOCAL_SOCKET_DIR_FORMAT) + 16);
+    assert(dir != NULL);
+    sprintf(dir, LOCAL_SOCKET_DIR_FORMAT, (int) geteuid());
+    return dir;
+}
+
+/* make sure the socket directory exists and only this user can change it,
+ * so a stale socket found there is safe to replace */
+static int prepare_socket_dir(void) {
+    struct stat info;
+
+    if (mkdir(local_socket_dir, 0700) < 0 && errno != EEXIST) {
+        fprintf(stderr, "Unable to create socket directory: %s\n",
+                local_socket_dir);
+        return -1;
+    }
+    if (lstat(local_socket_dir, &info) < 0 || !S_ISDIR(info.st_mode) ||
+            info.st_uid != geteuid() || (info.st_mode & 022) != 0)
+    {
+        fprintf(stderr, "Socket directory must be owned by this user and "
+                "not writable by others: %s\n", local_socket_dir);
+        return -1;
+    }
+
+    return 0;
+}
+
 void print_usage(void) {
     fprintf(stderr,
 "Usage: %s <opt>\n"
@@ -49,7 +89,10 @@ void print_usage(void) {
             (isstorage ? "storage" : "envoy"));
     if (isstorage) {
         fprintf(stderr,
-"    -r, --root=<PATH>          path to the root of the object store\n");
+"    -r, --root=<PATH>          path to the root of the object store\n"
+"    -u, --uring                experimental: submit object reads and\n"
+"                                 writes through io_uring when the kernel\n"
+"                                 supports it (off by default)\n");
     } else {
         fprintf(stderr,
 "    -r, --root=<ROOT>          connect to the root envoy instance\n"
@@ -58,6 +101,8 @@ void print_usage(void) {
 "                                 (default 0)\n"
 "    -s, --storage=<SERVERS>    connect to the comma-seperated list of\n"
 "                                 storage servers (default localhost:%d)\n"
+"                                 (name a server on this host as\n"
+"                                 local[:PORT] to bypass TCP)\n"
 "    -c, --cache=<PATH>         path to the root of the object cache\n"
 "    = = = = = = = = dynamic territory management = = = = = = = =\n"
 "    -a, --noauto               disable automatic territory management\n"
@@ -70,7 +115,11 @@ void print_usage(void) {
 "    -u, --idle=<OPS>           lowest rate to trigger a change (at maxtime)\n"
 "                                 (default %g)\n"
 "    -U, --urgent=<OPS>         rate to trigger a change fastest (at mintime)\n"
-"                                 (default %g)\n",
+"                                 (default %g)\n"
+"    -Q, --twoq=<CACHES>        use 2Q instead of plain LRU for:\n"
+"                                 c: claims\n"
+"                                 w: walk results\n"
+"                                 d: directory blocks\n",
             STORAGE_PORT,
             ter_halflife, ter_mintime, ter_maxtime, ter_idle, ter_urgent);
     }
@@ -79,12 +128,21 @@ void print_usage(void) {
 "                                 (default %s)\n"
 "    -p, --port=<PORT>          listen on the given port (default %d)\n"
 "    -m, --messagesize=<SIZE>   maximum message size (default %d)\n"
+"    -n, --iothreads=<COUNT>    number of I/O reactor threads (default %d)\n"
+"    -q, --queuelength=<COUNT>  messages queued for sending on a connection\n"
+"                                 before senders wait (default %d)\n"
+"    -b, --queuebytes=<BYTES>   bytes queued for sending on a connection\n"
+"                                 before senders wait (default %d)\n"
+"    -k, --sockets=<PATH>       directory holding the sockets of storage\n"
+"                                 servers on this host (default %s)\n"
 "    -d, --debug=<FLAGS>        debug options:\n"
 "                                 v: verbose debug output\n"
 "                                 d: data structure audits\n"
 "                                 s: message to/from storage servers\n",
             addr_to_dotted(my_address),
-            (isstorage ? STORAGE_PORT : ENVOY_PORT), GLOBAL_MAX_SIZE);
+            (isstorage ? STORAGE_PORT : ENVOY_PORT), GLOBAL_MAX_SIZE,
+            reactor_count, queue_max_messages, queue_max_bytes,
+            local_socket_dir);
     if (!isstorage) {
         fprintf(stderr,
 "                                 c: messages to/from clients\n"
@@ -109,10 +167,15 @@ int config_envoy(int argc, char **argv) {
         { "maxtime",    required_argument,      NULL,   'T' },
         { "idle",       required_argument,      NULL,   'u' },
         { "urgent",     required_argument,      NULL,   'U' },
+        { "twoq",       required_argument,      NULL,   'Q' },
         { "ip",         required_argument,      NULL,   'i' },
         { "port",       required_argument,      NULL,   'p' },
         { "debug",      required_argument,      NULL,   'd' },
         { "messagesize", required_argument,     NULL,   'm' },
+        { "iothreads",  required_argument,      NULL,   'n' },
+        { "queuelength", required_argument,     NULL,   'q' },
+        { "queuebytes", required_argument,      NULL,   'b' },
+        { "sockets",    required_argument,      NULL,   'k' },
         { 0,            0,                      0,      0   }
     };
 
@@ -127,6 +190,7 @@ int config_envoy(int argc, char **argv) {
     objectroot = NULL;
     PORT = ENVOY_PORT;
     my_address = get_my_address();
+    local_socket_dir = default_socket_dir();
     DEBUG_VERBOSE =
         DEBUG_AUDIT =
         DEBUG_STORAGE =
@@ -144,7 +208,7 @@ int config_envoy(int argc, char **argv) {
         int i;
         double d;
 
-        switch (getopt_long(argc, argv, "hr:s:c:al:t:T:u:U:i:p:d:m:",
+        switch (getopt_long(argc, argv, "hr:s:c:al:t:T:u:U:Q:i:p:d:m:n:q:b:k:",
                     long_options, NULL))
         {
             case EOF:
@@ -239,6 +303,19 @@ int config_envoy(int argc, char **argv) {
                     return -1;
                 }
                 break;
+            case 'Q':
+                for (i = 0; optarg[i]; i++) {
+                    switch (optarg[i]) {
+                        case 'c':       claim_cache_policy = LRU_2Q;    break;
+                        case 'w':       walk_cache_policy = LRU_2Q;     break;
+                        case 'd':       dir_cache_policy = LRU_2Q;      break;
+                        default:
+                            fprintf(stderr, "Unknown cache: %c\n",
+                                    optarg[i]);
+                            return -1;
+                    }
+                }
+                break;
             case 'i':
                 my_address = make_address(optarg, PORT);
                 if (my_address == NULL) {
@@ -268,6 +345,36 @@ int config_envoy(int argc, char **argv) {
                     return -1;
                 }
                 break;
+            case 'n':
+                i = strtol(optarg, &end, 10);
+                if (*end == 0 && i >= 1 && i <= MAX_REACTORS) {
+                    reactor_count = i;
+                } else {
+                    fprintf(stderr, "Invalid I/O thread count: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'q':
+                i = strtol(optarg, &end, 10);
+                if (*end == 0 && i >= 1 && i <= 0x10000) {
+                    queue_max_messages = i;
+                } else {
+                    fprintf(stderr, "Invalid queue length: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'b':
+                i = strtol(optarg, &end, 10);
+                if (*end == 0 && i >= BLOCK_SIZE && i <= 0x40000000) {
+                    queue_max_bytes = i;
+                } else {
+                    fprintf(stderr, "Invalid queue size: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'k':
+                local_socket_dir = optarg;
+                break;
             case 'd':
                 DEBUG = 1;
                 for (i = 0; optarg[i]; i++) {
@@ -341,6 +448,11 @@ int config_storage(int argc, char **argv) {
         { "port",       required_argument,      NULL,   'p' },
         { "debug",      required_argument,      NULL,   'd' },
         { "messagesize", required_argument,     NULL,   'm' },
+        { "iothreads",  required_argument,      NULL,   'n' },
+        { "queuelength", required_argument,     NULL,   'q' },
+        { "queuebytes", required_argument,      NULL,   'b' },
+        { "sockets",    required_argument,      NULL,   'k' },
+        { "uring",      no_argument,            NULL,   'u' },
         { NULL,         0,                      NULL,   0   }
     };
 
@@ -348,6 +460,7 @@ int config_storage(int argc, char **argv) {
     objectroot = NULL;
     PORT = STORAGE_PORT;
     my_address = get_my_address();
+    local_socket_dir = default_socket_dir();
     DEBUG_VERBOSE =
         DEBUG_STORAGE =
         DEBUG_PAYLOAD = 0;
@@ -358,7 +471,9 @@ int config_storage(int argc, char **argv) {
         char cwd[100];
         struct stat info;
 
-        switch (getopt_long(argc, argv, "hr:p:d:m:", long_options, NULL)) {
+        switch (getopt_long(argc, argv, "hr:p:d:m:n:q:b:k:u",
+                    long_options, NULL))
+        {
             case EOF:
                 finished = 1;
                 break;
@@ -401,6 +516,39 @@ int config_storage(int argc, char **argv) {
                     return -1;
                 }
                 break;
+            case 'n':
+                i = strtol(optarg, &end, 10);
+                if (*end == 0 && i >= 1 && i <= MAX_REACTORS) {
+                    reactor_count = i;
+                } else {
+                    fprintf(stderr, "Invalid I/O thread count: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'q':
+                i = strtol(optarg, &end, 10);
+                if (*end == 0 && i >= 1 && i <= 0x10000) {
+                    queue_max_messages = i;
+                } else {
+                    fprintf(stderr, "Invalid queue length: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'b':
+                i = strtol(optarg, &end, 10);
+                if (*end == 0 && i >= BLOCK_SIZE && i <= 0x40000000) {
+                    queue_max_bytes = i;
+                } else {
+                    fprintf(stderr, "Invalid queue size: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'k':
+                local_socket_dir = optarg;
+                break;
+            case 'u':
+                disk_uring = 1;
+                break;
             case 'd':
                 DEBUG = 1;
                 for (i = 0; optarg[i]; i++) {
@@ -434,6 +582,8 @@ int config_storage(int argc, char **argv) {
             return -1;
         }
     }
+    if (prepare_socket_dir() < 0)
+        return -1;
 
     return 0;
 }
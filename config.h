@@ -6,42 +6,74 @@
 #include "connection.h"
 
 #define CONN_HASHTABLE_SIZE 32
+#define HASH_MAX_LOAD_NUM 7
+#define HASH_MAX_LOAD_DEN 8
+#define HASH_MIGRATE_STEP 16
 #define CONN_VECTOR_SIZE 16
 #define CONN_STORAGE_LRU_SIZE 16
 #define TAG_VECTOR_SIZE 16
 #define FID_VECTOR_SIZE 128
 #define HANDLES_INITIAL_SIZE 32
+#define HANDLES_EVENT_BATCH 64
+#define TRANSPORT_RING_SIZE 16384
+#define TRANSPORT_WRITE_BATCH 16
+#define MAX_REACTORS 64
 #define THREAD_LIFETIME 16384
 #define OBJECTDIR_CACHE_SIZE_STORAGE 512
 #define OBJECTDIR_CACHE_SIZE_ENVOY 512
 #define FD_CACHE_SIZE_STORAGE 256
 #define FD_CACHE_SIZE_ENVOY 256
+#define DISK_URING_ENTRIES 64
 #define MAX_HOSTNAME 255
 #define LEASE_HASHTABLE_SIZE 64
 #define LEASE_FIDS_HASHTABLE_SIZE 128
 #define LEASE_CLAIM_HASHTABLE_SIZE 1024
 #define CLAIM_LRU_SIZE 1024
+#define CLAIM_CHILD_INDEX_MIN 16
 #define LEASE_DIR_HASHTABLE_SIZE 64
 #define LEASE_DIR_CACHE_SIZE 64
 #define WALK_CACHE_SIZE 1024
+#define LRU_2Q_PROBATION_PERCENT 25
+#define LRU_2Q_GHOST_PERCENT 50
 #define WORKER_READY_QUEUE_SIZE 16
+#define WORKER_THREAD_COUNT 16
+#define WORKER_THREAD_STACK_SIZE (1024 * 1024)
+#define WORKER_STACK_INITIAL_SIZE 4096
 #define FID_REMOTE_VECTOR_SIZE 256
 #define GROUP_HASHTABLE_SIZE 128
+#define NAME_HASHTABLE_SIZE 1024
 #define USER_HASHTABLE_SIZE 128
 #define OBJECT_CACHE_STATE_SIZE 16384
 #define DISPATCH_STREAM_WINDOW_SIZE 8
+#define ADMIT_MAX_ACTIVE 64
+#define ADMIT_QUANTUM 16
+#define POOL_MAX_FREE 1024
+#define RAW_CLASSES 3
+#define RAW_SMALL_SIZE 128
+#define RAW_BLOCK_SIZE (BLOCK_SIZE + RAW_SMALL_SIZE)
 #define EPSILON 0.00001
 
 #define ENVOY_PORT 9922
 #define STORAGE_PORT 9923
+#define LOCAL_SOCKET_DIR_FORMAT "/tmp/envoy-%d"
+#define LOCAL_SOCKET_FORMAT "%s/storage.%d"
+#define LOCAL_ADDRESS_NAME "local"
+#define LOCAL_PEER_NET 0x7fff0000
 
 #define BITS_PER_DIR_OBJECTS 6
 #define BITS_PER_DIR_DIRS 8
 #define BLOCK_SIZE 4096
+#define DIR_HASH_MIN_BLOCKS 4
+#define DIR_HASH_MAX_DEPTH 16
 
 extern int GLOBAL_MAX_SIZE;
-#define GLOBAL_MIN_SIZE (BLOCK_SIZE + TSWRITE_DATA_OFFSET + 8)
+#define GLOBAL_MIN_SIZE (BLOCK_SIZE + TSWRITE_DATA_OFFSET)
 extern int PORT;
+extern int reactor_count;
+extern int queue_max_messages;
+extern int queue_max_bytes;
+extern int disk_uring;
+extern char *local_socket_dir;
 
 extern Address *my_address;
 
@@ -71,6 +103,11 @@ extern double ter_mintime;
 extern double ter_maxtime;
 extern double ter_rate;
 
+/* replacement policy for each of the envoy's metadata caches */
+extern int claim_cache_policy;
+extern int walk_cache_policy;
+extern int dir_cache_policy;
+
 extern int DEBUG_CLIENT;
 extern int DEBUG_ENVOY;
 extern int DEBUG_ENVOY_ADMIN;
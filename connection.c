@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <pthread.h>
 #include <gc/gc.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -25,6 +26,10 @@ Hashtable *addr_2_envoy_out;
 Hashtable *addr_2_in;
 int envoycount;
 
+/* conn_vector and the address hashtables have their own mutex so reactors
+ * can add connections without taking the big lock */
+static pthread_mutex_t *conn_table_lock;
+
 Connection *conn_insert_new(int fd, enum conn_type type,
         struct sockaddr_in *netaddr)
 {
@@ -32,7 +37,6 @@ Connection *conn_insert_new(int fd, enum conn_type type,
 
     assert(fd >= 0);
     assert(netaddr != NULL);
-    assert(!vector_test(conn_vector, fd));
 
     conn = GC_NEW(Connection);
     assert(conn != NULL);
@@ -49,11 +53,29 @@ Connection *conn_insert_new(int fd, enum conn_type type,
     conn->fid_vector = vector_create(FID_VECTOR_SIZE);
     conn->tag_vector = vector_create(TAG_VECTOR_SIZE);
     conn->pending_writes = NULL;
+    conn->pending_writes_tail = NULL;
+    conn->control_writes = NULL;
+    conn->control_writes_tail = NULL;
+    conn->pending_writes_count = 0;
+    conn->pending_writes_bytes = 0;
+    conn->pending_writes_peak = 0;
+    conn->writable = cond_new();
+    conn->write_waiters = 0;
+    conn->read_paused = 0;
+    conn->admit_queue = NULL;
+    conn->admit_queue_tail = NULL;
+    conn->admit_queued = 0;
+    conn->admit_deficit = 0;
     conn->notag_trans = NULL;
     conn->partial_in = NULL;
     conn->partial_in_bytes = 0;
+    conn->ring = NULL;
+    conn->ring_start = 0;
+    conn->ring_end = 0;
     conn->partial_out = NULL;
+    conn->partial_out_count = 0;
     conn->partial_out_bytes = 0;
+    conn->reactor = NULL;
     conn->totalbytesin = 0;
     conn->totalbytesout = 0;
     conn->totalmessagesin = 0;
@@ -63,6 +85,8 @@ Connection *conn_insert_new(int fd, enum conn_type type,
     conn->prevmessagesin = 0;
     conn->prevmessagesout = 0;
 
+    mutex_lock(conn_table_lock, LOCK_RANK_CONN);
+    assert(!vector_test(conn_vector, fd));
     vector_set(conn_vector, conn->fd, conn);
     if (type == CONN_ENVOY_OUT) {
         assert(hash_get(addr_2_envoy_out, conn->addr) == NULL);
@@ -73,6 +97,9 @@ Connection *conn_insert_new(int fd, enum conn_type type,
         assert(hash_get(addr_2_in, conn->addr) == NULL);
         hash_set(addr_2_in, conn->addr, conn);
     }
+    mutex_unlock(conn_table_lock, LOCK_RANK_CONN);
+
+    transport_attach(conn);
 
     return conn;
 }
@@ -90,11 +117,29 @@ Connection *conn_insert_new_stub(Address *addr) {
     conn->fid_vector = vector_create(FID_VECTOR_SIZE);
     conn->tag_vector = NULL;
     conn->pending_writes = NULL;
+    conn->pending_writes_tail = NULL;
+    conn->control_writes = NULL;
+    conn->control_writes_tail = NULL;
+    conn->pending_writes_count = 0;
+    conn->pending_writes_bytes = 0;
+    conn->pending_writes_peak = 0;
+    conn->writable = cond_new();
+    conn->write_waiters = 0;
+    conn->read_paused = 0;
+    conn->admit_queue = NULL;
+    conn->admit_queue_tail = NULL;
+    conn->admit_queued = 0;
+    conn->admit_deficit = 0;
     conn->notag_trans = NULL;
     conn->partial_in = NULL;
     conn->partial_in_bytes = 0;
+    conn->ring = NULL;
+    conn->ring_start = 0;
+    conn->ring_end = 0;
     conn->partial_out = NULL;
+    conn->partial_out_count = 0;
     conn->partial_out_bytes = 0;
+    conn->reactor = NULL;
     conn->totalbytesin = 0;
     conn->totalbytesout = 0;
     conn->totalmessagesin = 0;
@@ -104,18 +149,23 @@ Connection *conn_insert_new_stub(Address *addr) {
     conn->prevmessagesin = 0;
     conn->prevmessagesout = 0;
 
+    mutex_lock(conn_table_lock, LOCK_RANK_CONN);
     hash_set(addr_2_in, addr, conn);
+    mutex_unlock(conn_table_lock, LOCK_RANK_CONN);
 
     return conn;
 }
 
 void conn_set_addr_envoy_in(Connection *conn, Address *addr) {
-    Connection *merge = hash_get(addr_2_in, addr);
+    Connection *merge;
 
     assert(conn->addr != NULL);
     assert(addr != NULL);
     assert(conn->type == CONN_ENVOY_IN);
 
+    mutex_lock(conn_table_lock, LOCK_RANK_CONN);
+    merge = hash_get(addr_2_in, addr);
+
     hash_remove(addr_2_in, conn->addr);
 
     if (merge != NULL) {
@@ -126,10 +176,17 @@ void conn_set_addr_envoy_in(Connection *conn, Address *addr) {
 
     conn->addr = addr;
     hash_set(addr_2_in, addr, conn);
+    mutex_unlock(conn_table_lock, LOCK_RANK_CONN);
 }
 
 Connection *conn_lookup_fd(int fd) {
-    return vector_get(conn_vector, fd);
+    Connection *conn;
+
+    mutex_lock(conn_table_lock, LOCK_RANK_CONN);
+    conn = vector_get(conn_vector, fd);
+    mutex_unlock(conn_table_lock, LOCK_RANK_CONN);
+
+    return conn;
 }
 
 Connection *conn_get_envoy_out(Worker *worker, Address *addr) {
@@ -139,7 +196,11 @@ Connection *conn_get_envoy_out(Worker *worker, Address *addr) {
     assert(addr != NULL);
     assert(addr_cmp(addr, my_address));
 
-    if ((conn = hash_get(addr_2_envoy_out, addr)) == NULL) {
+    mutex_lock(conn_table_lock, LOCK_RANK_CONN);
+    conn = hash_get(addr_2_envoy_out, addr);
+    mutex_unlock(conn_table_lock, LOCK_RANK_CONN);
+
+    if (conn == NULL) {
         int fd;
         struct sockaddr_in *netaddr = addr_to_netaddr(addr);
         if ((fd = open_connection(netaddr)) < 0)
@@ -158,7 +219,12 @@ Connection *conn_get_envoy_out(Worker *worker, Address *addr) {
 }
 
 Connection *conn_get_incoming(Address *addr) {
-    Connection *conn = hash_get(addr_2_in, addr);
+    Connection *conn;
+
+    mutex_lock(conn_table_lock, LOCK_RANK_CONN);
+    conn = hash_get(addr_2_in, addr);
+    mutex_unlock(conn_table_lock, LOCK_RANK_CONN);
+
     return conn;
 }
 
@@ -167,7 +233,11 @@ Connection *conn_connect_to_storage(Address *addr) {
     Connection *conn;
     int fd;
 
-    if ((fd = open_connection(netaddr)) < 0)
+    if (addr->local)
+        fd = open_local_connection(addr->port);
+    else
+        fd = open_connection(netaddr);
+    if (fd < 0)
         return NULL;
 
     conn = conn_insert_new(fd, CONN_STORAGE_OUT, netaddr);
@@ -180,32 +250,108 @@ Connection *conn_connect_to_storage(Address *addr) {
     return conn;
 }
 
+/* the payload a queued message will carry, which dominates the memory it
+ * pins; this is known before the message is packed */
+static u32 conn_message_bytes(Message *msg) {
+    switch (msg->id) {
+        case RREAD:     return msg->msg.rread.count;
+        case TWRITE:    return msg->msg.twrite.count;
+        case RSREAD:    return msg->msg.rsread.count;
+        case TSWRITE:   return msg->msg.tswrite.count;
+        default:        return 0;
+    }
+}
+
+/* envoy admin messages (lease grants, revokes, nominations and the like)
+ * go out ahead of client and storage traffic */
+int conn_is_control(Message *msg) {
+    return msg->id > RWSTAT && msg->id < TSRESERVE;
+}
+
+static Message *conn_queue_pop(List **head, List **tail) {
+    List *elt = *head;
+
+    if (null(elt))
+        return NULL;
+
+    *head = cdr(elt);
+    if (null(*head))
+        *tail = NULL;
+
+    return car(elt);
+}
+
+/* append in constant time by keeping track of the last cell */
+static void conn_queue_push(List **head, List **tail, Message *msg) {
+    List *elt = cons(msg, NULL);
+
+    if (null(*head))
+        *head = elt;
+    else
+        setcdr(*tail, elt);
+    *tail = elt;
+}
+
 Message *conn_get_pending_write(Connection *conn) {
-    Message *msg = NULL;
+    Message *msg;
 
     assert(conn != NULL);
 
-    if (!null(conn->pending_writes)) {
-        List *elt = conn->pending_writes;
-        msg = car(elt);
-        conn->pending_writes = cdr(elt);
+    /* drain the control lane first */
+    msg = conn_queue_pop(&conn->control_writes, &conn->control_writes_tail);
+    if (msg == NULL) {
+        msg = conn_queue_pop(&conn->pending_writes,
+                &conn->pending_writes_tail);
+    }
+
+    if (msg != NULL) {
+        conn->pending_writes_count--;
+        conn->pending_writes_bytes -= conn_message_bytes(msg);
     }
 
     return msg;
 }
 
 int conn_has_pending_write(Connection *conn) {
-    return conn->partial_out != NULL || !null(conn->pending_writes);
+    return conn->partial_out_count > 0 || !null(conn->pending_writes) ||
+        !null(conn->control_writes);
 }
 
 void conn_queue_write(Connection *conn, Message *msg) {
     assert(conn != NULL && msg != NULL);
 
-    conn->pending_writes = append_elt(conn->pending_writes, msg);
+    if (conn_is_control(msg)) {
+        conn_queue_push(&conn->control_writes, &conn->control_writes_tail,
+                msg);
+    } else {
+        conn_queue_push(&conn->pending_writes, &conn->pending_writes_tail,
+                msg);
+    }
+
+    conn->pending_writes_count++;
+    conn->pending_writes_bytes += conn_message_bytes(msg);
+    if (conn->pending_writes_count > conn->pending_writes_peak)
+        conn->pending_writes_peak = conn->pending_writes_count;
+}
+
+/* has the output queue reached either of its limits? */
+int conn_queue_full(Connection *conn) {
+    return conn->pending_writes_count >= queue_max_messages ||
+        conn->pending_writes_bytes >= queue_max_bytes;
+}
+
+/* has the output queue drained to half of both limits? */
+int conn_queue_drained(Connection *conn) {
+    return conn->pending_writes_count <= queue_max_messages / 2 &&
+        conn->pending_writes_bytes <= queue_max_bytes / 2;
 }
 
 void conn_remove(Connection *conn) {
     assert(conn != NULL);
+
+    transport_detach(conn);
+
+    mutex_lock(conn_table_lock, LOCK_RANK_CONN);
     assert(vector_test(conn_vector, conn->fd));
     if (conn->type == CONN_ENVOY_OUT) {
         assert(hash_get(addr_2_envoy_out, conn->addr) != NULL);
@@ -216,8 +362,15 @@ void conn_remove(Connection *conn) {
         assert(hash_get(addr_2_in, conn->addr) != NULL);
         hash_remove(addr_2_in, conn->addr);
     }
-
     vector_remove(conn_vector, conn->fd);
+    mutex_unlock(conn_table_lock, LOCK_RANK_CONN);
+}
+
+/* call f on every connection with the table locked */
+void conn_apply(void (*f)(void *, u32, void *), void *env) {
+    mutex_lock(conn_table_lock, LOCK_RANK_CONN);
+    vector_apply(conn_vector, f, env);
+    mutex_unlock(conn_table_lock, LOCK_RANK_CONN);
 }
 
 /*
@@ -239,6 +392,10 @@ void conn_close(Connection *conn) {
 }
 
 void conn_init(void) {
+    conn_table_lock = GC_NEW(pthread_mutex_t);
+    assert(conn_table_lock != NULL);
+    pthread_mutex_init(conn_table_lock, NULL);
+
     conn_vector = vector_create(CONN_VECTOR_SIZE);
     addr_2_envoy_out = hash_create(
             CONN_HASHTABLE_SIZE,
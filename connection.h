@@ -29,11 +29,41 @@ struct connection {
     Vector *fid_vector;
     Vector *tag_vector;
     List *pending_writes;
+    List *pending_writes_tail;
+    /* a second lane for envoy admin messages, which is always sent first */
+    List *control_writes;
+    List *control_writes_tail;
+    /* depth of both lanes in messages and payload bytes, and the deepest it
+     * has been */
+    u32 pending_writes_count;
+    u32 pending_writes_bytes;
+    u32 pending_writes_peak;
+    /* workers waiting for room in pending_writes, and whether reading
+     * requests from the connection is paused until it drains */
+    Cond *writable;
+    int write_waiters;
+    int read_paused;
+    /* client requests waiting for admission, and this connection's
+     * allowance in the current round */
+    List *admit_queue;
+    List *admit_queue_tail;
+    u32 admit_queued;
+    u32 admit_deficit;
     Transaction *notag_trans;
     Message *partial_in;
     int partial_in_bytes;
-    Message *partial_out;
+    /* receive ring: bytes ring_start..ring_end have arrived but have not
+     * yet been framed into messages */
+    u8 *ring;
+    int ring_start;
+    int ring_end;
+    /* messages packed and handed to the kernel but not yet fully sent, in
+     * order; partial_out_bytes counts what has gone out of the first one */
+    Message **partial_out;
+    int partial_out_count;
     int partial_out_bytes;
+    /* the I/O reactor that services this connection */
+    Reactor *reactor;
     u64 totalbytesin;
     u64 totalbytesout;
     u32 totalmessagesin;
@@ -47,6 +77,8 @@ struct connection {
 struct address {
     u32 ip;
     u16 port;
+    /* a server on this host, reached over a Unix-domain stream */
+    u8 local;
 };
 
 extern Vector *conn_vector;
@@ -63,7 +95,11 @@ Connection *conn_connect_to_storage(Address *addr);
 Message *conn_get_pending_write(Connection *conn);
 int conn_has_pending_write(Connection *conn);
 void conn_queue_write(Connection *conn, Message *msg);
+int conn_is_control(Message *msg);
+int conn_queue_full(Connection *conn);
+int conn_queue_drained(Connection *conn);
 void conn_remove(Connection *conn);
+void conn_apply(void (*f)(void *, u32, void *), void *env);
 void conn_init(void);
 
 #endif
@@ -18,6 +18,17 @@
 #include "claim.h"
 #include "lease.h"
 
+/* the vector width used to compare names in packed blocks */
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define DIR_SCAN_WIDTH 32
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define DIR_SCAN_WIDTH 16
+#else
+#define DIR_SCAN_WIDTH 1
+#endif
+
 int dir_block_cmp(const struct dir_block *a, const struct dir_block *b) {
     if (a->oid != b->oid)
         return a->oid - b->oid;
@@ -29,7 +40,9 @@ u32 dir_block_hash(const struct dir_block *block) {
             generic_hash(&block->blocknum, sizeof(u32), 0));
 }
 
-void dir_block_cache_set(Lease *lease, u64 oid, u32 blocknum, List *entries) {
+struct dir_block *dir_block_cache_set(Lease *lease, u64 oid, u32 blocknum,
+        List *entries)
+{
     struct dir_block *block = GC_NEW(struct dir_block);
     assert(block != NULL);
     assert(lease != NULL);
@@ -38,12 +51,20 @@ void dir_block_cache_set(Lease *lease, u64 oid, u32 blocknum, List *entries) {
     block->oid = oid;
     block->blocknum = blocknum;
     block->entries = entries;
+    block->header = NULL;
+    block->data = NULL;
+    block->count = 0;
 
     assert(null(entries) || car(entries) != NULL);
 
     /* note: the lru_add must come first because it may clear an old value */
     lru_add(dir_cache, block, block);
+
+    mutex_lock(lease->lock, LOCK_RANK_LEASE);
     hash_set(lease->dir_cache, block, block);
+    mutex_unlock(lease->lock, LOCK_RANK_LEASE);
+
+    return block;
 }
 
 struct dir_block *dir_block_cache_lookup(u64 oid, u32 blocknum) {
@@ -51,7 +72,10 @@ struct dir_block *dir_block_cache_lookup(u64 oid, u32 blocknum) {
         .lease = NULL,
         .oid = oid,
         .blocknum = blocknum,
-        .entries = NULL
+        .entries = NULL,
+        .header = NULL,
+        .data = NULL,
+        .count = 0
     };
 
     return lru_get(dir_cache, &block);
@@ -66,6 +90,35 @@ struct dir_block *dir_block_cache_lookup(u64 oid, u32 blocknum) {
  * u64: object id of this entry
  * u8: copy-on-write flag
  * string: u16 length, file name in utf-8, (not null terminated)
+ *
+ * A small directory is a linear run of these blocks and every operation
+ * scans them in order.  Once it has DIR_HASH_MIN_BLOCKS blocks, the next
+ * create converts it to a hashed directory (extendible hashing), where the
+ * first block is a header instead:
+ *
+ * u16: DIR_HASH_MAGIC, which is never a valid end-of-data offset
+ * u8: depth, the number of low bits of a name hash used to pick a bucket
+ * u16: number of blocks in use, including the header
+ * u16[]: the blocks holding the rest of the bucket table, one for every
+ *     DIR_HASH_TABLE_SLOTS slots past the first DIR_HASH_TABLE_SLOTS
+ * u16[]: the first DIR_HASH_TABLE_SLOTS (or all 1 << depth) slots of the
+ *     bucket table, each giving the block that holds the entries for one
+ *     hash suffix
+ *
+ * and each further table block is:
+ *
+ * u16: DIR_HASH_MAGIC
+ * u16[DIR_HASH_TABLE_SLOTS]: the next slots of the bucket table
+ *
+ * The buckets are ordinary entry blocks and the header and table blocks
+ * read as empty ones, so readers that walk every block (cloning, emptiness
+ * checks) need no changes.  Lookups read the header and one bucket.  A full
+ * bucket is split in two, doubling the table first if needed.  Block
+ * numbers are 16 bits, so a directory whose full bucket cannot be split
+ * (at DIR_HASH_MAX_DEPTH, or with no block numbers left) has no room for
+ * the entry; that takes millions of entries, or names chosen to collide.
+ * A header that does not parse reads as an empty block, so the directory is
+ * searched as a linear one until the next create rebuilds the header.
  */
 
 /* given a single block of directory data, return a list of entries */
@@ -145,48 +198,273 @@ static u32 dir_pack_entries(List *entries, u8 *data) {
     return (u32) i;
 }
 
-/* prime the claim cache for all the entries in the list */
-static void dir_prime_claim_cache(Worker *worker, Claim *dir, List *entries,
-        char *targetname)
-{
-    enum path_type type;
+/* the bucket hash of a name; it is stored implicitly on disk, so it must
+ * never change */
+static u32 dir_name_hash(char *name) {
+    u32 hash = 2166136261U;
 
-    if (emptystring(targetname))
-        return;
+    for ( ; *name; name++) {
+        hash ^= (u8) *name;
+        hash *= 16777619U;
+    }
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bU;
+    hash ^= hash >> 13;
+
+    return hash;
+}
 
-    type = get_admin_path_type(dir->pathname);
+/* the packed size of a list of entries */
+static u32 dir_entries_size(List *entries) {
+    u32 size = sizeof(u16);
 
     for ( ; !null(entries); entries = cdr(entries)) {
         struct direntry *elt = car(entries);
-        char *pathname;
-        enum claim_access access;
-        Claim *claim;
+        size += DIR_END_OFFSET + strlen(elt->filename);
+    }
 
-        if (strcmp(targetname, elt->filename))
-            continue;
+    return size;
+}
 
-        pathname = concatname(dir->pathname, elt->filename);
+static struct direntry *dir_entries_find(List *entries, char *name) {
+    for ( ; !null(entries); entries = cdr(entries)) {
+        struct direntry *elt = car(entries);
+        if (!strcmp(elt->filename, name))
+            return elt;
+    }
 
-        /* does this file exit the lease? */
-        if (lease_get_remote(pathname) != NULL)
-            continue;
+    return NULL;
+}
 
-        /* is it already in the cache? */
-        if ((claim = claim_lookup_from_cache(dir->lease, pathname)) != NULL) {
-            reserve(worker, LOCK_CLAIM, claim);
-            continue;
+/* does a packed block belong to a hash header (the header itself or one of
+ * its table blocks)? */
+static int dir_is_header_block(u32 count, u8 *data) {
+    return count >= sizeof(u16) &&
+        ((u32) data[0] | ((u32) data[1] << 8)) == DIR_HASH_MAGIC;
+}
+
+/* the number of blocks besides the header holding a bucket table */
+static u32 dir_hash_ntables(u32 depth) {
+    if ((1U << depth) <= DIR_HASH_TABLE_SLOTS)
+        return 0;
+    return (1U << depth) / DIR_HASH_TABLE_SLOTS - 1;
+}
+
+/* the number of bucket table slots held in the header itself */
+static u32 dir_hash_header_slots(u32 depth) {
+    if ((1U << depth) < DIR_HASH_TABLE_SLOTS)
+        return 1U << depth;
+    return DIR_HASH_TABLE_SLOTS;
+}
+
+/* unpack a run of bucket table slots, checking that each names a block */
+static int dir_unpack_slots(u8 *data, int size, int *offset,
+        struct dir_header *header, u32 first, u32 count)
+{
+    u32 i;
+
+    for (i = first; i < first + count; i++) {
+        header->buckets[i] = unpackU16(data, size, offset);
+        if (*offset < 0 || header->buckets[i] == 0 ||
+                header->buckets[i] >= header->nblocks)
+        {
+            return -1;
         }
+    }
+
+    return 0;
+}
+
+/* given the first block of a directory, return its hash header with the
+ * slots it holds itself, or NULL if it is not a valid one.  The rest of the
+ * table is read from the blocks in header->tables with dir_unpack_table. */
+static struct dir_header *dir_unpack_header(u32 count, u8 *data) {
+    int size = (int) count;
+    int offset = sizeof(u16);
+    struct dir_header *header;
+    u32 ntables;
+    u32 i;
+
+    if (!dir_is_header_block(count, data))
+        return NULL;
+
+    header = GC_NEW(struct dir_header);
+    assert(header != NULL);
+    header->depth = unpackU8(data, size, &offset);
+    header->nblocks = unpackU16(data, size, &offset);
+    if (offset < 0 || header->depth > DIR_HASH_MAX_DEPTH)
+        return NULL;
+
+    ntables = dir_hash_ntables(header->depth);
+    header->tables = NULL;
+    if (ntables > 0) {
+        header->tables = GC_MALLOC_ATOMIC(sizeof(u16) * ntables);
+        assert(header->tables != NULL);
+    }
+    for (i = 0; i < ntables; i++) {
+        header->tables[i] = unpackU16(data, size, &offset);
+        if (offset < 0 || header->tables[i] == 0 ||
+                header->tables[i] >= header->nblocks)
+        {
+            return NULL;
+        }
+    }
+
+    header->buckets = GC_MALLOC_ATOMIC(sizeof(u16) << header->depth);
+    assert(header->buckets != NULL);
+    if (dir_unpack_slots(data, size, &offset, header, 0,
+                dir_hash_header_slots(header->depth)) < 0)
+    {
+        return NULL;
+    }
+
+    return header;
+}
+
+/* fill in the slots held by table block n (counting from 0) of a header;
+ * returns -1 if the block is not a valid table block */
+static int dir_unpack_table(struct dir_header *header, u32 n,
+        u32 count, u8 *data)
+{
+    int offset = sizeof(u16);
+
+    if (!dir_is_header_block(count, data))
+        return -1;
+
+    return dir_unpack_slots(data, (int) count, &offset, header,
+            (n + 1) * DIR_HASH_TABLE_SLOTS, DIR_HASH_TABLE_SLOTS);
+}
+
+static u32 dir_pack_header(struct dir_header *header, u8 *data) {
+    u32 ntables = dir_hash_ntables(header->depth);
+    int i = 0;
+    u32 j;
+
+    packU16(data, &i, DIR_HASH_MAGIC);
+    packU8(data, &i, header->depth);
+    packU16(data, &i, header->nblocks);
+    for (j = 0; j < ntables; j++)
+        packU16(data, &i, header->tables[j]);
+    for (j = 0; j < dir_hash_header_slots(header->depth); j++)
+        packU16(data, &i, header->buckets[j]);
+
+    return (u32) i;
+}
+
+/* pack table block n (counting from 0) of a header */
+static u32 dir_pack_table(struct dir_header *header, u32 n, u8 *data) {
+    u16 *slots = header->buckets + (n + 1) * DIR_HASH_TABLE_SLOTS;
+    int i = 0;
+    u32 j;
+
+    packU16(data, &i, DIR_HASH_MAGIC);
+    for (j = 0; j < DIR_HASH_TABLE_SLOTS; j++)
+        packU16(data, &i, slots[j]);
 
-        /* create a new claim and add it to the cache */
-        access = fid_access_child(dir->access, elt->cow);
-        if (type == PATH_ADMIN && ispositiveint(elt->filename))
-            access = ACCESS_READONLY;
+    return (u32) i;
+}
+
+/* a name to search for in packed blocks, with its length worked out once */
+struct dir_key {
+    char *name;
+    u32 len;
+};
+
+/* a bitmap of which of the next DIR_SCAN_WIDTH bytes match */
+static inline u32 dir_scan_match(u8 *a, u8 *b) {
+#if defined(__AVX2__)
+    return (u32) _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+                _mm256_loadu_si256((__m256i *) a),
+                _mm256_loadu_si256((__m256i *) b)));
+#elif defined(__SSE2__)
+    return (u32) _mm_movemask_epi8(_mm_cmpeq_epi8(
+                _mm_loadu_si128((__m128i *) a),
+                _mm_loadu_si128((__m128i *) b)));
+#else
+    return *a == *b;
+#endif
+}
+
+/* compare a packed name against the key, whose length has already been
+ * matched.  Whole vectors are compared while both names have that many bytes
+ * left, and the rest byte by byte, so nothing is read past either end. */
+static int dir_name_equal(u8 *name, struct dir_key *key) {
+    u32 full = ~0U >> (32 - DIR_SCAN_WIDTH);
+    u8 *bytes = (u8 *) key->name;
+    u32 i;
+
+    for (i = 0; i + DIR_SCAN_WIDTH <= key->len; i += DIR_SCAN_WIDTH)
+        if (dir_scan_match(name + i, bytes + i) != full)
+            return 0;
+
+    return !memcmp(name + i, bytes + i, key->len - i);
+}
+
+/* search a packed block in place, without decoding it; returns the offset
+ * of the matching entry or -1 */
+static int dir_scan_block(u32 count, u8 *data, struct dir_key *key) {
+    u32 offset = sizeof(u16);
+    u32 end;
+
+    if (count < sizeof(u16))
+        return -1;
+
+    end = (u32) data[0] | ((u32) data[1] << 8);
+    if (end > count)
+        return -1;
+
+    while (offset + DIR_END_OFFSET <= end) {
+        u8 *entry = data + offset;
+
+        /* the CoW flag is the high bit of the name length */
+        u32 len = (u32) (entry[DIR_COW_OFFSET] & 0x7f) |
+            ((u32) entry[DIR_COW_OFFSET + 1] << 8);
 
-        /* create the entry, but don't hold onto it */
-        claim = claim_new(dir, elt->filename, access, elt->oid);
+        if (offset + DIR_END_OFFSET + len > end)
+            return -1;
+        if (len == key->len && dir_name_equal(entry + DIR_END_OFFSET, key))
+            return (int) offset;
 
-        reserve(worker, LOCK_CLAIM, claim);
+        offset += DIR_END_OFFSET + len;
     }
+
+    return -1;
+}
+
+/* prime the claim cache with a single directory entry, given its full
+ * pathname; returns the reserved claim, or NULL if the entry exits the
+ * lease */
+static Claim *dir_prime_claim(Worker *worker, Claim *dir, char *name,
+        char *pathname, u64 oid, u8 cow)
+{
+    enum claim_access access;
+    Claim *claim;
+
+    /* does this file exit the lease? */
+    if (lease_get_remote(pathname) != NULL)
+        return NULL;
+
+    /* is it already in the cache? */
+    if ((claim = claim_lookup_from_cache(dir->lease, pathname)) != NULL) {
+        reserve_wait(worker, LOCK_CLAIM, claim,
+                claim_lookup_from_cache(dir->lease, pathname) == claim);
+        return claim;
+    }
+
+    /* create a new claim and add it to the cache */
+    access = fid_access_child(dir->access, cow);
+    if (get_admin_path_type(dir->pathname) == PATH_ADMIN &&
+            ispositiveint(name))
+    {
+        access = ACCESS_READONLY;
+    }
+
+    /* create the entry, but don't hold onto it */
+    claim = claim_new(dir, name, access, oid);
+
+    reserve(worker, LOCK_CLAIM, claim);
+
+    return claim;
 }
 
 /* prepare a directory block for a clone by setting all copy-on-write flags */
@@ -200,6 +478,249 @@ void dir_clone(u32 count, u8 *data) {
     }
 }
 
+/* get a block of a directory from the cache, or read it and cache it
+ * packed; it is only decoded once something needs its entries */
+static struct dir_block *dir_fetch_block(Worker *worker, Claim *claim,
+        u32 num)
+{
+    struct dir_block *elt = dir_block_cache_lookup(claim->oid, num);
+    u32 count;
+    u8 *data;
+    u8 *copy;
+    void *raw;
+
+    if (elt != NULL)
+        return elt;
+
+    raw = object_read(worker, claim->oid, now(),
+            (u64) num * BLOCK_SIZE, BLOCK_SIZE, &count, &data);
+    assert(data != NULL);
+
+    copy = GC_MALLOC_ATOMIC(count);
+    assert(copy != NULL);
+    memcpy(copy, data, count);
+    raw_delete(raw);
+
+    elt = dir_block_cache_set(claim->lease, claim->oid, num, NULL);
+    elt->data = copy;
+    elt->count = count;
+
+    return elt;
+}
+
+/* get a block of a directory with its entries decoded.  The blocks of a
+ * hash header have no entries and stay packed until dir_get_header reads
+ * them. */
+static struct dir_block *dir_get_block(Worker *worker, Claim *claim, u32 num) {
+    struct dir_block *elt = dir_fetch_block(worker, claim, num);
+
+    if (elt->data != NULL && !dir_is_header_block(elt->count, elt->data)) {
+        elt->entries = dir_unpack_entries(elt->count, elt->data);
+        elt->data = NULL;
+    }
+
+    return elt;
+}
+
+/* write a packed block, extending the directory first if it would leave a
+ * gap; length tracks the size of the directory */
+static void dir_write_block(Worker *worker, Claim *claim, u64 *length,
+        u32 num, void *raw, u32 count)
+{
+    u64 offset = (u64) BLOCK_SIZE * num;
+
+    /* make sure the directory has room for the block */
+    if (offset > *length) {
+        /* extend the block */
+        struct p9stat *delta = p9stat_new();
+        delta->length = offset + count;
+        object_wstat(worker, claim->oid, delta);
+    }
+
+    /* write the block */
+    assert(object_write(worker, claim->oid, now(),
+                offset, count, raw, raw) == count);
+    if (offset + count > *length)
+        *length = offset + count;
+    claim->info = NULL;
+}
+
+static void dir_write_entries(Worker *worker, Claim *claim, u64 *length,
+        u32 num, List *entries)
+{
+    void *raw = raw_new_size(BLOCK_SIZE);
+    u32 count = dir_pack_entries(entries, raw);
+
+    dir_block_cache_set(claim->lease, claim->oid, num, entries);
+    dir_write_block(worker, claim, length, num, raw, count);
+}
+
+/* write a hash header, after whichever of its table blocks differ from the
+ * old header's (all of them if there is no old header) */
+static void dir_write_header(Worker *worker, Claim *claim, u64 *length,
+        struct dir_header *header, struct dir_header *old)
+{
+    u32 ntables = dir_hash_ntables(header->depth);
+    void *raw;
+    u32 count;
+    u32 n;
+
+    for (n = 0; n < ntables; n++) {
+        u32 first = (n + 1) * DIR_HASH_TABLE_SLOTS;
+        struct dir_block *elt;
+
+        if (old != NULL && n < dir_hash_ntables(old->depth) &&
+                !memcmp(header->buckets + first, old->buckets + first,
+                    sizeof(u16) * DIR_HASH_TABLE_SLOTS))
+        {
+            continue;
+        }
+
+        raw = raw_new_size(BLOCK_SIZE);
+        count = dir_pack_table(header, n, raw);
+
+        /* table blocks are cached packed, the way dir_get_header reads them */
+        elt = dir_block_cache_set(claim->lease, claim->oid, header->tables[n],
+                NULL);
+        elt->data = GC_MALLOC_ATOMIC(count);
+        assert(elt->data != NULL);
+        memcpy(elt->data, raw, count);
+        elt->count = count;
+
+        dir_write_block(worker, claim, length, header->tables[n], raw, count);
+    }
+
+    raw = raw_new_size(BLOCK_SIZE);
+    count = dir_pack_header(header, raw);
+
+    dir_block_cache_set(claim->lease, claim->oid, 0, NULL)->header = header;
+    dir_write_block(worker, claim, length, 0, raw, count);
+}
+
+/* returns the header of a hashed directory with its whole bucket table, or
+ * NULL for a linear one */
+static struct dir_header *dir_get_header(Worker *worker, Claim *claim) {
+    struct dir_block *elt;
+    struct dir_header *header;
+    u32 n;
+
+    if (claim->info == NULL)
+        claim->info = object_stat(worker, claim->oid, claim->name);
+    if (claim->info->length == 0)
+        return NULL;
+
+    elt = dir_fetch_block(worker, claim, 0);
+    if (elt->header != NULL || elt->data == NULL)
+        return elt->header;
+
+    header = dir_unpack_header(elt->count, elt->data);
+    for (n = 0; header != NULL && n < dir_hash_ntables(header->depth); n++) {
+        struct dir_block *table =
+            dir_fetch_block(worker, claim, header->tables[n]);
+
+        if (table->data == NULL ||
+                dir_unpack_table(header, n, table->count, table->data) < 0)
+        {
+            header = NULL;
+        }
+    }
+
+    /* a header that does not parse is left packed, so it reads as empty */
+    if (header != NULL) {
+        elt->header = header;
+        elt->data = NULL;
+    }
+
+    return header;
+}
+
+/* readdir returns entries in order of their name hash with the bits
+ * reversed, then by name.  Each bucket of a hashed directory then covers a
+ * single range of these keys, and since buckets only ever split, a position
+ * kept as the start of the next range is still valid after the directory
+ * splits a bucket or changes format between reads. */
+static u32 dir_reverse_bits(u32 x) {
+    u32 res = 0;
+    int i;
+
+    for (i = 0; i < 32; i++) {
+        res = (res << 1) | (x & 1);
+        x >>= 1;
+    }
+
+    return res;
+}
+
+struct dir_read_key {
+    u64 key;
+    struct direntry *elt;
+};
+
+static int dir_read_key_cmp(const void *a, const void *b) {
+    const struct dir_read_key *x = a;
+    const struct dir_read_key *y = b;
+
+    if (x->key != y->key)
+        return x->key < y->key ? -1 : 1;
+    return strcmp(x->elt->filename, y->elt->filename);
+}
+
+/* read the entries in the range of keys beginning at start, in key order.
+ * For a linear directory this is everything left; for a hashed one it is
+ * the bucket that start falls in.  Returns the start of the next range. */
+static u64 dir_read_range(Worker *worker, Claim *claim,
+        struct p9stat *dirinfo, u64 start, List **entries)
+{
+    struct dir_header *header = dir_get_header(worker, claim);
+    struct dir_read_key *keys;
+    List *elts = NULL;
+    u64 end = DIR_READ_END;
+    int count = 0;
+    int i;
+
+    if (header == NULL) {
+        u32 num;
+        for (num = 0; (u64) num * BLOCK_SIZE < dirinfo->length; num++) {
+            List *block = dir_get_block(worker, claim, num)->entries;
+            for ( ; !null(block); block = cdr(block))
+                elts = cons(car(block), elts);
+        }
+    } else {
+        u32 mask = (1 << header->depth) - 1;
+        u32 slot = dir_reverse_bits((u32) start) & mask;
+        u16 bucket = header->buckets[slot];
+        int depth;
+
+        /* the bucket's own depth is one more than the highest slot bit that
+         * leads to a different bucket */
+        for (depth = header->depth; depth > 0; depth--)
+            if (header->buckets[slot ^ (1 << (depth - 1))] != bucket)
+                break;
+
+        end = (start | ((DIR_READ_END >> depth) - 1)) + 1;
+        elts = dir_get_block(worker, claim, bucket)->entries;
+    }
+
+    keys = GC_MALLOC(sizeof(struct dir_read_key) * (length(elts) + 1));
+    assert(keys != NULL);
+    for ( ; !null(elts); elts = cdr(elts)) {
+        struct direntry *elt = car(elts);
+        u64 key = dir_reverse_bits(dir_name_hash(elt->filename));
+        if (key >= start) {
+            keys[count].key = key;
+            keys[count].elt = elt;
+            count++;
+        }
+    }
+    qsort(keys, count, sizeof(struct dir_read_key), dir_read_key_cmp);
+
+    *entries = NULL;
+    for (i = count - 1; i >= 0; i--)
+        *entries = cons(keys[i].elt, *entries);
+
+    return end;
+}
+
 static struct p9stat *dir_read_next(Worker *worker, Fid *fid,
         struct p9stat *dirinfo, struct dir_read_env *env)
 {
@@ -214,36 +735,14 @@ static struct p9stat *dir_read_next(Worker *worker, Fid *fid,
         return res;
     }
 
-    /* do we need to read a new block?  loop because blocks can be empty */
+    /* do we need to read a new range?  loop because ranges can be empty */
     while (null(env->entries)) {
-        u32 bytesread;
-        u8 *block;
-        void *raw;
-        struct dir_block *elt;
-
-        /* have we already read the last block? */
-        if (env->offset >= dirinfo->length)
+        /* have we already read the last range? */
+        if (env->start >= DIR_READ_END)
             return NULL;
 
-        /* read a block */
-        elt = dir_block_cache_lookup(fid->claim->oid, env->offset / BLOCK_SIZE);
-        if (elt == NULL) {
-            /* read a block and decode the entries */
-            raw = object_read(worker, fid->claim->oid, now(),
-                    env->offset, BLOCK_SIZE, &bytesread, &block);
-            env->entries = dir_unpack_entries(bytesread, block);
-            dir_block_cache_set(fid->claim->lease, fid->claim->oid,
-                    env->offset / BLOCK_SIZE, env->entries);
-            raw_delete(raw);
-        } else {
-            /* get the decoded entries from the cache */
-            env->entries = elt->entries;
-        }
-
-        env->offset += BLOCK_SIZE;
-
-        /* cache these entries */
-        /*dir_prime_claim_cache(worker, fid->claim, env->entries, NULL);*/
+        env->start = dir_read_range(worker, fid->claim, dirinfo, env->start,
+                &env->entries);
     }
 
     /* get stats for the next entry */
@@ -258,12 +757,12 @@ static struct p9stat *dir_read_next(Worker *worker, Fid *fid,
 
         /* make sure this can be found in cache, otherwise we get attempts
          * to search the directory and deadlock results */
-        dir_prime_claim_cache(worker, fid->claim, cons(elt, NULL),
-                elt->filename);
+        dir_prime_claim(worker, fid->claim, elt->filename, childpath,
+                elt->oid, elt->cow);
         claim = claim_get_child(worker, fid->claim, elt->filename);
 
         if (claim->info == NULL)
-            claim->info = object_stat(worker, claim->oid, elt->filename);
+            claim->info = object_stat(worker, claim->oid, claim->name);
         info = claim->info;
 
         /* we don't want to hold locks on a bunch of claims */
@@ -283,7 +782,7 @@ u32 dir_read(Worker *worker, Fid *fid, u32 size, u8 *data) {
 
     if (fid->claim->info == NULL) {
         fid->claim->info =
-            object_stat(worker, fid->claim->oid, filename(fid->pathname));
+            object_stat(worker, fid->claim->oid, fid->claim->name);
     }
     dirinfo = fid->claim->info;
 
@@ -293,7 +792,7 @@ u32 dir_read(Worker *worker, Fid *fid, u32 size, u8 *data) {
         assert(fid->readdir_env != NULL);
 
         fid->readdir_env->next = NULL;
-        fid->readdir_env->offset = 0;
+        fid->readdir_env->start = 0;
         fid->readdir_env->entries = NULL;
 
         /* do we need to catch up (after a fid migration)? */
@@ -336,7 +835,7 @@ enum dir_iter_action {
     DIR_CONTINUE,
 };
 
-static int dir_iter(Worker *worker, Claim *claim, char *targetname,
+static int dir_iter(Worker *worker, Claim *claim,
         enum dir_iter_action (f)(void *env, List *in, List **out, int extra),
         void *env)
 {
@@ -344,41 +843,26 @@ static int dir_iter(Worker *worker, Claim *claim, char *targetname,
     List *changes = NULL;
     int stop = 0;
     struct p9stat *dirinfo;
+    u64 length;
 
     if (claim->info == NULL) {
         claim->info =
-            object_stat(worker, claim->oid, filename(claim->pathname));
+            object_stat(worker, claim->oid, claim->name);
     }
     dirinfo = claim->info;
 
     for (num = 0; !stop; num++) {
-        u32 count;
-        u8 *data;
         List *pre = NULL;
         List *post = (List *) 1;
-        void *raw;
 
         if ((u64) num * BLOCK_SIZE >= dirinfo->length) {
             /* we're past the end of the directory */
             stop = 1;
         } else {
             /* read a block */
-            struct dir_block *elt = dir_block_cache_lookup(claim->oid, num);
-            if (elt == NULL) {
-                raw = object_read(worker, claim->oid, now(),
-                        (u64) num * BLOCK_SIZE, BLOCK_SIZE, &count, &data);
-                assert(data != NULL);
-                pre = dir_unpack_entries(count, data);
-                dir_block_cache_set(claim->lease, claim->oid, num, pre);
-                raw_delete(raw);
-            } else {
-                pre = elt->entries;
-            }
+            pre = dir_get_block(worker, claim, num)->entries;
         }
 
-        /* add target entry (if any) to the claim cache */
-        dir_prime_claim_cache(worker, claim, pre, targetname);
-
         /* process the files in this block */
         switch (f(env, pre, &post, stop)) {
             case DIR_ABORT:
@@ -397,33 +881,225 @@ static int dir_iter(Worker *worker, Claim *claim, char *targetname,
     }
 
     /* make any requested changes */
+    length = dirinfo->length;
     for ( ; !null(changes); changes = cdr(changes)) {
         int num = (int) caar(changes);
-        List *entries = cdar(changes);
-        void *raw = raw_new();
-        u8 *data = raw + TSWRITE_DATA_OFFSET;
-        u32 count;
-        u64 offset;
-
-        count = dir_pack_entries(entries, data);
-        dir_block_cache_set(claim->lease, claim->oid, num, entries);
-
-        /* make sure the directory has room for the block */
-        offset = BLOCK_SIZE * num;
-        if (offset > dirinfo->length) {
-            /* extend the block */
-            struct p9stat *delta = p9stat_new();
-            delta->length = offset + count;
-            object_wstat(worker, claim->oid, delta);
+        dir_write_entries(worker, claim, &length, num, cdar(changes));
+    }
+
+    return 0;
+}
+
+/*
+ * Hashed directories
+ */
+
+/* the block holding a name in a hashed directory */
+static u32 dir_hash_blocknum(struct dir_header *header, char *name) {
+    return header->buckets[dir_name_hash(name) & ((1 << header->depth) - 1)];
+}
+
+static struct dir_block *dir_hash_bucket(Worker *worker, Claim *claim,
+        struct dir_header *header, char *name)
+{
+    return dir_get_block(worker, claim, dir_hash_blocknum(header, name));
+}
+
+/* cut the directory back to the given length */
+static void dir_truncate(Worker *worker, Claim *claim, u64 *length,
+        u64 newlength)
+{
+    struct p9stat *delta;
+
+    if (*length <= newlength)
+        return;
+
+    delta = p9stat_new();
+    delta->length = *length = newlength;
+    object_wstat(worker, claim->oid, delta);
+    claim->info = NULL;
+}
+
+/* split the bucket holding the given name into two, doubling the bucket
+ * table if only one slot points to it.  The new table is built in a copy
+ * and installed after both buckets are written.  Returns the new header,
+ * or NULL (changing nothing) if the bucket cannot be split. */
+static struct dir_header *dir_hash_split(Worker *worker, Claim *claim,
+        u64 *length, struct dir_header *header, char *name)
+{
+    u32 index = dir_name_hash(name) & ((1 << header->depth) - 1);
+    u16 old = header->buckets[index];
+    List *entries = dir_get_block(worker, claim, old)->entries;
+    List *stay = NULL;
+    List *move = NULL;
+    struct dir_header *next;
+    u32 ntables, grow;
+    u16 new;
+    u32 bit;
+    int slots = 0;
+    int i;
+
+    /* the local depth of the bucket follows from how many slots share it */
+    for (i = 0; i < (1 << header->depth); i++)
+        if (header->buckets[i] == old)
+            slots++;
+    for (bit = 1 << header->depth; slots > 1; slots >>= 1)
+        bit >>= 1;
+
+    if (bit == 1 << header->depth && header->depth == DIR_HASH_MAX_DEPTH)
+        return NULL;
+
+    /* doubling the table may take more table blocks as well as the new
+     * bucket */
+    ntables = dir_hash_ntables(header->depth);
+    grow = bit == 1 << header->depth ?
+        dir_hash_ntables(header->depth + 1) - ntables : 0;
+    if (header->nblocks + 1 + grow > 0xffff)
+        return NULL;
+
+    new = header->nblocks;
+    next = GC_NEW(struct dir_header);
+    assert(next != NULL);
+    next->depth = header->depth + (bit == 1 << header->depth ? 1 : 0);
+    next->nblocks = header->nblocks + 1 + grow;
+    next->buckets = GC_MALLOC_ATOMIC(sizeof(u16) << next->depth);
+    assert(next->buckets != NULL);
+    for (i = 0; i < (1 << next->depth); i++) {
+        next->buckets[i] = header->buckets[i & ((1 << header->depth) - 1)];
+        if (next->buckets[i] == old && (i & bit))
+            next->buckets[i] = new;
+    }
+    next->tables = header->tables;
+    if (grow > 0) {
+        next->tables = GC_MALLOC_ATOMIC(sizeof(u16) * (ntables + grow));
+        assert(next->tables != NULL);
+        for (i = 0; i < ntables + grow; i++)
+            next->tables[i] = i < ntables ? header->tables[i] : new + 1 + i -
+                ntables;
+    }
+
+    for ( ; !null(entries); entries = cdr(entries)) {
+        struct direntry *elt = car(entries);
+        if (dir_name_hash(elt->filename) & bit)
+            move = cons(elt, move);
+        else
+            stay = cons(elt, stay);
+    }
+
+    dir_write_entries(worker, claim, length, new, move);
+    dir_write_entries(worker, claim, length, old, stay);
+    dir_write_header(worker, claim, length, next, header);
+
+    return next;
+}
+
+/* add an entry known not to exist yet, splitting buckets as needed.
+ * Returns -1 (changing nothing) if the entry's bucket is full and cannot be
+ * split any further. */
+static int dir_hash_insert(Worker *worker, Claim *claim, u64 *length,
+        struct dir_header *header, struct direntry *newentry)
+{
+    u32 size = DIR_END_OFFSET + strlen(newentry->filename);
+
+    for (;;) {
+        struct dir_block *block =
+            dir_hash_bucket(worker, claim, header, newentry->filename);
+
+        if (dir_entries_size(block->entries) + size <= BLOCK_SIZE) {
+            dir_write_entries(worker, claim, length, block->blocknum,
+                    cons(newentry, block->entries));
+            return 0;
         }
 
-        /* write the block */
-        assert(object_write(worker, claim->oid, now(),
-                    offset, count, data, raw) == count);
-        claim->info = NULL;
+        header = dir_hash_split(worker, claim, length, header,
+                newentry->filename);
+        if (header == NULL)
+            return -1;
     }
+}
 
-    return 0;
+/* rewrite a linear directory in hashed form.  Returns the new header, or
+ * NULL (leaving the directory alone) if the entries will not fit. */
+static struct dir_header *dir_hash_convert(Worker *worker, Claim *claim,
+        u64 *length)
+{
+    u32 nblocks = (*length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    struct dir_header *header;
+    List *entries = NULL;
+    List *elts;
+    List **buckets;
+    u32 *sizes;
+    u32 ntables;
+    u32 num;
+    int depth;
+    int i;
+
+    for (num = 0; num < nblocks; num++) {
+        List *block = dir_get_block(worker, claim, num)->entries;
+        for ( ; !null(block); block = cdr(block))
+            entries = cons(car(block), entries);
+    }
+
+    /* start with about half-full buckets and deepen until everything fits */
+    for (depth = 0; (1U << depth) < nblocks * 2; depth++)
+        ;
+    for ( ; depth <= DIR_HASH_MAX_DEPTH; depth++) {
+        int full = 0;
+
+        buckets = GC_MALLOC(sizeof(List *) << depth);
+        assert(buckets != NULL);
+        sizes = GC_MALLOC_ATOMIC(sizeof(u32) << depth);
+        assert(sizes != NULL);
+        for (i = 0; i < (1 << depth); i++) {
+            buckets[i] = NULL;
+            sizes[i] = sizeof(u16);
+        }
+
+        for (elts = entries; !null(elts) && !full; elts = cdr(elts)) {
+            struct direntry *elt = car(elts);
+            i = dir_name_hash(elt->filename) & ((1 << depth) - 1);
+            buckets[i] = cons(elt, buckets[i]);
+            sizes[i] += DIR_END_OFFSET + strlen(elt->filename);
+            full = sizes[i] > BLOCK_SIZE;
+        }
+
+        if (!full)
+            break;
+    }
+
+    /* every bucket gets a block of its own, after the header and the table
+     * blocks */
+    ntables = depth > DIR_HASH_MAX_DEPTH ? 0 : dir_hash_ntables(depth);
+    if (depth > DIR_HASH_MAX_DEPTH || 1 + ntables + (1 << depth) > 0xffff)
+        return NULL;
+
+    header = GC_NEW(struct dir_header);
+    assert(header != NULL);
+    header->depth = depth;
+    header->nblocks = 1 + ntables + (1 << depth);
+    header->buckets = GC_MALLOC_ATOMIC(sizeof(u16) << depth);
+    assert(header->buckets != NULL);
+    header->tables = NULL;
+    if (ntables > 0) {
+        header->tables = GC_MALLOC_ATOMIC(sizeof(u16) * ntables);
+        assert(header->tables != NULL);
+        for (num = 0; num < ntables; num++)
+            header->tables[num] = 1 + num;
+    }
+
+    for (i = 0; i < (1 << depth); i++) {
+        header->buckets[i] = 1 + ntables + i;
+        dir_write_entries(worker, claim, length, header->buckets[i],
+                buckets[i]);
+    }
+    dir_write_header(worker, claim, length, header, NULL);
+
+    /* drop anything left over from the old layout */
+    num = header->nblocks - 1;
+    dir_truncate(worker, claim, length,
+            (u64) BLOCK_SIZE * num + sizes[(1 << depth) - 1]);
+
+    return header;
 }
 
 struct dir_create_entry_env {
@@ -458,6 +1134,8 @@ static enum dir_iter_action dir_create_entry_iter(
 
 int dir_create_entry(Worker *worker, Claim *dir, char *name, u64 oid, int cow) {
     struct dir_create_entry_env env;
+    struct dir_header *header = dir_get_header(worker, dir);
+    u64 length = dir->info->length;
     int result;
 
     env.added = 0;
@@ -468,7 +1146,23 @@ int dir_create_entry(Worker *worker, Claim *dir, char *name, u64 oid, int cow) {
     env.newentry->cow = cow;
     env.newentry->filename = name;
 
-    result = dir_iter(worker, dir, NULL,
+    /* switch to the hashed format once a linear scan gets long */
+    if (header == NULL &&
+            length > (u64) (DIR_HASH_MIN_BLOCKS - 1) * BLOCK_SIZE)
+    {
+        header = dir_hash_convert(worker, dir, &length);
+    }
+
+    if (header != NULL) {
+        struct dir_block *block = dir_hash_bucket(worker, dir, header, name);
+        if (dir_entries_find(block->entries, name) != NULL)
+            return -1;
+        if (dir_hash_insert(worker, dir, &length, header, env.newentry) < 0)
+            return -2;
+        return 0;
+    }
+
+    result = dir_iter(worker, dir,
             (enum dir_iter_action (*)(void *, List *, List **, int))
             dir_create_entry_iter,
             &env);
@@ -501,47 +1195,77 @@ static enum dir_iter_action dir_remove_entry_iter(
 }
 
 int dir_remove_entry(Worker *worker, Claim *dir, char *name) {
-    return dir_iter(worker, dir, NULL,
+    struct dir_header *header = dir_get_header(worker, dir);
+
+    if (header != NULL) {
+        u64 length = dir->info->length;
+        struct dir_block *block = dir_hash_bucket(worker, dir, header, name);
+        struct direntry *elt = dir_entries_find(block->entries, name);
+
+        if (elt == NULL)
+            return -1;
+        dir_write_entries(worker, dir, &length, block->blocknum,
+                remove_elt(block->entries, elt));
+        return 0;
+    }
+
+    return dir_iter(worker, dir,
             (enum dir_iter_action (*)(void *, List *, List **, int))
             dir_remove_entry_iter,
             name);
 }
 
-struct dir_find_claim_env {
-    char *pathname;
-    Lease *lease;
-    Claim *claim;
-};
-
-static enum dir_iter_action dir_find_claim_iter(
-        struct dir_find_claim_env *env, List *in, List **out, int extra)
+/* look for a name in one block, scanning it in place unless it has
+ * already been decoded; returns 1 and fills in oid and cow if found */
+static int dir_lookup(Worker *worker, Claim *claim, u32 num,
+        struct dir_key *key, u64 *oid, u8 *cow)
 {
-    /* dir iter adds it to the cache for us, so all we have to do is
-     * check if our target has arrived in the cache yet */
-    env->claim = claim_lookup_from_cache(env->lease, env->pathname);
-    if (env->claim == NULL)
-        return DIR_CONTINUE;
-    else
-        return DIR_STOP;
+    struct dir_block *elt = dir_fetch_block(worker, claim, num);
+    int offset;
+
+    if (elt->data == NULL) {
+        struct direntry *entry = dir_entries_find(elt->entries, key->name);
+        if (entry == NULL)
+            return 0;
+        *oid = entry->oid;
+        *cow = entry->cow;
+        return 1;
+    }
+
+    if ((offset = dir_scan_block(elt->count, elt->data, key)) < 0)
+        return 0;
+    *oid = unpackU64(elt->data, elt->count, &offset);
+    *cow = (elt->data[offset] & 0x80) ? 1 : 0;
+    return 1;
 }
 
 Claim *dir_find_claim(Worker *worker, Claim *dir, char *name) {
-    struct dir_find_claim_env env;
-    int result;
+    struct dir_header *header = dir_get_header(worker, dir);
+    struct dir_key key;
+    u64 length;
+    u64 oid;
+    u8 cow;
+    u32 num;
+    int found = 0;
 
-    env.pathname = concatname(dir->pathname, name);
-    env.lease = dir->lease;
-    env.claim = NULL;
+    key.name = name;
+    key.len = strlen(name);
 
-    result = dir_iter(worker, dir, name,
-            (enum dir_iter_action (*)(void *, List *, List **, int))
-            dir_find_claim_iter,
-            &env);
+    if (header != NULL) {
+        found = dir_lookup(worker, dir, dir_hash_blocknum(header, name), &key,
+                &oid, &cow);
+    } else {
+        length = dir->info->length;
+        for (num = 0; !found && (u64) num * BLOCK_SIZE < length; num++)
+            found = dir_lookup(worker, dir, num, &key, &oid, &cow);
+    }
 
-    if (result < 0)
+    if (!found)
         return NULL;
 
-    return env.claim;
+    /* add it to the claim cache */
+    return dir_prime_claim(worker, dir, name, concatname(dir->pathname, name),
+            oid, cow);
 }
 
 struct dir_is_empty_env {
@@ -564,7 +1288,7 @@ int dir_is_empty(Worker *worker, Claim *dir) {
 
     env.isempty = 1;
 
-    dir_iter(worker, dir, NULL,
+    dir_iter(worker, dir,
             (enum dir_iter_action (*)(void *, List *, List **, int))
             dir_is_empty_iter,
             &env);
@@ -635,6 +1359,7 @@ static enum dir_iter_action dir_rename_iter(
 
 int dir_rename(Worker *worker, Claim *dir, char *oldname, char *newname) {
     struct dir_rename_env env;
+    struct dir_header *header = dir_get_header(worker, dir);
 
     env.oldname = oldname;
 
@@ -647,7 +1372,36 @@ int dir_rename(Worker *worker, Claim *dir, char *oldname, char *newname) {
     env.added = 0;
     env.removed = 0;
 
-    return dir_iter(worker, dir, NULL,
+    if (header != NULL) {
+        u64 length = dir->info->length;
+        struct dir_block *block =
+            dir_hash_bucket(worker, dir, header, oldname);
+        struct direntry *elt = dir_entries_find(block->entries, oldname);
+
+        if (elt == NULL)
+            return -1;
+        if (!strcmp(oldname, newname))
+            return 0;
+        env.newentry->oid = elt->oid;
+        env.newentry->cow = elt->cow;
+
+        /* add the new name before dropping the old one, so the file is
+         * never missing; an existing entry is replaced in place */
+        block = dir_hash_bucket(worker, dir, header, newname);
+        if ((elt = dir_entries_find(block->entries, newname)) != NULL) {
+            dir_write_entries(worker, dir, &length, block->blocknum,
+                    cons(env.newentry, remove_elt(block->entries, elt)));
+        } else if (dir_hash_insert(worker, dir, &length, header,
+                    env.newentry) < 0)
+        {
+            return -1;
+        }
+
+        /* the insert may have reshaped the directory, so look again */
+        return dir_remove_entry(worker, dir, oldname);
+    }
+
+    return dir_iter(worker, dir,
             (enum dir_iter_action (*)(void *, List *, List **, int))
             dir_rename_iter,
             &env);
@@ -689,12 +1443,28 @@ u64 dir_change_oid(Worker *worker, Claim *dir, char *name,
         u64 oid, int cow)
 {
     struct dir_change_oid_env env;
+    struct dir_header *header = dir_get_header(worker, dir);
 
     env.name = name;
     env.oid = oid;
     env.cow = cow;
 
-    if (dir_iter(worker, dir, NULL,
+    if (header != NULL) {
+        u64 length = dir->info->length;
+        struct dir_block *block = dir_hash_bucket(worker, dir, header, name);
+        struct direntry *elt = dir_entries_find(block->entries, name);
+
+        if (elt == NULL)
+            return NOOID;
+        env.oldoid = elt->oid;
+        elt->oid = oid;
+        elt->cow = cow;
+        dir_write_entries(worker, dir, &length, block->blocknum,
+                block->entries);
+        return env.oldoid;
+    }
+
+    if (dir_iter(worker, dir,
             (enum dir_iter_action (*)(void *, List *, List **, int))
             dir_change_oid_iter,
             &env) < 0)
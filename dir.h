@@ -1,6 +1,8 @@
 #ifndef _DIR_H_
 #define _DIR_H_
 
+#include <stdlib.h>
+#include <unistd.h>
 #include "types.h"
 #include "9p.h"
 #include "list.h"
@@ -12,6 +14,10 @@
 
 #define DIR_COW_OFFSET 8
 #define DIR_END_OFFSET 10
+#define DIR_HASH_MAGIC 0xffff
+/* bucket table slots held by a hashed directory's header, and by each of
+ * the blocks that hold the rest of a larger table */
+#define DIR_HASH_TABLE_SLOTS 1024
 
 struct direntry {
     u32 offset;
@@ -20,26 +26,47 @@ struct direntry {
     char *filename;
 };
 
+/* readdir position past every key (see dir_read_range) */
+#define DIR_READ_END (1ULL << 32)
+
 struct dir_read_env {
     struct p9stat *next;
-    u64 offset;
+    /* the start of the next range of keys to read */
+    u64 start;
+    /* what is left of the current range, in order */
     List *entries;
 };
 
+struct dir_header {
+    u8 depth;
+    u16 nblocks;
+    u16 *buckets;
+    /* the blocks holding the bucket table past its first
+     * DIR_HASH_TABLE_SLOTS slots, or NULL if it fits in the header */
+    u16 *tables;
+};
+
 struct dir_block {
     Lease *lease;
     u64 oid;
     u32 blocknum;
     List *entries;
+    /* set instead of entries for the first block of a hashed directory */
+    struct dir_header *header;
+    /* the packed block, if it has only been searched and not yet decoded */
+    u8 *data;
+    u32 count;
 };
 
 int dir_block_cmp(const struct dir_block *a, const struct dir_block *b);
 u32 dir_block_hash(const struct dir_block *block);
-void dir_block_cache_set(Lease *lease, u64 oid, u32 blocknum, List *entries);
+struct dir_block *dir_block_cache_set(Lease *lease, u64 oid, u32 blocknum,
+        List *entries);
 
 void dir_clone(u32 count, u8 *data);
 u32 dir_read(Worker *worker, Fid *fid, u32 size, u8 *data);
-/* returns 0 on success, -1 if the file already exists */
+/* returns 0 on success, -1 if the file already exists, -2 if the directory
+ * has no room for another entry */
 int dir_create_entry(Worker *worker, Claim *dir, char *name, u64 oid, int cow);
 /* returns 0 on success, -1 if not found */
 int dir_remove_entry(Worker *worker, Claim *dir, char *name);
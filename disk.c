@@ -17,6 +17,7 @@
 #include "worker.h"
 #include "lru.h"
 #include "disk.h"
+#include "uring.h"
 #include "dir.h"
 
 Lru *objectdir_lru;
@@ -85,28 +86,37 @@ static void close_openfile(Openfile *file) {
 void disk_state_init_storage(void) {
     objectdir_lru = lru_new(
             OBJECTDIR_CACHE_SIZE_STORAGE,
+            LRU_PLAIN,
             (Hashfunc) u64_hash,
             (Cmpfunc) u64_cmp,
             (int (*)(void *)) resurrect_objectdir,
             (void (*)(void *)) close_objectdir);
     openfile_lru = lru_new(
             FD_CACHE_SIZE_STORAGE,
+            LRU_PLAIN,
             (Hashfunc) u64_hash,
             (Cmpfunc) u64_cmp,
             (int (*)(void *)) resurrect_openfile,
             (void (*)(void *)) close_openfile);
     disk_next_available = disk_find_next_available();
+
+    if (disk_uring && uring_init(DISK_URING_ENTRIES) < 0) {
+        fprintf(stderr, "io_uring is not available, "
+                "falling back to synchronous disk I/O\n");
+    }
 }
 
 void disk_state_init_envoy(void) {
     objectdir_lru = lru_new(
             OBJECTDIR_CACHE_SIZE_ENVOY,
+            LRU_PLAIN,
             (Hashfunc) u64_hash,
             (Cmpfunc) u64_cmp,
             (int (*)(void *)) resurrect_objectdir,
             (void (*)(void *)) close_objectdir);
     openfile_lru = lru_new(
             FD_CACHE_SIZE_ENVOY,
+            LRU_PLAIN,
             (Hashfunc) u64_hash,
             (Cmpfunc) u64_cmp,
             (int (*)(void *)) resurrect_openfile,
@@ -617,7 +627,8 @@ Openfile *disk_get_openfile(Worker *worker, u64 oid) {
 
     assert(file->fd >= 0);
 
-    reserve(worker, LOCK_OPENFILE, file);
+    /* the file may have been removed while we waited */
+    reserve_wait(worker, LOCK_OPENFILE, file, file->fd >= 0);
 
     return file;
 }
@@ -684,7 +695,7 @@ int disk_clone(Worker *worker, u64 oldoid, u64 newoid) {
                 u32 i;
                 for (i = 0; i < count; i += BLOCK_SIZE) {
                     u32 size = min(BLOCK_SIZE, count - i);
-                    dir_clone(size, buff);
+                    dir_clone(size, (u8 *) buff + i);
                 }
             }
             if (write(new_fd->fd, buff, count) != count) {
@@ -734,15 +745,21 @@ int disk_write(Worker *worker, u64 oid, u32 time, u64 offset, u32 count,
     if (file == NULL)
         return -ENOENT;
 
-    if (lseek(file->fd, offset, SEEK_SET) < 0)
-        return -errno;
+    if (uring_available()) {
+        len = uring_write(worker, file->fd, offset, data, count);
+        if (len < 0)
+            return len;
+    } else {
+        if (lseek(file->fd, offset, SEEK_SET) < 0)
+            return -errno;
 
-    unlock();
-    len = write(file->fd, data, count);
-    lock();
+        unlock();
+        len = write(file->fd, data, count);
+        lock();
 
-    if (len < 0)
-        return -errno;
+        if (len < 0)
+            return -errno;
+    }
 
     assert(count == (u32) len);
 
@@ -765,17 +782,54 @@ int disk_read(Worker *worker, u64 oid, u32 time, u64 offset, u32 count,
     if (file == NULL)
         return -ENOENT;
 
-    if (lseek(file->fd, offset, SEEK_SET) < 0)
-        return -errno;
+    if (uring_available()) {
+        len = uring_read(worker, file->fd, offset, data, count);
+        if (len < 0)
+            return len;
+    } else {
+        if (lseek(file->fd, offset, SEEK_SET) < 0)
+            return -errno;
 
-    unlock();
-    len = read(file->fd, data, count);
-    lock();
+        unlock();
+        len = read(file->fd, data, count);
+        lock();
 
-    if (len < 0)
-        return -errno;
+        if (len < 0)
+            return -errno;
+    }
 
     /* set the atime */
 
     return len;
 }
+
+/* prepare to send up to count bytes of an object straight from its file.
+ * Returns the number of bytes available at the offset, and if that is
+ * non-zero, a private descriptor for the file in *fd that the caller must
+ * close; the cached descriptor may be closed at any time once we release
+ * the big lock. */
+int disk_read_fd(Worker *worker, u64 oid, u32 time, u64 offset, u32 count,
+        int *fd)
+{
+    Openfile *file;
+    struct stat info;
+
+    *fd = -1;
+
+    file = disk_get_openfile(worker, oid);
+    if (file == NULL)
+        return -ENOENT;
+
+    if (fstat(file->fd, &info) < 0)
+        return -errno;
+
+    if (offset >= (u64) info.st_size)
+        return 0;
+    if ((u64) info.st_size - offset < count)
+        count = (u32) ((u64) info.st_size - offset);
+
+    if ((*fd = dup(file->fd)) < 0)
+        return -errno;
+
+    return (int) count;
+}
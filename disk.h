@@ -49,6 +49,8 @@ int disk_write(Worker *worker, u64 oid, u32 time, u64 offset, u32 count,
         u8 *data);
 int disk_read(Worker *worker, u64 oid, u32 time, u64 offset, u32 count,
         u8 *data);
+int disk_read_fd(Worker *worker, u64 oid, u32 time, u64 offset, u32 count,
+        int *fd);
 
 void disk_state_init_storage(void);
 void disk_state_init_envoy(void);
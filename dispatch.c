@@ -1,5 +1,4 @@
 #include <assert.h>
-#include <pthread.h>
 #include <gc/gc.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -57,20 +56,29 @@ void send_request(Transaction *trans) {
     assert(trans->wait == NULL);
     trans->wait = cond_new();
 
+    /* another envoy may need our objects before it can answer */
+    if (trans->conn->type == CONN_ENVOY_OUT)
+        worker_remote_wait_begin();
+
     trans_insert(trans);
     put_message(trans->conn, trans->out);
     cond_wait(trans->wait);
 
+    if (trans->conn->type == CONN_ENVOY_OUT)
+        worker_remote_wait_end();
+
     /* we should have response when we wake up */
     assert(trans->in != NULL);
+    cond_free(trans->wait);
     trans->wait = NULL;
 }
 
 void send_requests(List *list, void (*callback)(void *), void *env) {
     Transaction *trans;
     List *ptr;
-    pthread_cond_t *cond;
+    Cond *cond;
     int done;
+    int remote = 0;
 
     assert(!null(list));
 
@@ -83,6 +91,11 @@ void send_requests(List *list, void (*callback)(void *), void *env) {
         assert(trans->in == NULL);
         assert(trans->wait == NULL);
 
+        if (trans->conn->type == CONN_ENVOY_OUT && !remote) {
+            remote = 1;
+            worker_remote_wait_begin();
+        }
+
         trans->wait = cond;
         trans_insert(trans);
         put_message(trans->conn, trans->out);
@@ -119,13 +132,17 @@ void send_requests(List *list, void (*callback)(void *), void *env) {
         trans = car(ptr);
         trans->wait = NULL;
     }
+    cond_free(cond);
+
+    if (remote)
+        worker_remote_wait_end();
 }
 
 void send_requests_streamed(List **queues, int n,
         void (*f)(void *, Transaction *),
         void *env)
 {
-    pthread_cond_t *cond;
+    Cond *cond;
     int *outstanding;
     int i;
     int done = 0;
@@ -188,6 +205,8 @@ void send_requests_streamed(List **queues, int n,
         if (!done)
             cond_wait(cond);
     }
+
+    cond_free(cond);
 }
 
 void send_reply(Transaction *trans) {
@@ -374,7 +393,8 @@ void dispatch(Worker *worker, Transaction *trans) {
         /* lock the objects this transaction will use */
         if (fid->isremote) {
             /* lock the fid only */
-            reserve(worker, LOCK_FID, fid);
+            reserve_wait(worker, LOCK_FID, fid,
+                    fid_lookup(trans->conn, oldfid) == fid);
         } else {
             /* is this a special admin operation? */
             if (trans->in->id == TCREATE &&
@@ -392,7 +412,8 @@ void dispatch(Worker *worker, Transaction *trans) {
                 lock_lease(worker, fid->claim->lease);
 
             /* next lock the fid */
-            reserve(worker, LOCK_FID, fid);
+            reserve_wait(worker, LOCK_FID, fid,
+                    fid_lookup(trans->conn, oldfid) == fid);
 
             /* for write ops, make sure the object is writable */
             if (!isleasemigrate && !isdumpcreate &&
@@ -14,8 +14,13 @@
 #include "util.h"
 #include "config.h"
 #include "envoy.h"
+#include "admit.h"
+#include "worker.h"
+#include "lru.h"
+#include "pool.h"
 #include "claim.h"
 #include "lease.h"
+#include "walk.h"
 #include "dump.h"
 
 /*
@@ -117,7 +122,9 @@ void dump_dot(FILE *fp, Lease *lease) {
     fprintf(fp, "  %s [shape=box];\n", deslash(lease->pathname));
 
     /* mark the exits */
-    for (list = lease->wavefront; !null(list); list = cdr(list)) {
+    for (list = lease_exits(lease, lease->pathname); !null(list);
+            list = cdr(list))
+    {
         Lease *exit = car(list);
         fprintf(fp, "  %s [shape=box,label=\"%s\"];\n", deslash(exit->pathname),
                 filename(exit->pathname));
@@ -130,6 +137,7 @@ void dump_dot(FILE *fp, Lease *lease) {
     stack = cons(lease->claim, NULL);
     while (!null(stack)) {
         Claim *claim = car(stack);
+        Claim *child;
         stack = cdr(stack);
 
         /* update the counters (copied from claim.c) */
@@ -146,8 +154,11 @@ void dump_dot(FILE *fp, Lease *lease) {
         }
 
         /* add children to the stack */
-        for (list = claim->children; !null(list); list = cdr(list))
-            stack = cons(car(list), stack);
+        for (child = claim->children; child != NULL;
+                child = child->nextsibling)
+        {
+            stack = cons(child, stack);
+        }
 
         /* link this claim to its parent */
         if (claim->parent != NULL) {
@@ -193,6 +204,11 @@ void dump_conn_all_iter(FILE *fp, u32 i, Connection *conn) {
             conn->totalmessagesin, conn->totalbytesin);
     fprintf(fp, " *     messages/bytes out    : %d/%lld\n",
             conn->totalmessagesout, conn->totalbytesout);
+    fprintf(fp, " *     queued messages/bytes : %d/%d (peak %d messages)\n",
+            conn->pending_writes_count, conn->pending_writes_bytes,
+            conn->pending_writes_peak);
+    if (conn->admit_queued > 0)
+        fprintf(fp, " *     awaiting admission    : %d\n", conn->admit_queued);
     if (conn->prevbytesout != 0 || conn->prevbytesin != 0) {
         fprintf(fp, " *     new messages/bytes in : %d/%lld\n",
                 conn->totalmessagesin - conn->prevmessagesin,
@@ -209,8 +225,55 @@ void dump_conn_all_iter(FILE *fp, u32 i, Connection *conn) {
 
 void dump_conn_all(FILE *fp) {
     fprintf(fp, "/* Connections:\n");
-    vector_apply(conn_vector,
-            (void (*)(void *, u32, void *)) dump_conn_all_iter, fp);
+    conn_apply((void (*)(void *, u32, void *)) dump_conn_all_iter, fp);
+    fprintf(fp, " */\n");
+}
+
+void dump_workers(FILE *fp) {
+    fprintf(fp, "/* Workers:\n");
+    fprintf(fp, " *   active transactions   : %d (%d of %d client)\n",
+            worker_active_count(), admit_active_count(), ADMIT_MAX_ACTIVE);
+    fprintf(fp, " *   restarts after losing : %u\n", worker_restarts);
+    fprintf(fp, " *   waits in place        : %u (%u restarted anyway)\n",
+            worker_waits, worker_waits_rechecked);
+    fprintf(fp, " */\n");
+}
+
+static void dump_pool(FILE *fp, Pool *pool) {
+    fprintf(fp, " *   %-21s : %u allocated, %u reused, %u free\n",
+            pool->name, pool->allocs, pool->reuses, pool->free_count);
+}
+
+void dump_memory(FILE *fp) {
+    fprintf(fp, "/* Memory:\n");
+    fprintf(fp, " *   heap size             : %lu (%lu free)\n",
+            (unsigned long) GC_get_heap_size(),
+            (unsigned long) GC_get_free_bytes());
+    fprintf(fp, " *   collections           : %u\n", pool_gc_count);
+    fprintf(fp, " *   pause total/max       : %.6f/%.6f seconds\n",
+            pool_gc_pause_total, pool_gc_pause_max);
+    dump_pool(fp, pool_messages);
+    dump_pool(fp, pool_transactions);
+    dump_pool(fp, pool_cells);
+    dump_pool(fp, pool_conds);
+    fprintf(fp, " */\n");
+}
+
+static void dump_lru(FILE *fp, char *name, Lru *lru) {
+    if (lru == NULL)
+        return;
+    mutex_lock(lru->lock, LOCK_RANK_LRU);
+    fprintf(fp, " *   %-21s : %u hits, %u misses, %d/%d held (%s)\n",
+            name, lru->hits, lru->misses, hash_count(lru->table), lru->size,
+            lru->policy == LRU_2Q ? "2q" : "plain");
+    mutex_unlock(lru->lock, LOCK_RANK_LRU);
+}
+
+void dump_caches(FILE *fp) {
+    fprintf(fp, "/* Caches:\n");
+    dump_lru(fp, "claims", claim_cache);
+    dump_lru(fp, "walks", walk_cache);
+    dump_lru(fp, "directory blocks", dir_cache);
     fprintf(fp, " */\n");
 }
 
@@ -238,6 +301,9 @@ void dump(char *name) {
                 ctime(&now));
 
     dump_conn_all(fp);
+    dump_workers(fp);
+    dump_memory(fp);
+    dump_caches(fp);
     dump_dot_all(fp);
     fclose(fp);
 }
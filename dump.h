@@ -9,6 +9,9 @@ extern int dot_counter;
 void dump_dot(FILE *fp, Lease *lease);
 void dump_dot_all(FILE *fp);
 void dump_conn_all(FILE *fp);
+void dump_workers(FILE *fp);
+void dump_memory(FILE *fp);
+void dump_caches(FILE *fp);
 void dump(char *name);
 
 #endif
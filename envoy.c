@@ -116,7 +116,7 @@ static void rerror(Message *m, u16 errnum, int line) {
 #define require_info(_ptr) do { \
     if ((_ptr)->info == NULL) { \
         (_ptr)->info = \
-            object_stat(worker, (_ptr)->oid, filename((_ptr)->pathname)); \
+            object_stat(worker, (_ptr)->oid, (_ptr)->name); \
     } \
 } while (0)
 
@@ -135,11 +135,11 @@ void forward_to_envoy(Worker *worker, Transaction *trans, Fid *fid) {
 
     assert(fid->isremote);
 
-    /* copy the whole message over */
+    /* copy the whole message over, sharing the payload; the request keeps
+     * its own reference in case the transaction has to start over */
     env = trans_new(NULL, NULL, message_new());
     if (custom_raw(trans->in)) {
-        env->out->raw = trans->in->raw;
-        trans->in->raw = NULL;
+        env->out->raw = raw_retain(trans->in->raw);
     } else {
         assert(trans->in->raw == NULL);
     }
@@ -179,6 +179,12 @@ void forward_to_envoy(Worker *worker, Transaction *trans, Fid *fid) {
         assert(0);
     }
 
+    /* the request is done with its payload */
+    if (custom_raw(trans->in)) {
+        raw_delete(trans->in->raw);
+        trans->in->raw = NULL;
+    }
+
     /* now copy the response back into trans */
     memcpy(&trans->out->msg, &env->in->msg, sizeof(env->in->msg));
     trans->out->id = env->in->id;
@@ -738,6 +744,7 @@ void handle_tcreate_admin(Worker *worker, Transaction *trans) {
     u64 newoid;
     int cow;
     int isfork;
+    int result;
     struct timeval start;
 
     if (DEBUG_VERBOSE)
@@ -872,8 +879,9 @@ void handle_tcreate_admin(Worker *worker, Transaction *trans) {
     /* note: the client normally checks to make sure this doesn't exist
      * before trying to create it, but a race with another client could
      * still happen */
-    failif(dir_create_entry(worker, fid->claim, req->name, newoid, cow) < 0,
-            EEXIST);
+    result = dir_create_entry(worker, fid->claim, req->name, newoid, cow);
+    failif(result == -2, ENOSPC);
+    failif(result < 0, EEXIST);
 
     /* directory info has changed */
     fid->claim->info = NULL;
@@ -941,6 +949,7 @@ void handle_tcreate(Worker *worker, Transaction *trans) {
     struct qid qid;
     enum fid_status status;
     u64 newoid;
+    int result;
     Claim *change = NULL;
 
     failif(!strcmp(req->name, ".") || !strcmp(req->name, "..") ||
@@ -1006,8 +1015,10 @@ void handle_tcreate(Worker *worker, Transaction *trans) {
     /* note: the client normally checks to make sure this doesn't exist
      * before trying to create it, but a race with another client could
      * still happen */
-    if (dir_create_entry(worker, fid->claim, req->name, newoid, 0) < 0) {
+    result = dir_create_entry(worker, fid->claim, req->name, newoid, 0);
+    if (result < 0) {
         object_delete(worker, newoid);
+        failif(result == -2, ENOSPC);
         failif(1, EEXIST);
     }
 
@@ -1088,7 +1099,7 @@ void handle_tread(Worker *worker, Transaction *trans) {
 
         if (req->offset >= info->length) {
             res->count = 0;
-            trans->out->raw = raw_new();
+            trans->out->raw = raw_new_size(RREAD_DATA_OFFSET);
         } else {
             trans->out->raw = object_read(worker, fid->claim->oid, now(),
                     req->offset, count, &res->count, &res->data);
@@ -1102,7 +1113,7 @@ void handle_tread(Worker *worker, Transaction *trans) {
         failif(req->offset != fid->readdir_cookie, ESPIPE);
 
         /* use the raw message buffer for data */
-        trans->out->raw = raw_new();
+        trans->out->raw = raw_new_size(RREAD_DATA_OFFSET + count);
         res->data = trans->out->raw + RREAD_DATA_OFFSET;
 
         /* read directory entries until we run out or the buffer is full */
@@ -14,6 +14,7 @@
 #include "object.h"
 #include "worker.h"
 #include "claim.h"
+#include "lease.h"
 
 /*
  * Fid pool state
@@ -22,6 +23,19 @@
 Vector *fid_remote_vector;
 List *fid_deleted_list;
 
+/* the lease's table of fids has its own lock */
+static void fid_index_add(Lease *lease, Fid *fid) {
+    mutex_lock(lease->lock, LOCK_RANK_LEASE);
+    hash_set(lease->fids, fid, fid);
+    mutex_unlock(lease->lock, LOCK_RANK_LEASE);
+}
+
+static void fid_index_remove(Lease *lease, Fid *fid) {
+    mutex_lock(lease->lock, LOCK_RANK_LEASE);
+    hash_remove(lease->fids, fid);
+    mutex_unlock(lease->lock, LOCK_RANK_LEASE);
+}
+
 void fid_insert_local(Connection *conn, u32 fid, char *user, Claim *claim) {
     Fid *res = GC_NEW(Fid);
 
@@ -52,7 +66,7 @@ void fid_insert_local(Connection *conn, u32 fid, char *user, Claim *claim) {
 
     fid_link_claim(res, claim);
     vector_set(conn->fid_vector, res->fid, res);
-    hash_set(res->claim->lease->fids, res, res);
+    fid_index_add(res->claim->lease, res);
 }
 
 void fid_insert_remote(Connection *conn, u32 fid, char *pathname, char *user,
@@ -95,7 +109,7 @@ void fid_update_remote(Fid *fid, char *pathname, Address *raddr, u32 rfid) {
     fid->pathname = pathname;
     fid->isremote = 1;
     if (fid->claim != NULL) {
-        hash_remove(fid->claim->lease->fids, fid);
+        fid_index_remove(fid->claim->lease, fid);
         fid_unlink_claim(fid);
     }
     fid->raddr = raddr;
@@ -107,7 +121,7 @@ void fid_update_local(Fid *fid, Claim *claim) {
     fid->pathname = claim->pathname;
     fid->isremote = 0;
     if (fid->claim != NULL && fid->claim != claim) {
-        hash_remove(fid->claim->lease->fids, fid);
+        fid_index_remove(fid->claim->lease, fid);
         fid_unlink_claim(fid);
     }
     fid->claim = NULL;
@@ -117,7 +131,7 @@ void fid_update_local(Fid *fid, Claim *claim) {
     fid->rfid = NOFID;
 
     fid_link_claim(fid, claim);
-    hash_set(fid->claim->lease->fids, fid, fid);
+    fid_index_add(fid->claim->lease, fid);
 }
 
 int fid_cmp(const Fid *a, const Fid *b) {
@@ -159,7 +173,7 @@ void fid_remove(Worker *worker, Connection *conn, u32 fid) {
         if (claim->deleted)
             fid_unlink_deleted(elt);
         else
-            hash_remove(claim->lease->fids, elt);
+            fid_index_remove(claim->lease, elt);
 
         if (claim->exclusive && elt->status != STATUS_UNOPENNED)
             claim->exclusive = 0;
@@ -229,7 +243,7 @@ List *fid_gather_groups(List *fids) {
 void fid_link_claim(Fid *fid, Claim *claim) {
     assert(fid->claim == NULL);
     assert(claim->lease != NULL);
-    assert(claim->parent != NULL || !null(claim->children) ||
+    assert(claim->parent != NULL || claim->children != NULL ||
             !strcmp(claim->lease->pathname, claim->pathname));
     fid->claim = claim;
     claim->fids = insertinorder((Cmpfunc) fid_cmp, claim->fids, fid);
@@ -187,6 +187,11 @@ let outputMessageStruct out m =
   fprintf out "@,u8 *raw;";
   fprintf out "@,u32 size;";
   fprintf out "@,";
+  fprintf out "@,int sendfd;";
+  fprintf out "@,u64 sendoffset;";
+  fprintf out "@,u32 sendcount;";
+  fprintf out "@,u8 *sendraw;";
+  fprintf out "@,";
   fprintf out "@,u8 id;";
   fprintf out "@,u16 tag;";
   fprintf out "@,";
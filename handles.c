@@ -1,55 +1,213 @@
 #include <assert.h>
+#include <pthread.h>
 #include <gc/gc.h>
 #include <stdlib.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <errno.h>
+#include <string.h>
 #include "types.h"
+#include "9p.h"
 #include "handles.h"
+#include "config.h"
+#include "worker.h"
 
 /*
  * Handle sets
  */
 
-Handles *handles_new(void) {
+static pthread_mutex_t *handles_lock;
+static Handles *handles_sets[HANDLES_MAX_SETS];
+static int handles_set_count;
+static int handles_pollers[HANDLES_MAX_POLLERS];
+static int handles_poller_count;
+
+/* for each descriptor, a bitmap of the sets that currently hold it and the
+ * poller it is registered with */
+static u8 *handles_interest;
+static u8 *handles_owner;
+static int handles_interest_size;
+
+static void handles_init(void) {
+    if (handles_lock != NULL)
+        return;
+
+    handles_lock = GC_NEW(pthread_mutex_t);
+    assert(handles_lock != NULL);
+    pthread_mutex_init(handles_lock, NULL);
+
+    handles_interest = GC_MALLOC_ATOMIC(HANDLES_INITIAL_SIZE);
+    assert(handles_interest != NULL);
+    memset(handles_interest, 0, HANDLES_INITIAL_SIZE);
+    handles_owner = GC_MALLOC_ATOMIC(HANDLES_INITIAL_SIZE);
+    assert(handles_owner != NULL);
+    memset(handles_owner, 0, HANDLES_INITIAL_SIZE);
+    handles_interest_size = HANDLES_INITIAL_SIZE;
+
+    handles_set_count = 0;
+    handles_poller_count = 0;
+    handles_poller_new();
+}
+
+static u8 *handles_grow_array(u8 *old, int oldsize, int size) {
+    u8 *array = GC_MALLOC_ATOMIC(size);
+    assert(array != NULL);
+    memcpy(array, old, oldsize);
+    memset(array + oldsize, 0, size - oldsize);
+    return array;
+}
+
+static void handles_grow(int handle) {
+    int size = handles_interest_size;
+
+    if (handle < size)
+        return;
+
+    while (handle >= size)
+        size *= 2;
+
+    handles_interest =
+        handles_grow_array(handles_interest, handles_interest_size, size);
+    handles_owner =
+        handles_grow_array(handles_owner, handles_interest_size, size);
+    handles_interest_size = size;
+}
+
+static u32 handles_events(u8 interest) {
+    u32 events = 0;
+    int i;
+
+    for (i = 0; i < handles_set_count; i++)
+        if (interest & handles_sets[i]->bit)
+            events |= handles_sets[i]->events;
+
+    return events;
+}
+
+static void handles_update(int handle, u8 old) {
+    struct epoll_event ev;
+    int epfd = handles_pollers[handles_owner[handle]];
+    u8 interest = handles_interest[handle];
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = handles_events(interest);
+    ev.data.fd = handle;
+
+    if (interest == 0) {
+        /* the descriptor may already have been closed, which removes it
+         * from the epoll set automatically */
+        if (epoll_ctl(epfd, EPOLL_CTL_DEL, handle, &ev) < 0)
+            assert(errno == ENOENT || errno == EBADF);
+    } else if (old == 0 || epoll_ctl(epfd, EPOLL_CTL_MOD, handle, &ev) < 0) {
+        /* a stale entry for a closed descriptor looks like a MOD but must
+         * be registered afresh */
+        assert(old == 0 || errno == ENOENT);
+        assert(epoll_ctl(epfd, EPOLL_CTL_ADD, handle, &ev) == 0);
+    }
+}
+
+Handles *handles_new(u32 events) {
     Handles *set = GC_NEW(Handles);
     assert(set != NULL);
-    set->set = GC_NEW_ATOMIC(fd_set);
-    assert(set != NULL);
-    FD_ZERO(set->set);
-    set->high = -1;
+
+    handles_init();
+
+    assert(handles_set_count < HANDLES_MAX_SETS);
+    set->events = events;
+    set->bit = 1 << handles_set_count;
+    handles_sets[handles_set_count++] = set;
 
     return set;
 }
 
 void handles_add(Handles *set, int handle) {
-    FD_SET(handle, set->set);
-    set->high = handle > set->high ? handle : set->high;
+    u8 old;
+
+    assert(handle >= 0);
+
+    mutex_lock(handles_lock, LOCK_RANK_HANDLES);
+    handles_grow(handle);
+    old = handles_interest[handle];
+    if (!(old & set->bit)) {
+        handles_interest[handle] = old | set->bit;
+        handles_update(handle, old);
+    }
+    mutex_unlock(handles_lock, LOCK_RANK_HANDLES);
 }
 
 void handles_remove(Handles *set, int handle) {
-    FD_CLR(handle, set->set);
-    if (handle >= set->high)
-        while (set->high >= 0 && FD_ISSET(set->high, set->set))
-            set->high--;
+    u8 old;
+
+    mutex_lock(handles_lock, LOCK_RANK_HANDLES);
+    if (handle >= 0 && handle < handles_interest_size) {
+        old = handles_interest[handle];
+        if (old & set->bit) {
+            handles_interest[handle] = old & ~set->bit;
+            handles_update(handle, old);
+        }
+    }
+    mutex_unlock(handles_lock, LOCK_RANK_HANDLES);
 }
 
-int handles_collect(Handles *set, fd_set *rset, int high) {
-    int i;
-    fd_mask *a = (fd_mask *) rset, *b = (fd_mask *) set->set;
+int handles_member(Handles *set, int handle) {
+    int res;
+
+    mutex_lock(handles_lock, LOCK_RANK_HANDLES);
+    res = handle >= 0 && handle < handles_interest_size &&
+        (handles_interest[handle] & set->bit) != 0;
+    mutex_unlock(handles_lock, LOCK_RANK_HANDLES);
 
-    high = high > set->high ? high : set->high;
+    return res;
+}
+
+/* create a new epoll instance and return its index */
+int handles_poller_new(void) {
+    int epfd;
+
+    handles_init();
 
-    for (i = 0; i * NFDBITS <= high; i++)
-        a[i] |= b[i];
+    assert(handles_poller_count < HANDLES_MAX_POLLERS);
+    epfd = epoll_create(HANDLES_INITIAL_SIZE);
+    assert(epfd >= 0);
+    handles_pollers[handles_poller_count] = epfd;
 
-    return high;
+    return handles_poller_count++;
 }
 
-int handles_member(Handles *set, fd_set *rset) {
-    int i;
+/* move a descriptor (and any interest it already has) to the given poller */
+void handles_assign(int handle, int poller) {
+    u8 interest;
+
+    assert(handle >= 0);
+    assert(poller >= 0 && poller < handles_poller_count);
+
+    mutex_lock(handles_lock, LOCK_RANK_HANDLES);
+    handles_grow(handle);
+    interest = handles_interest[handle];
+    if (handles_owner[handle] != poller) {
+        if (interest != 0) {
+            handles_interest[handle] = 0;
+            handles_update(handle, interest);
+        }
+        handles_owner[handle] = poller;
+        if (interest != 0) {
+            handles_interest[handle] = interest;
+            handles_update(handle, 0);
+        }
+    }
+    mutex_unlock(handles_lock, LOCK_RANK_HANDLES);
+}
+
+/* block until at least one descriptor registered with the poller is ready */
+int handles_wait(int poller, struct epoll_event *events, int maxevents) {
+    int count;
+
+    assert(poller >= 0 && poller < handles_poller_count);
+
+    do
+        count = epoll_wait(handles_pollers[poller], events, maxevents, -1);
+    while (count < 0 && errno == EINTR);
 
-    for (i = 0; i <= set->high; i++)
-        if (FD_ISSET(i, rset) && FD_ISSET(i, set->set))
-            return i;
+    assert(count >= 0);
 
-    return -1;
+    return count;
 }
@@ -1,19 +1,32 @@
 #ifndef _HANDLES_H_
 #define _HANDLES_H_
 
-#include <sys/select.h>
+#include <sys/epoll.h>
 #include "types.h"
+#include "9p.h"
 
-/* handle sets */
+#define HANDLES_MAX_SETS 8
+#define HANDLES_MAX_POLLERS 64
+
+/* handle sets
+ * Each set contributes its event mask (EPOLLIN or EPOLLOUT) to the
+ * descriptors it holds, so a descriptor is registered once and only modified
+ * when its combined interest changes.  Every descriptor belongs to exactly
+ * one poller (an epoll instance); poller 0 is used until a descriptor is
+ * assigned elsewhere.  The handle sets are guarded by handles_lock and may be
+ * used without holding worker_biglock. */
 struct handles {
-    fd_set *set;
-    int high;
+    u32 events;
+    u8 bit;
 };
 
 void handles_add(Handles *set, int handle);
 void handles_remove(Handles *set, int handle);
-int handles_collect(Handles *set, fd_set *rset, int high);
-int handles_member(Handles *set, fd_set *rset);
-Handles *handles_new(void);
+int handles_member(Handles *set, int handle);
+Handles *handles_new(u32 events);
+
+int handles_poller_new(void);
+void handles_assign(int handle, int poller);
+int handles_wait(int poller, struct epoll_event *events, int maxevents);
 
 #endif
@@ -2,6 +2,7 @@
 #include <gc/gc.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include "types.h"
 #include "9p.h"
 #include "list.h"
@@ -12,12 +13,31 @@
  * Generic hash tables
  */
 
+/* many of the hash functions in use are weak in their low bits, which are
+ * the only ones a power-of-two table looks at, so mix them all in */
+static inline u32 hash_mix(u32 hash) {
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+static struct hash_entry *hash_entries_new(u32 bucketCount) {
+    struct hash_entry *entries =
+        GC_MALLOC(sizeof(struct hash_entry) * bucketCount);
+    assert(entries != NULL);
+    return entries;
+}
+
 Hashtable *hash_create(
         int bucketCount,
         u32 (*keyhash)(const void *),
         int (*keycmp)(const void *, const void *))
 {
     Hashtable *table;
+    u32 count = 1;
 
     assert(keyhash != NULL);
     assert(keycmp != NULL);
@@ -26,124 +46,244 @@ Hashtable *hash_create(
     table = GC_NEW(Hashtable);
     assert(table != NULL);
 
+    /* round up to a power of two, leaving room for the requested number of
+     * entries without growing */
+    while (count * HASH_MAX_LOAD_NUM < (u32) bucketCount * HASH_MAX_LOAD_DEN)
+        count *= 2;
+
     table->size = 0;
-    table->bucketCount = bucketCount;
+    table->bucketCount = count;
     table->keyhash = keyhash;
     table->keycmp = keycmp;
-
-    table->buckets = GC_MALLOC(sizeof(List *) * bucketCount);
-    assert(table->buckets != NULL);
+    table->entries = hash_entries_new(count);
+    table->oldEntries = NULL;
+    table->oldBucketCount = 0;
+    table->migrated = 0;
 
     return table;
 }
 
-void *hash_get(Hashtable *table, const void *key) {
-    u32 hash;
-    List *elt;
+/* find the slot holding key in an array, or -1 */
+static int hash_find(Hashtable *table, struct hash_entry *entries,
+        u32 bucketCount, const void *key, u32 hash)
+{
+    u32 mask = bucketCount - 1;
+    u32 i = hash & mask;
+    u32 dist = 0;
+
+    for (;;) {
+        struct hash_entry *entry = &entries[i];
+
+        /* an empty slot, or an entry closer to home than we would be, means
+         * the key is not here */
+        if (entry->key == NULL || entry->dist < dist)
+            return -1;
+        if (entry->hash == hash && !table->keycmp(key, entry->key))
+            return (int) i;
+
+        i = (i + 1) & mask;
+        dist++;
+    }
+}
 
-    assert(table != NULL);
-    assert(key != NULL);
+/* find the slot holding key in the old array if it has not been moved yet,
+ * or -1 */
+static int hash_find_old(Hashtable *table, const void *key, u32 hash) {
+    int i;
 
-    hash = table->keyhash(key) % table->bucketCount;
-    elt = table->buckets[hash];
+    if (table->oldEntries == NULL)
+        return -1;
 
-    while (!null(elt) && table->keycmp(key, caar(elt)))
-        elt = cdr(elt);
+    i = hash_find(table, table->oldEntries, table->oldBucketCount, key, hash);
 
-    return null(elt) ? NULL : cdar(elt);
+    return i < (int) table->migrated ? -1 : i;
 }
 
-static void hash_size_double(Hashtable *table) {
-    int i;
-    List *elt;
-    int newBucketCount = table->bucketCount * 2;
-    List **newBuckets =
-        GC_MALLOC(sizeof(List *) * newBucketCount);
-
-    assert(newBuckets != NULL);
-
-    for (i = 0; i < table->bucketCount; i++) {
-        elt = table->buckets[i];
-        while (!null(elt)) {
-            u32 hash = table->keyhash(caar(elt)) % newBucketCount;
-            newBuckets[hash] = cons(car(elt), newBuckets[hash]);
-            elt = cdr(elt);
+/* place an entry for a key known not to be in the table */
+static void hash_place(Hashtable *table, struct hash_entry entry) {
+    u32 mask = table->bucketCount - 1;
+    u32 i = entry.hash & mask;
+
+    entry.dist = 0;
+    for (;;) {
+        struct hash_entry *slot = &table->entries[i];
+
+        if (slot->key == NULL) {
+            *slot = entry;
+            return;
         }
+
+        /* take the slot from an entry that is better off than we are */
+        if (slot->dist < entry.dist) {
+            struct hash_entry displaced = *slot;
+            *slot = entry;
+            entry = displaced;
+        }
+
+        i = (i + 1) & mask;
+        entry.dist++;
+    }
+}
+
+/* move up to count slots of the old array into the new one */
+static void hash_migrate(Hashtable *table, u32 count) {
+    if (table->oldEntries == NULL)
+        return;
+
+    for ( ; count > 0 && table->migrated < table->oldBucketCount; count--) {
+        struct hash_entry *entry = &table->oldEntries[table->migrated++];
+
+        /* skip empty slots and entries removed since growing started */
+        if (entry->key != NULL && entry->value != NULL)
+            hash_place(table, *entry);
     }
 
-    table->bucketCount = newBucketCount;
-    table->buckets = newBuckets;
+    if (table->migrated == table->oldBucketCount) {
+        table->oldEntries = NULL;
+        table->oldBucketCount = 0;
+        table->migrated = 0;
+    }
+}
+
+static void hash_size_double(Hashtable *table) {
+    /* finish any earlier growth first; with the step size in use this only
+     * happens if the table is being filled very quickly */
+    hash_migrate(table, table->oldBucketCount);
+
+    table->oldEntries = table->entries;
+    table->oldBucketCount = table->bucketCount;
+    table->migrated = 0;
+
+    table->bucketCount *= 2;
+    table->entries = hash_entries_new(table->bucketCount);
+
     if (DEBUG_VERBOSE)
-        printf("hash_size_double: new size = %d buckets\n", newBucketCount);
+        printf("hash_size_double: new size = %d buckets\n",
+                table->bucketCount);
+}
+
+void *hash_get(Hashtable *table, const void *key) {
+    u32 hash;
+    int i;
+
+    assert(table != NULL);
+    assert(key != NULL);
+
+    hash_migrate(table, HASH_MIGRATE_STEP);
+
+    hash = hash_mix(table->keyhash(key));
+    if ((i = hash_find(table, table->entries, table->bucketCount,
+                    key, hash)) >= 0)
+    {
+        return table->entries[i].value;
+    }
+    if ((i = hash_find_old(table, key, hash)) >= 0)
+        return table->oldEntries[i].value;
+
+    return NULL;
 }
 
 void hash_set(Hashtable *table, void *key, void *value) {
+    struct hash_entry entry;
     u32 hash;
-    List *elt;
+    int i;
 
     assert(table != NULL);
     assert(key != NULL);
     assert(value != NULL);
 
-    hash = table->keyhash(key) % table->bucketCount;
+    hash_migrate(table, HASH_MIGRATE_STEP);
 
     /* check if this key already exists */
-    elt = table->buckets[hash];
-    while (!null(elt) && table->keycmp(key, caar(elt)))
-        elt = cdr(elt);
-
-    if (!null(elt)) {
-        setcar(elt, cons(key, value));
-    } else {
-        table->buckets[hash] = cons(cons(key, value), table->buckets[hash]);
-        table->size++;
-        if (table->size > (table->bucketCount * 2) / 3)
-            hash_size_double(table);
+    hash = hash_mix(table->keyhash(key));
+    if ((i = hash_find(table, table->entries, table->bucketCount,
+                    key, hash)) >= 0)
+    {
+        table->entries[i].key = key;
+        table->entries[i].value = value;
+        return;
+    }
+    if ((i = hash_find_old(table, key, hash)) >= 0) {
+        /* a removed entry comes back to life in place */
+        if (table->oldEntries[i].value == NULL)
+            table->size++;
+        table->oldEntries[i].key = key;
+        table->oldEntries[i].value = value;
+        return;
+    }
+
+    if ((table->size + 1) * HASH_MAX_LOAD_DEN >
+            table->bucketCount * HASH_MAX_LOAD_NUM)
+    {
+        hash_size_double(table);
     }
+
+    entry.key = key;
+    entry.value = value;
+    entry.hash = hash;
+    hash_place(table, entry);
+    table->size++;
 }
 
 void hash_remove(Hashtable *table, const void *key) {
-    u32 hash;
-    List *elt, *prev;
+    u32 hash, mask;
+    int i;
 
     assert(table != NULL);
     assert(key != NULL);
 
-    hash = table->keyhash(key) % table->bucketCount;
-    prev = NULL;
-    elt = table->buckets[hash];
+    hash_migrate(table, HASH_MIGRATE_STEP);
 
-    while (!null(elt) && table->keycmp(key, caar(elt))) {
-        prev = elt;
-        elt = cdr(elt);
-    }
+    hash = hash_mix(table->keyhash(key));
+    i = hash_find(table, table->entries, table->bucketCount, key, hash);
 
-    /* element didn't exist */
-    if (null(elt))
+    if (i < 0) {
+        /* leave the slot in place so the run stays intact */
+        if ((i = hash_find_old(table, key, hash)) >= 0 &&
+                table->oldEntries[i].value != NULL)
+        {
+            table->oldEntries[i].value = NULL;
+            table->size--;
+        }
         return;
+    }
+
+    /* pull the rest of the run back one slot */
+    mask = table->bucketCount - 1;
+    for (;;) {
+        u32 next = (i + 1) & mask;
+        struct hash_entry *entry = &table->entries[next];
 
-    /* was it the first element? */
-    if (null(prev))
-        table->buckets[hash] = cdr(elt);
-    else
-        setcdr(prev, cdr(elt));
+        if (entry->key == NULL || entry->dist == 0)
+            break;
+
+        table->entries[i] = *entry;
+        table->entries[i].dist--;
+        i = next;
+    }
 
+    table->entries[i].key = NULL;
+    table->entries[i].value = NULL;
+    table->entries[i].dist = 0;
     table->size--;
 }
 
 void hash_apply(Hashtable *table, void (*fun)(void *, void *, void *),
         void *env)
 {
-    int i;
-    List *elt;
+    u32 i;
 
     assert(table != NULL);
 
-    for (i = 0; i < table->bucketCount; i++) {
-        elt = table->buckets[i];
-        while (!null(elt)) {
-            fun(env, caar(elt), cdar(elt));
-            elt = cdr(elt);
+    for (i = 0; i < table->bucketCount; i++)
+        if (table->entries[i].key != NULL)
+            fun(env, table->entries[i].key, table->entries[i].value);
+
+    if (table->oldEntries != NULL) {
+        for (i = table->migrated; i < table->oldBucketCount; i++) {
+            struct hash_entry *entry = &table->oldEntries[i];
+            if (entry->key != NULL && entry->value != NULL)
+                fun(env, entry->key, entry->value);
         }
     }
 }
@@ -153,26 +293,33 @@ int hash_count(Hashtable *table) {
 }
 
 List *hash_tolist(Hashtable *table) {
-    int i;
+    u32 i;
     List *res = NULL;
-    List *elt;
 
     assert(table != NULL);
 
     for (i = 0; i < table->bucketCount; i++)
-        for (elt = table->buckets[i]; !null(elt); elt = cdr(elt))
-            res = cons(cdar(elt), res);
+        if (table->entries[i].key != NULL)
+            res = cons(table->entries[i].value, res);
+
+    if (table->oldEntries != NULL) {
+        for (i = table->migrated; i < table->oldBucketCount; i++) {
+            struct hash_entry *entry = &table->oldEntries[i];
+            if (entry->key != NULL && entry->value != NULL)
+                res = cons(entry->value, res);
+        }
+    }
 
     return res;
 }
 
 void hash_clear(Hashtable *table) {
-    int i;
-
     assert(table != NULL);
 
-    for (i = 0; i < table->bucketCount; i++)
-        table->buckets[i] = NULL;
+    memset(table->entries, 0, sizeof(struct hash_entry) * table->bucketCount);
+    table->oldEntries = NULL;
+    table->oldBucketCount = 0;
+    table->migrated = 0;
 
     table->size = 0;
 }
@@ -1,18 +1,50 @@
 #ifndef _HASH_H_
 #define _HASH_H_
 
+#include <stdlib.h>
 #include "types.h"
 #include "9p.h"
 #include "list.h"
 
 /*
  * Generic hash tables
+ *
+ * Entries live directly in a power-of-two array and collisions are resolved
+ * by linear probing with Robin Hood insertion: an entry that has strayed
+ * further from its home slot than the one in its way takes that slot, and
+ * the displaced entry moves on.  Probe lengths stay short and even, so a
+ * lookup can stop as soon as it passes an entry closer to home than the key
+ * would be.  Removal shifts the rest of the run back a slot instead of
+ * leaving a tombstone.  Keys may not be NULL, which marks an empty slot.
+ *
+ * Growing does not rehash everything at once.  The old array is kept and
+ * every operation moves the next few of its slots into the new one, so the
+ * cost is spread over the operations that follow.  Until then a
+ * key may be in either array: slots of the old array below the migration
+ * point have been moved and are ignored, and an entry removed from the
+ * unmoved part has its value cleared rather than being shifted out, since
+ * shifting could carry a moved entry back across the migration point.
  */
 
+struct hash_entry {
+    void *key;
+    void *value;
+    /* the full hash of the key, and how far the entry sits from the slot
+     * the hash picks */
+    u32 hash;
+    u32 dist;
+};
+
 struct hashtable {
     u32 size;
     u32 bucketCount;
-    List **buckets;
+    struct hash_entry *entries;
+
+    /* while growing, the previous array and how many of its slots have
+     * been moved */
+    struct hash_entry *oldEntries;
+    u32 oldBucketCount;
+    u32 migrated;
 
     Hashfunc keyhash;
     Cmpfunc keycmp;
@@ -25,6 +57,7 @@ Hashtable *hash_create(
 void *hash_get(Hashtable *table, const void *key);
 void hash_set(Hashtable *table, void *key, void *value);
 void hash_remove(Hashtable *table, const void *key);
+/* fun must not add or remove entries in the table being walked */
 void hash_apply(Hashtable *table, void (*fun)(void *, void *, void *), void *env);
 int hash_count(Hashtable *table);
 List *hash_tolist(Hashtable *table);
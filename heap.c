@@ -125,6 +125,18 @@ void *heap_remove(Heap *heap) {
     return min;
 }
 
+/**
+ * Return the smallest element in the Heap without removing it.
+ */
+void *heap_peek(Heap *heap) {
+    assert(heap != NULL);
+
+    if (heap->count == 0)
+        return NULL;
+
+    return heap->array[1];
+}
+
 int heap_isempty(Heap *heap) {
     return heap->count == 0;
 }
@@ -15,6 +15,7 @@ struct heap {
 Heap *heap_new(int minSize, Cmpfunc compare);
 void heap_add(Heap *heap, void *elt);
 void *heap_remove(Heap *heap);
+void *heap_peek(Heap *heap);
 int heap_isempty(Heap *heap);
 
 #endif
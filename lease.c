@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <pthread.h>
 #include <gc/gc.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -24,12 +25,177 @@
 Hashtable *lease_by_root_pathname;
 Lru *dir_cache;
 
-static int lease_cmp(const Lease *a, const Lease *b) {
-    return strcmp(a->pathname, b->pathname);
+/*
+ * Lease index
+ *
+ * Every lease root and exit is also recorded in a trie of path components,
+ * so the lease covering a path and the exits beneath a directory can be
+ * found in a single descent without building any intermediate paths.
+ */
+
+struct lease_node {
+    char *name;
+    int len;
+    Lease *lease;
+    struct lease_node *parent;
+    struct lease_node *children;
+    struct lease_node *next;
+};
+
+static struct lease_node *lease_index;
+
+static struct lease_node *lease_node_new(struct lease_node *parent,
+        char *name, int len)
+{
+    struct lease_node *node = GC_NEW(struct lease_node);
+    assert(node != NULL);
+
+    node->name = GC_MALLOC_ATOMIC(len + 1);
+    assert(node->name != NULL);
+    memcpy(node->name, name, len);
+    node->name[len] = 0;
+    node->len = len;
+    node->lease = NULL;
+    node->parent = parent;
+    node->children = NULL;
+    node->next = NULL;
+
+    if (parent != NULL) {
+        node->next = parent->children;
+        parent->children = node;
+    }
+
+    return node;
+}
+
+static struct lease_node *lease_node_child(struct lease_node *node,
+        char *name, int len)
+{
+    for (node = node->children; node != NULL; node = node->next)
+        if (node->len == len && !memcmp(node->name, name, len))
+            return node;
+
+    return NULL;
+}
+
+/* step past the next component of a path, returning its start and length */
+static char *lease_path_next(char *path, char *end, int *len) {
+    char *p;
+
+    while (path < end && *path == '/')
+        path++;
+    for (p = path; p < end && *p != '/'; p++)
+        ;
+    *len = p - path;
+
+    return path;
+}
+
+/* find the node for a pathname, optionally creating it and its ancestors */
+static struct lease_node *lease_node_find(char *pathname, int create) {
+    struct lease_node *node = lease_index;
+    char *end = pathname + strlen(pathname);
+    char *name;
+    int len;
+
+    while (node != NULL &&
+            (name = lease_path_next(pathname, end, &len), len > 0))
+    {
+        struct lease_node *child = lease_node_child(node, name, len);
+        if (child == NULL && create)
+            child = lease_node_new(node, name, len);
+        node = child;
+        pathname = name + len;
+    }
+
+    return node;
+}
+
+/* the deepest lease rooted at or above the first len bytes of pathname */
+static Lease *lease_index_cover(char *pathname, int len) {
+    struct lease_node *node = lease_index;
+    Lease *lease = node->lease;
+    char *end = pathname + len;
+    char *name;
+    int namelen;
+
+    while ((name = lease_path_next(pathname, end, &namelen), namelen > 0) &&
+            (node = lease_node_child(node, name, namelen)) != NULL)
+    {
+        if (node->lease != NULL)
+            lease = node->lease;
+        pathname = name + namelen;
+    }
+
+    return lease;
+}
+
+/* the length of the parent directory part of a pathname */
+static int lease_path_dirlen(char *pathname) {
+    char *slash = strrchr(pathname, '/');
+    assert(slash != NULL);
+    return slash - pathname;
+}
+
+/* like ispathprefix, but every path lies within the root */
+static int lease_path_within(char *pathname, char *prefix) {
+    return !strcmp(prefix, "/") || ispathprefix(pathname, prefix);
+}
+
+static void lease_index_add(Lease *lease) {
+    hash_set(lease_by_root_pathname, lease->pathname, lease);
+    lease_node_find(lease->pathname, 1)->lease = lease;
 }
 
-static int lease_key_cmp(const char *key, const Lease *elt) {
-    return strcmp(key, elt->pathname);
+static void lease_index_remove(Lease *lease) {
+    struct lease_node *node = lease_node_find(lease->pathname, 0);
+
+    hash_remove(lease_by_root_pathname, lease->pathname);
+    if (node == NULL)
+        return;
+
+    /* prune branches that no longer lead to any lease */
+    node->lease = NULL;
+    while (node != lease_index && node->lease == NULL &&
+            node->children == NULL)
+    {
+        struct lease_node **link = &node->parent->children;
+        while (*link != node)
+            link = &(*link)->next;
+        *link = node->next;
+        node = node->parent;
+    }
+}
+
+/* gather the exits below a node, stopping at other leases rooted here */
+static List *lease_node_exits(struct lease_node *node, List *exits) {
+    for (node = node->children; node != NULL; node = node->next) {
+        if (node->lease == NULL)
+            exits = lease_node_exits(node, exits);
+        else if (node->lease->isexit)
+            exits = cons(node->lease, exits);
+    }
+
+    return exits;
+}
+
+List *lease_exits(Lease *lease, char *pathname) {
+    struct lease_node *node;
+
+    assert(!lease->isexit);
+
+    /* start from the lease root if the path lies above it */
+    if (lease_path_within(lease->pathname, pathname))
+        pathname = lease->pathname;
+    else
+        assert(lease_path_within(pathname, lease->pathname));
+
+    if ((node = lease_node_find(pathname, 0)) == NULL)
+        return NULL;
+    if (node->lease != NULL && node->lease != lease)
+        return node->lease->isexit ? cons(node->lease, NULL) : NULL;
+
+    return lease_node_exits(node, NULL);
 }
 
 Lease *lease_new(char *pathname, Address *addr, int isexit, Claim *claim,
@@ -48,10 +214,12 @@ Lease *lease_new(char *pathname, Address *addr, int isexit, Claim *claim,
     l->pathname = pathname;
     l->addr = addr;
 
-    l->wavefront = NULL;
-
     l->isexit = isexit;
 
+    l->lock = GC_NEW(pthread_mutex_t);
+    assert(l->lock != NULL);
+    pthread_mutex_init(l->lock, NULL);
+
     if (isexit) {
         l->claim = NULL;
         l->fids = NULL;
@@ -65,8 +233,8 @@ Lease *lease_new(char *pathname, Address *addr, int isexit, Claim *claim,
                 (Cmpfunc) fid_cmp);
         l->claim_cache = hash_create(
                 LEASE_CLAIM_HASHTABLE_SIZE,
-                (Hashfunc) string_hash,
-                (Cmpfunc) strcmp);
+                (Hashfunc) claim_hash,
+                (Cmpfunc) claim_cmp);
         l->dir_cache = hash_create(
                 LEASE_DIR_HASHTABLE_SIZE,
                 (Hashfunc) dir_block_hash,
@@ -79,29 +247,29 @@ Lease *lease_new(char *pathname, Address *addr, int isexit, Claim *claim,
     return l;
 }
 
-static void lease_clear_dir_cache(Lease *lease) {
-    List *allblocks = hash_tolist(lease->dir_cache);
+/* list the entries of one of a lease's tables; no two lease locks are
+ * ever held at once, so merging goes through a list */
+List *lease_table_list(Lease *lease, Hashtable *table) {
+    List *res;
 
-    for ( ; !null(allblocks); allblocks = cdr(allblocks))
-        lru_remove(dir_cache, car(allblocks));
-}
+    mutex_lock(lease->lock, LOCK_RANK_LEASE);
+    res = hash_tolist(table);
+    mutex_unlock(lease->lock, LOCK_RANK_LEASE);
 
-static void lease_merge_iter_claim_cache(Lease *lease,
-        char *pathname, Claim *claim)
-{
-    claim->lease = lease;
-    hash_set(lease->claim_cache, pathname, claim);
+    return res;
 }
 
-static void lease_merge_iter_dir_cache(Lease *lease,
-        struct dir_block *block, void *value)
-{
-    block->lease = lease;
-    hash_set(lease->dir_cache, block, block);
+/* dropping a block from the global cache removes it from ours */
+static void lease_clear_dir_cache(Lease *lease) {
+    List *allblocks = lease_table_list(lease, lease->dir_cache);
+
+    for ( ; !null(allblocks); allblocks = cdr(allblocks))
+        lru_remove(dir_cache, car(allblocks));
 }
 
 void lease_merge_exit(Worker *worker, Lease *parent, Lease *child) {
     Claim *claim;
+    List *fids, *claims, *blocks;
     assert(parent->wait_for_update == worker &&
             child->wait_for_update == worker);
     assert(parent->inflight == 0 && child->inflight == 0);
@@ -109,53 +277,64 @@ void lease_merge_exit(Worker *worker, Lease *parent, Lease *child) {
     /* assert(!parent->readonly);
     assert(!child->readonly); */
 
-    /* prevent lookups on the old lease */
-    hash_remove(lease_by_root_pathname, child->pathname);
+    /* prevent lookups on the old lease; its exits now fall to the parent */
+    lease_index_remove(child);
 
     /* find the immediate parent and add this child */
     claim = claim_find(worker, dirname(child->pathname));
     assert(claim != NULL && claim->lease == parent);
     claim_link_child(claim, child->claim);
 
+    fids = lease_table_list(child, child->fids);
+    claims = lease_table_list(child, child->claim_cache);
+    blocks = lease_table_list(child, child->dir_cache);
+
+    mutex_lock(parent->lock, LOCK_RANK_LEASE);
+
     /* merge the fids */
-    hash_apply(child->fids, (void (*)(void *, void *, void *)) hash_set,
-            parent->fids);
+    for ( ; !null(fids); fids = cdr(fids))
+        hash_set(parent->fids, car(fids), car(fids));
     child->fids = NULL;
 
     /* merge the claim cache */
-    hash_apply(child->claim_cache,
-            (void (*)(void *, void *, void *)) lease_merge_iter_claim_cache,
-            parent);
+    for ( ; !null(claims); claims = cdr(claims)) {
+        Claim *elt = car(claims);
+        elt->lease = parent;
+        hash_set(parent->claim_cache, elt, elt);
+    }
     child->claim_cache = NULL;
 
     /* merge the dir cache */
-    hash_apply(child->dir_cache,
-            (void (*)(void *, void *, void *)) lease_merge_iter_dir_cache,
-            parent);
+    for ( ; !null(blocks); blocks = cdr(blocks)) {
+        struct dir_block *block = car(blocks);
+        block->lease = parent;
+        hash_set(parent->dir_cache, block, block);
+    }
     child->dir_cache = NULL;
 
-    /* merge in the wavefront */
-    for ( ; !null(child->wavefront); child->wavefront = cdr(child->wavefront))
-        lease_link_exit((Lease *) car(child->wavefront));
+    mutex_unlock(parent->lock, LOCK_RANK_LEASE);
 
     parent->lastchange = now_double();
 }
 
 void lease_link_exit(Lease *exit) {
-    Lease *lease = lease_find_root(dirname(exit->pathname));
-    lease->wavefront =
-        insertinorder((Cmpfunc) lease_cmp, lease->wavefront, exit);
+    Lease *lease = lease_index_cover(exit->pathname,
+            lease_path_dirlen(exit->pathname));
+    assert(lease != NULL && !lease->isexit);
     lease_add(exit);
 }
 
 void lease_unlink_exit(Lease *exit) {
-    Lease *lease = lease_find_root(dirname(exit->pathname));
-    lease->wavefront =
-        removeinorder((Cmpfunc) lease_cmp, lease->wavefront, exit);
+    assert(exit->isexit);
+    lease_index_remove(exit);
 }
 
 static void lease_cleanup_dir_block(struct dir_block *block) {
-    hash_remove(block->lease->dir_cache, block);
+    Lease *lease = block->lease;
+
+    mutex_lock(lease->lock, LOCK_RANK_LEASE);
+    hash_remove(lease->dir_cache, block);
+    mutex_unlock(lease->lock, LOCK_RANK_LEASE);
 }
 
 void lease_state_init(void) {
@@ -163,8 +342,10 @@ void lease_state_init(void) {
             LEASE_HASHTABLE_SIZE,
             (Hashfunc) string_hash,
             (Cmpfunc) strcmp);
+    lease_index = lease_node_new(NULL, "", 0);
     dir_cache = lru_new(
             LEASE_DIR_CACHE_SIZE,
+            dir_cache_policy,
             (Hashfunc) dir_block_hash,
             (Cmpfunc) dir_block_cmp,
             NULL,
@@ -177,39 +358,26 @@ Lease *lease_get_remote(char *pathname) {
 }
 
 Lease *lease_find_root(char *pathname) {
-    Lease *lease = NULL;
-
-    while ((lease = hash_get(lease_by_root_pathname, pathname)) == NULL &&
-            strcmp(pathname, "/"))
-    {
-        pathname = dirname(pathname);
-    }
+    Lease *lease = lease_index_cover(pathname, strlen(pathname));
 
     return (lease != NULL && !lease->isexit) ? lease : NULL;
 }
 
 int lease_is_exit_point_parent(Lease *lease, char *pathname) {
-    return findinorder((Cmpfunc) lease_key_cmp,
-            lease->wavefront, pathname) != NULL;
+    Lease *exit = hash_get(lease_by_root_pathname, pathname);
+
+    return exit != NULL && exit->isexit &&
+        lease_index_cover(pathname, lease_path_dirlen(pathname)) == lease;
 }
 
 void lease_add(Lease *lease) {
-    List *exits = lease->wavefront;
-
-    assert(!lease->isexit || null(exits));
-
-    hash_set(lease_by_root_pathname, lease->pathname, lease);
-    for ( ; !null(exits); exits = cdr(exits)) {
-        Lease *exit = car(exits);
-        assert(exit->isexit);
-        hash_set(lease_by_root_pathname, exit->pathname, exit);
-    }
+    lease_index_add(lease);
 
     lease->lastchange = now_double();
 }
 
 void lease_remove(Lease *lease) {
-    assert(null(lease->wavefront));
+    assert(lease->isexit || null(lease_exits(lease, lease->pathname)));
     assert(lease->fids == NULL || hash_count(lease->fids) == 0);
     assert(null(lease->changeexits));
     assert(null(lease->changefids));
@@ -219,38 +387,36 @@ void lease_remove(Lease *lease) {
     } else {
         claim_clear_descendents(lease->claim);
         lease_clear_dir_cache(lease);
+        lease_index_remove(lease);
     }
 
-    hash_remove(lease_by_root_pathname, lease->pathname);
     lease->pathname = NULL;
     lease->addr = NULL;
     lease->claim = NULL;
     lease->lastchange = now_double();
 }
 
-static void make_claim_cow(char *prefix, char *pathname, Claim *claim) {
-    if (ispathprefix(pathname, prefix) && claim->access == ACCESS_WRITEABLE)
+static void make_claim_cow(char *prefix, Claim *key, Claim *claim) {
+    if (ispathprefix(claim->pathname, prefix) &&
+            claim->access == ACCESS_WRITEABLE)
         claim->access = ACCESS_COW;
 }
 
 void lease_snapshot(Worker *worker, Claim *claim) {
-    List *allexits = claim->lease->wavefront;
-    List *exits = NULL;
+    List *exits;
     List *newoids = NULL;
 
     lock_lease_exclusive(worker, claim->lease);
 
     /* start by freezing everything */
+    mutex_lock(claim->lease->lock, LOCK_RANK_LEASE);
     hash_apply(claim->lease->claim_cache,
             (void (*)(void *, void *, void *)) make_claim_cow,
             claim->pathname);
+    mutex_unlock(claim->lease->lock, LOCK_RANK_LEASE);
 
     /* recursively snapshot all the child leases */
-    for ( ; !null(allexits); allexits = cdr(allexits)) {
-        Lease *lease = car(allexits);
-        if (ispathprefix(lease->pathname, claim->pathname))
-            exits = cons(lease, exits);
-    }
+    exits = lease_exits(claim->lease, claim->pathname);
     if (!null(exits))
         newoids = remote_snapshot(worker, exits);
 
@@ -456,32 +622,17 @@ List *lease_serialize_exits(Worker *worker, Lease *lease,
         char *root, Address *addr)
 {
     List *result = NULL;
-    List *targets = NULL;
-    List *exits = lease->wavefront;
-    List *prev = NULL;
+    List *targets = lease_exits(lease, root);
     int prefixlen = strlen(root) + 1;
 
-    /* gather exits that match the prefix and remove them from the lease */
-    while (!null(exits)) {
-        Lease *elt = car(exits);
-        if (ispathprefix(elt->pathname, root)) {
-            targets = cons(elt, targets);
-            hash_remove(lease_by_root_pathname, elt->pathname);
-
-            if (prev == NULL)
-                lease->wavefront = cdr(exits);
-            else
-                setcdr(prev, cdr(exits));
-        } else {
-            prev = exits;
-        }
-        exits = cdr(exits);
+    /* remove the exits that match the prefix from the lease and prepare the
+     * list of records for the transfer */
+    for ( ; !null(targets); targets = cdr(targets)) {
+        Lease *elt = car(targets);
+        lease_index_remove(elt);
+        result = cons(lease_to_lease_record(elt, prefixlen), result);
     }
 
-    /* prepare list of records for the transfer */
-    for ( ; !null(targets); targets = cdr(targets))
-        result = cons(lease_to_lease_record(car(targets), prefixlen), result);
-
     return result;
 }
 
@@ -538,7 +689,7 @@ void lease_add_exits(Worker *worker, Lease *lease, char *prefix, List *exits) {
 List *lease_serialize_fids(Worker *worker, Lease *lease,
         char *root, Address *addr)
 {
-    List *allfids = hash_tolist(lease->fids);
+    List *allfids = lease_table_list(lease, lease->fids);
     List *res = NULL;
     int rootlen = strlen(root);
 
@@ -595,7 +746,9 @@ void lease_release_fids(Worker *worker, Lease *lease,
     List *fids;
 
     /* delete the envoy fids and update client fids to be remote */
-    for (fids = hash_tolist(lease->fids); !null(fids); fids = cdr(fids)) {
+    for (fids = lease_table_list(lease, lease->fids); !null(fids);
+            fids = cdr(fids))
+    {
         Fid *fid = car(fids);
 
         if (ispathprefix(fid->pathname, root)) {
@@ -796,7 +949,7 @@ void lease_rename(Worker *worker, Lease *lease, Claim *root,
     lock_lease_exclusive(worker, lease);
 
     /* update the claims */
-    allclaims = hash_tolist(lease->claim_cache);
+    allclaims = lease_table_list(lease, lease->claim_cache);
     for ( ; !null(allclaims); allclaims = cdr(allclaims)) {
         Claim *elt = car(allclaims);
         List *fids = elt->fids;
@@ -819,19 +972,12 @@ void lease_rename(Worker *worker, Lease *lease, Claim *root,
         }
     }
 
-    /* gather the exits that need updating */
-    exits = lease->wavefront;
-    lease->wavefront = NULL;
+    /* gather the exits that are descendents of our renamed directory */
+    exits = lease_exits(lease, oldpath);
     for ( ; !null(exits); exits = cdr(exits)) {
         Lease *elt = car(exits);
-
-        /* is this exit a descendent of our renamed directory? */
-        if (ispathprefix(elt->pathname, oldpath)) {
-            lock_lease_join(worker, cons(elt, NULL));
-            remoteleases = cons(elt, remoteleases);
-        } else {
-            lease_link_exit(elt);
-        }
+        lock_lease_join(worker, cons(elt, NULL));
+        remoteleases = cons(elt, remoteleases);
     }
 
     /* update the remote exits and remote fids */
@@ -842,15 +988,15 @@ void lease_rename(Worker *worker, Lease *lease, Claim *root,
 
     /* see if the lease itself needs renaming before re-linking the exits */
     if (ispathprefix(lease->pathname, oldpath)) {
-        hash_remove(lease_by_root_pathname, lease->pathname);
+        lease_index_remove(lease);
         lease->pathname = concatname(newpath, lease->pathname + prefixlen);
-        hash_set(lease_by_root_pathname, lease->pathname, lease);
+        lease_index_add(lease);
     }
 
-    /* now update the local exit stubs and the wavefront list */
+    /* now update the local exit stubs */
     for ( ; !null(remoteleases); remoteleases = cdr(remoteleases)) {
         Lease *elt = car(remoteleases);
-        hash_remove(lease_by_root_pathname, elt->pathname);
+        lease_index_remove(elt);
         elt->pathname = concatname(newpath, elt->pathname + prefixlen);
         lease_link_exit(elt);
     }
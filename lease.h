@@ -1,6 +1,8 @@
 #ifndef _LEASE_H_
 #define _LEASE_H_
 
+#include <pthread.h>
+#include <gc/gc.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include "types.h"
@@ -47,10 +49,12 @@ struct lease {
 
     /* these fields are not applicable for remote leases */
 
+    /* guards fids, claim_cache and dir_cache, which are reached from claims,
+     * fids and the global caches' cleanup callbacks */
+    pthread_mutex_t *lock;
+
     /* root claim */
     Claim *claim;
-    /* all the exits from this lease */
-    List *wavefront;
     /* all active fids using this lease */
     Hashtable *fids;
     /* does this lease cover a read-only region? */
@@ -86,6 +90,13 @@ Lease *lease_get_remote(char *pathname);
  * lease and return the lease.  Otherwise, return NULL. */
 Lease *lease_find_root(char *pathname);
 
+/* returns the exits from the given local lease that lie at or below pathname,
+ * which may also be a directory above the lease root */
+List *lease_exits(Lease *lease, char *pathname);
+
+/* returns the entries of one of the lease's tables, taken under its lock */
+List *lease_table_list(Lease *lease, Hashtable *table);
+
 void lease_link_exit(Lease *exit);
 void lease_unlink_exit(Lease *exit);
 
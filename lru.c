@@ -1,32 +1,95 @@
 #include <assert.h>
+#include <pthread.h>
 #include <gc/gc.h>
 #include <stdlib.h>
 #include "types.h"
 #include "9p.h"
 #include "hashtable.h"
-#include "heap.h"
+#include "config.h"
+#include "worker.h"
 #include "lru.h"
 
-static int lru_cmp(const struct lru_elt *a, const struct lru_elt *b) {
-    if (a->count == b->count)
-        return 0;
-    if (a->count < b->count && b->count - a->count < HEAP_COUNTER_THRESHOLD)
-        return -1;
-    return 1;
+static struct lru_list *lru_list_of(Lru *lru, struct lru_elt *elt) {
+    switch (elt->queue) {
+        case LRU_MAIN:          return &lru->main;
+        case LRU_PROBATION:     return &lru->probation;
+        case LRU_GHOST:         return &lru->ghost;
+        default:                assert(0);
+    }
+    return NULL;
+}
+
+static void lru_unlink(Lru *lru, struct lru_elt *elt) {
+    struct lru_list *list = lru_list_of(lru, elt);
+
+    if (elt->prev == NULL)
+        list->head = elt->next;
+    else
+        elt->prev->next = elt->next;
+
+    if (elt->next == NULL)
+        list->tail = elt->prev;
+    else
+        elt->next->prev = elt->prev;
+
+    elt->prev = elt->next = NULL;
+    list->count--;
+}
+
+static void lru_push_front(Lru *lru, struct lru_elt *elt, enum lru_queue queue)
+{
+    struct lru_list *list;
+
+    elt->queue = queue;
+    list = lru_list_of(lru, elt);
+
+    elt->prev = NULL;
+    elt->next = list->head;
+    if (list->head == NULL)
+        list->tail = elt;
+    else
+        list->head->prev = elt;
+    list->head = elt;
+    list->count++;
+}
+
+/* mark an item as the most recent one touched and put it on the main list */
+static void lru_touch(Lru *lru, struct lru_elt *elt) {
+    if (elt->queue != LRU_MAIN || lru->main.head != elt) {
+        lru_unlink(lru, elt);
+        lru_push_front(lru, elt, LRU_MAIN);
+    }
+}
+
+static void lru_list_init(struct lru_list *list) {
+    list->head = list->tail = NULL;
+    list->count = 0;
 }
 
-Lru *lru_new(int size, Hashfunc keyhash, Cmpfunc keycmp,
-        int (*resurrect)(void *), void (*cleanup)(void *))
+Lru *lru_new(int size, enum lru_policy policy, Hashfunc keyhash,
+        Cmpfunc keycmp, int (*resurrect)(void *), void (*cleanup)(void *))
 {
     Lru *lru = GC_NEW(Lru);
     assert(lru != NULL);
 
-    lru->table = hash_create(((size + 1) * 3) / 2, keyhash, keycmp);
-    lru->heap = heap_new(2 * size + 1, (Cmpfunc) lru_cmp);
+    lru->lock = GC_NEW(pthread_mutex_t);
+    assert(lru->lock != NULL);
+    pthread_mutex_init(lru->lock, NULL);
+    lru->table = hash_create(size + 1, keyhash, keycmp);
+    lru->policy = policy;
+    lru_list_init(&lru->main);
+    lru_list_init(&lru->probation);
+    lru_list_init(&lru->ghost);
+    if (policy == LRU_2Q)
+        lru->ghosts = hash_create(size * LRU_2Q_GHOST_PERCENT / 100 + 1,
+                keyhash, keycmp);
+    else
+        lru->ghosts = NULL;
     lru->resurrect = resurrect;
     lru->cleanup = cleanup;
     lru->size = size;
-    lru->counter = 0;
+    lru->hits = 0;
+    lru->misses = 0;
 
     return lru;
 }
@@ -34,43 +97,76 @@ Lru *lru_new(int size, Hashfunc keyhash, Cmpfunc keycmp,
 void *lru_get(Lru *lru, void *key) {
     struct lru_elt *elt;
 
+    void *value = NULL;
+
     assert(lru != NULL);
 
-    if ((elt = hash_get(lru->table, key)) == NULL)
-        return NULL;
+    mutex_lock(lru->lock, LOCK_RANK_LRU);
+    if ((elt = hash_get(lru->table, key)) == NULL) {
+        lru->misses++;
+    } else {
+        lru->hits++;
 
-    /* mark it as the most recent item touched */
-    elt->refresh = lru->counter++;
+        /* items on probation stay in arrival order */
+        if (elt->queue == LRU_MAIN)
+            lru_touch(lru, elt);
+        value = elt->value;
+    }
+    mutex_unlock(lru->lock, LOCK_RANK_LRU);
 
-    return elt->value;
+    return value;
 }
 
 void lru_remove_value(Lru *lru, void *value) {
-    int updated = 0;
-    while (lru->heap->count > hash_count(lru->table) ||
-            lru->heap->count > updated)
-    {
-        struct lru_elt *elt = heap_remove(lru->heap);
+    struct lru_list *lists[2] = { &lru->main, &lru->probation };
+    int i;
 
-        if (elt->value == NULL) {
-            continue;
-        } else if (elt->value == value) {
-            if (lru->cleanup != NULL)
-                lru->cleanup(elt->value);
-            hash_remove(lru->table, elt->key);
-            elt->value = NULL;
-            continue;
-        } else if (elt->count != elt->refresh) {
-            elt->count = elt->refresh;
-        } else {
-            elt->count = elt->refresh = lru->counter++;
-            updated++;
+    mutex_lock(lru->lock, LOCK_RANK_LRU);
+    for (i = 0; i < 2; i++) {
+        struct lru_elt *elt = lists[i]->head;
+
+        while (elt != NULL) {
+            struct lru_elt *next = elt->next;
+
+            if (elt->value == value) {
+                if (lru->cleanup != NULL)
+                    lru->cleanup(elt->value);
+                hash_remove(lru->table, elt->key);
+                lru_unlink(lru, elt);
+            }
+
+            elt = next;
         }
+    }
+    mutex_unlock(lru->lock, LOCK_RANK_LRU);
+}
 
-        heap_add(lru->heap, elt);
+/* remember the key of an item pushed out of probation */
+static void lru_add_ghost(Lru *lru, struct lru_elt *elt) {
+    elt->value = NULL;
+    lru_push_front(lru, elt, LRU_GHOST);
+    hash_set(lru->ghosts, elt->key, elt);
+
+    if (lru->ghost.count > lru->size * LRU_2Q_GHOST_PERCENT / 100) {
+        elt = lru->ghost.tail;
+        hash_remove(lru->ghosts, elt->key);
+        lru_unlink(lru, elt);
     }
 }
 
+/* pick the item to evict: under 2Q, probation gives up its oldest item once
+ * it holds more than its share */
+static struct lru_elt *lru_victim(Lru *lru) {
+    if (lru->main.tail == NULL || (lru->policy == LRU_2Q &&
+                lru->probation.count >
+                    lru->size * LRU_2Q_PROBATION_PERCENT / 100))
+    {
+        return lru->probation.tail;
+    }
+
+    return lru->main.tail;
+}
+
 void lru_add(Lru *lru, void *key, void *value) {
     struct lru_elt *elt;
     int keepers = 0;
@@ -79,53 +175,65 @@ void lru_add(Lru *lru, void *key, void *value) {
     assert(key != NULL);
     assert(value != NULL);
 
-    /* clean up and replace the old version if this key already exists */
+    mutex_lock(lru->lock, LOCK_RANK_LRU);
+
+    /* clean up and replace the old version if this key already exists; the
+     * new key takes over in case the old one is about to change */
     if ((elt = hash_get(lru->table, key)) != NULL) {
         if (lru->cleanup != NULL)
             lru->cleanup(elt->value);
+        elt->key = key;
         elt->value = value;
-        elt->refresh = lru->counter++;
+        hash_set(lru->table, key, elt);
+        if (elt->queue == LRU_MAIN)
+            lru_touch(lru, elt);
+        mutex_unlock(lru->lock, LOCK_RANK_LRU);
         return;
     }
 
-    /* make sure the heap doesn't grow out of control */
-    if (lru->heap->count >= lru->size * 2)
-        lru_remove_value(lru, NULL);
-
     /* if we're full, clear a space */
     while (hash_count(lru->table) >= lru->size) {
         assert(keepers < lru->size);
-        elt = heap_remove(lru->heap);
-
-        /* has this item been touched since we saw it last? */
-        if (elt->value == NULL) {
-            /* this item was already removed */
-        } else if (elt->count != elt->refresh) {
-            /* re-insert it with its updated rank */
-            elt->count = elt->refresh;
-            heap_add(lru->heap, elt);
-        } else if (lru->resurrect != NULL && lru->resurrect(elt->value)) {
+        elt = lru_victim(lru);
+
+        if (lru->resurrect != NULL && lru->resurrect(elt->value)) {
             /* refresh this item and keep it */
-            elt->count = elt->refresh = lru->counter++;
-            heap_add(lru->heap, elt);
+            lru_touch(lru, elt);
             keepers++;
         } else {
             /* remove it from the hashtable and destroy it */
+            enum lru_queue queue = elt->queue;
             hash_remove(lru->table, elt->key);
+            lru_unlink(lru, elt);
             if (lru->cleanup != NULL)
                 lru->cleanup(elt->value);
+            if (lru->policy == LRU_2Q && queue == LRU_PROBATION)
+                lru_add_ghost(lru, elt);
         }
     }
 
-    elt = GC_NEW(struct lru_elt);
-    assert(elt != NULL);
+    if (lru->policy == LRU_2Q &&
+            (elt = hash_get(lru->ghosts, key)) != NULL)
+    {
+        /* it was wanted again after leaving probation, so it has earned a
+         * place on the main list */
+        hash_remove(lru->ghosts, elt->key);
+        lru_unlink(lru, elt);
+        elt->key = key;
+        elt->value = value;
+        lru_push_front(lru, elt, LRU_MAIN);
+    } else {
+        elt = GC_NEW(struct lru_elt);
+        assert(elt != NULL);
 
-    elt->count = elt->refresh = lru->counter++;
-    elt->key = key;
-    elt->value = value;
+        elt->key = key;
+        elt->value = value;
+        lru_push_front(lru, elt,
+                lru->policy == LRU_2Q ? LRU_PROBATION : LRU_MAIN);
+    }
 
-    heap_add(lru->heap, elt);
     hash_set(lru->table, key, elt);
+    mutex_unlock(lru->lock, LOCK_RANK_LRU);
 }
 
 void lru_clear(Lru *lru) {
@@ -133,15 +241,23 @@ void lru_clear(Lru *lru) {
 
     assert(lru != NULL);
 
-    while ((elt = heap_remove(lru->heap)) != NULL) {
-        if (elt->value != NULL) {
-            hash_remove(lru->table, elt->key);
-            if (lru->cleanup != NULL)
-                lru->cleanup(elt->value);
-        }
+    mutex_lock(lru->lock, LOCK_RANK_LRU);
+    while ((elt = lru->probation.tail) != NULL ||
+            (elt = lru->main.tail) != NULL)
+    {
+        hash_remove(lru->table, elt->key);
+        lru_unlink(lru, elt);
+        if (lru->cleanup != NULL)
+            lru->cleanup(elt->value);
+    }
+
+    if (lru->ghosts != NULL) {
+        hash_clear(lru->ghosts);
+        lru_list_init(&lru->ghost);
     }
 
     assert(hash_count(lru->table) == 0);
+    mutex_unlock(lru->lock, LOCK_RANK_LRU);
 }
 
 void lru_remove(Lru *lru, void *key) {
@@ -149,11 +265,12 @@ void lru_remove(Lru *lru, void *key) {
 
     assert(lru != NULL);
 
-    /* the item remains in the heap, but is removed from the hashtable */
+    mutex_lock(lru->lock, LOCK_RANK_LRU);
     if ((elt = hash_get(lru->table, key)) != NULL) {
         if (lru->cleanup != NULL)
             lru->cleanup(elt->value);
         hash_remove(lru->table, elt->key);
-        elt->value = NULL;
+        lru_unlink(lru, elt);
     }
+    mutex_unlock(lru->lock, LOCK_RANK_LRU);
 }
@@ -1,45 +1,71 @@
 #ifndef _LRU_H_
 #define _LRU_H_
 
+#include <pthread.h>
+#include <gc/gc.h>
 #include "types.h"
 #include "9p.h"
 #include "hashtable.h"
-#include "heap.h"
-
-#define HEAP_COUNTER_THRESHOLD 0x80000000L
+#include "worker.h"
 
 /* A Least-Recently-Used (LRU) cache.
- * Items are indexed using a hashtable, and they are also put into a
- * binary heap.  Items are tracked by two values: the time of insert
- * and time of most recent access.  When an item is pulled off the
- * heap, the two values are compared.  If equal, the item is cleaned
- * up and discarded, otherwise the insert time is updated to the
- * most recent access time and the item is put back in the heap.
+ * Items are indexed using a hashtable, and they are also kept on doubly
+ * linked lists in order of use, most recent first.  Looking an item up moves
+ * it to the front and the victim is always taken from the back, so get, add
+ * and evict all take constant time.  An item that the resurrect callback
+ * wants to keep is moved to the front instead of being evicted.
  *
- * Age is tracked by a u32 counter.  If the difference between two
- * values is over 2^31 then it is assumed that the counter wrapped
- * around, and the lower value is considered more recent.  This
- * scheme could fail if the items are accessed 2^31 times between
- * inventory cycles.
+ * With LRU_2Q a single pass over many items (a tar of a large tree, say)
+ * cannot flush the working set.  New items go on a short FIFO probation
+ * queue, and only an item that is asked for again after it has been pushed
+ * out of probation joins the main LRU list.  Items pushed out of probation
+ * are remembered, without their values, on a ghost queue for that purpose.
  */
+enum lru_policy {
+    LRU_PLAIN,
+    LRU_2Q,
+};
+
+enum lru_queue {
+    LRU_MAIN,
+    LRU_PROBATION,
+    LRU_GHOST,
+};
+
+struct lru_list {
+    struct lru_elt *head;
+    struct lru_elt *tail;
+    int count;
+};
+
 struct lru {
+    /* every operation takes this, so callers need not hold the big lock */
+    pthread_mutex_t *lock;
     int size;
-    u32 counter;
+    enum lru_policy policy;
     Hashtable *table;
-    Heap *heap;
+    struct lru_list main;
+    struct lru_list probation;
+    /* LRU_2Q only: keys recently pushed out of probation */
+    Hashtable *ghosts;
+    struct lru_list ghost;
     int (*resurrect)(void *);
     void (*cleanup)(void *);
+    u32 hits;
+    u32 misses;
 };
 
 struct lru_elt {
-    u32 count;
-    u32 refresh;
+    struct lru_elt *prev;
+    struct lru_elt *next;
+    enum lru_queue queue;
     void *key;
     void *value;
 };
 
 Lru *lru_new(
         int size,
+        enum lru_policy policy,
         Hashfunc keyhash,
         Cmpfunc keycmp,
         int (*resurrect)(void *),
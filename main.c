@@ -13,6 +13,7 @@
 #include "transport.h"
 #include "object.h"
 #include "worker.h"
+#include "pool.h"
 #include "disk.h"
 #include "claim.h"
 #include "lease.h"
@@ -110,6 +111,7 @@ int main(int argc, char **argv) {
     GC_use_entire_heap = 1;
     GC_init();
     GC_expand_hp(1024 * 8192);
+    pool_state_init();
 
     /* were we called as envoy or storage? */
     name = strstr(argv[0], "storage");
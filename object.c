@@ -1,5 +1,4 @@
 #include <assert.h>
-#include <pthread.h>
 #include <gc/gc.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -25,7 +24,7 @@
 /* pool of reserved oids */
 static u64 object_reserve_next;
 static u32 object_reserve_remaining;
-static pthread_cond_t *object_reserve_wait;
+static Cond *object_reserve_wait;
 static Lru *object_cache_status;
 
 void object_cache_validate(u64 oid) {
@@ -67,15 +66,17 @@ static void send_request_to_all(Transaction *trans,
         /* copy the whole mess over */
         memcpy(newtrans->out, trans->out, sizeof(Message));
 
-        /* for tswrite, we need to copy the data payload as well */
+        /* for tswrite, each copy packs a header of its own and sends the
+         * payload out of the same shared buffer */
         if (newtrans->out->raw != NULL) {
             struct Tswrite *req = &newtrans->out->msg.tswrite;
 
             assert(trans->out->id == TSWRITE);
 
-            newtrans->out->raw = raw_new();
-            req->data = newtrans->out->raw + TWRITE_DATA_OFFSET;
-            memcpy(req->data, trans->out->raw + TWRITE_DATA_OFFSET, req->count);
+            newtrans->out->raw = raw_new_size(TSWRITE_DATA_OFFSET);
+            req->data = newtrans->out->raw + TSWRITE_DATA_OFFSET;
+            if (newtrans->out->sendraw != NULL)
+                raw_retain(newtrans->out->sendraw);
         }
 
         requests = cons(newtrans, requests);
@@ -104,7 +105,7 @@ u64 object_reserve_oid(Worker *worker) {
         /* the first storage server is considered the master */
         Transaction *trans = trans_new(storage_servers[0], NULL, message_new());
         struct Rsreserve *res;
-        pthread_cond_t *wait;
+        Cond *wait;
 
         trans->out->tag = ALLOCTAG;
         trans->out->id = TSRESERVE;
@@ -113,6 +114,7 @@ u64 object_reserve_oid(Worker *worker) {
         send_request(trans);
         object_reserve_wait = NULL;
         cond_broadcast(wait);
+        cond_free(wait);
 
         res = &trans->in->msg.rsreserve;
 
@@ -189,7 +191,7 @@ void *object_read(Worker *worker, u64 oid, u32 atime, u64 offset, u32 count,
 
     /* read from the cache if it exists */
     if (object_cache_isvalid(oid)) {
-        u8 *raw = raw_new();
+        u8 *raw = raw_new_size(RSREAD_DATA_OFFSET + count);
         int len;
 
         *data = raw + RSREAD_DATA_OFFSET;
@@ -254,13 +256,25 @@ u32 object_write(Worker *worker, u64 oid, u32 mtime, u64 offset,
 
     assert(raw != NULL);
 
-    trans->out->raw = raw;
+    /* the header is packed on its own and the payload is sent straight out
+     * of the caller's buffer, which is shared by all the replicas */
+    trans->out->raw = raw_new_size(TSWRITE_DATA_OFFSET);
     trans->out->tag = ALLOCTAG;
     trans->out->id = TSWRITE;
-    set_tswrite(trans->out, mtime, offset, count, data, oid);
+    set_tswrite(trans->out, oid, mtime, offset, count,
+            trans->out->raw + TSWRITE_DATA_OFFSET);
+    if (count > 0) {
+        trans->out->sendraw = raw_retain(raw);
+        trans->out->sendoffset = data - (u8 *) raw;
+        trans->out->sendcount = count;
+    }
 
     send_request_to_all(trans, (void (*)(void *)) object_write_cb, &env);
 
+    /* the cache write reads the payload, so our reference is only dropped
+     * once every replica has answered */
+    raw_delete(raw);
+
     res = &trans->in->msg.rswrite;
     return res->count;
 }
@@ -369,7 +383,7 @@ void object_delete(Worker *worker, u64 oid) {
 
 struct object_fetch_env {
     Openfile *file;
-    pthread_cond_t *wait;
+    Cond *wait;
 };
 
 static void object_fetch_iter(struct object_fetch_env *env, Transaction *trans)
@@ -397,6 +411,7 @@ static void object_fetch_iter(struct object_fetch_env *env, Transaction *trans)
     trans->in->raw = NULL;
 
     cond_broadcast(env->wait);
+    cond_free(env->wait);
     env->wait = NULL;
 }
 
@@ -494,6 +509,7 @@ void object_state_init(void) {
     } else {
         object_cache_status = lru_new(
                 OBJECT_CACHE_STATE_SIZE,
+                LRU_PLAIN,
                 (Hashfunc) u64_hash,
                 (Cmpfunc) u64_cmp,
                 NULL,
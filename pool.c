@@ -0,0 +1,149 @@
+#include <assert.h>
+#include <pthread.h>
+#include <gc/gc.h>
+#include <stdlib.h>
+#include <utime.h>
+#include <sys/time.h>
+#include <string.h>
+#include <time.h>
+#include "types.h"
+#include "9p.h"
+#include "list.h"
+#include "transaction.h"
+#include "util.h"
+#include "config.h"
+#include "worker.h"
+#include "pool.h"
+
+Pool *pool_messages;
+Pool *pool_transactions;
+Pool *pool_cells;
+Pool *pool_conds;
+
+u32 pool_gc_count;
+double pool_gc_pause_total;
+double pool_gc_pause_max;
+
+static struct timeval pool_gc_start;
+
+Pool *pool_new(char *name, size_t size) {
+    Pool *pool = GC_NEW(Pool);
+    assert(pool != NULL);
+
+    /* the free list is threaded through the first word of each object */
+    assert(size >= sizeof(void *));
+
+    pool->name = name;
+    pool->size = size;
+    pool->mutex = GC_NEW(pthread_mutex_t);
+    assert(pool->mutex != NULL);
+    pthread_mutex_init(pool->mutex, NULL);
+    pool->free = NULL;
+    pool->free_count = 0;
+    pool->allocs = 0;
+    pool->reuses = 0;
+
+    return pool;
+}
+
+/* return a zeroed object, reusing a freed one if there is one */
+void *pool_alloc(Pool *pool) {
+    void *obj;
+
+    mutex_lock(pool->mutex, LOCK_RANK_POOL);
+    pool->allocs++;
+    obj = pool->free;
+    if (obj != NULL) {
+        pool->free = *(void **) obj;
+        pool->free_count--;
+        pool->reuses++;
+    }
+    mutex_unlock(pool->mutex, LOCK_RANK_POOL);
+
+    if (obj == NULL) {
+        obj = GC_MALLOC(pool->size);
+        assert(obj != NULL);
+    } else {
+        *(void **) obj = NULL;
+    }
+
+    return obj;
+}
+
+/* the caller must be sure nothing refers to obj any more */
+void pool_free(Pool *pool, void *obj) {
+    assert(obj != NULL);
+
+    /* clear it now so it does not keep anything else alive */
+    memset(obj, 0, pool->size);
+
+    mutex_lock(pool->mutex, LOCK_RANK_POOL);
+    if (pool->free_count < POOL_MAX_FREE) {
+        *(void **) obj = pool->free;
+        pool->free = obj;
+        pool->free_count++;
+    }
+    mutex_unlock(pool->mutex, LOCK_RANK_POOL);
+}
+
+List *pool_cons(void *car, void *cdr) {
+    List *cell = pool_alloc(pool_cells);
+
+    cell->car = car;
+    cell->cdr = cdr;
+
+    return cell;
+}
+
+void pool_cons_free(List *cell) {
+    pool_free(pool_cells, cell);
+}
+
+/* the same as message_new, but drawn from the message pool */
+Message *pool_message_new(void) {
+    Message *msg = pool_alloc(pool_messages);
+
+    msg->raw = NULL;
+    msg->sendfd = -1;
+    msg->sendoffset = 0;
+    msg->sendcount = 0;
+    msg->sendraw = NULL;
+    msg->tag = ALLOCTAG;
+
+    return msg;
+}
+
+void pool_message_free(Message *msg) {
+    pool_free(pool_messages, msg);
+}
+
+/* time each collection; called by the collector with its own lock held, so
+ * this must not allocate */
+static void pool_gc_event(GC_EventType event) {
+    struct timeval now;
+    double pause;
+
+    if (event == GC_EVENT_START) {
+        gettimeofday(&pool_gc_start, NULL);
+    } else if (event == GC_EVENT_END) {
+        gettimeofday(&now, NULL);
+        pause = (now.tv_sec - pool_gc_start.tv_sec) +
+            (now.tv_usec - pool_gc_start.tv_usec) / 1000000.0;
+        pool_gc_count++;
+        pool_gc_pause_total += pause;
+        if (pause > pool_gc_pause_max)
+            pool_gc_pause_max = pause;
+    }
+}
+
+void pool_state_init(void) {
+    pool_messages = pool_new("messages", sizeof(Message));
+    pool_transactions = pool_new("transactions", sizeof(Transaction));
+    pool_cells = pool_new("queue cells", sizeof(List));
+    pool_conds = pool_new("condition variables", sizeof(Cond));
+
+    pool_gc_count = 0;
+    pool_gc_pause_total = 0.0;
+    pool_gc_pause_max = 0.0;
+    GC_set_on_collection_event(pool_gc_event);
+}
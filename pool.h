@@ -0,0 +1,52 @@
+#ifndef _POOL_H_
+#define _POOL_H_
+
+#include <pthread.h>
+#include <gc/gc.h>
+#include "types.h"
+#include "9p.h"
+#include "list.h"
+#include "config.h"
+
+/* Typed free-list pools
+ * Objects on the request path whose lifetime ends at a known point (queue
+ * cells, the condition variables used to wait for replies, and the
+ * transaction and request message of an incoming request once it has been
+ * dispatched) are handed back to a pool and given out again, so the request
+ * path draws on the collected heap far less often and collections come
+ * further apart.  Each pool keeps at most POOL_MAX_FREE objects and leaves
+ * the rest to the collector.  Pools may be used from any thread. */
+struct pool {
+    char *name;
+    size_t size;
+    pthread_mutex_t *mutex;
+    void *free;
+    u32 free_count;
+    u32 allocs;
+    u32 reuses;
+};
+
+extern Pool *pool_messages;
+extern Pool *pool_transactions;
+extern Pool *pool_cells;
+extern Pool *pool_conds;
+
+/* collector activity since startup */
+extern u32 pool_gc_count;
+extern double pool_gc_pause_total;
+extern double pool_gc_pause_max;
+
+Pool *pool_new(char *name, size_t size);
+void *pool_alloc(Pool *pool);
+void pool_free(Pool *pool, void *obj);
+void pool_state_init(void);
+
+/* list cells for queues whose cells are unlinked one at a time */
+List *pool_cons(void *car, void *cdr);
+void pool_cons_free(List *cell);
+
+/* incoming messages, returned once the request has been dispatched */
+Message *pool_message_new(void);
+void pool_message_free(Message *msg);
+
+#endif
@@ -63,6 +63,7 @@ u16 remote_walk(Worker *worker, Address *target,
             assert(addr != NULL);
             addr->ip = res->address;
             addr->port = res->port;
+            addr->local = 0;
             *address = addr;
         }
         return res->errnum;
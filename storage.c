@@ -79,28 +79,26 @@ void handle_tsclone(Worker *worker, Transaction *trans) {
 void handle_tsread(Worker *worker, Transaction *trans) {
     struct Tsread *req = &trans->in->msg.tsread;
     struct Rsread *res = &trans->out->msg.rsread;
-    int len;
+    int len, fd;
 
     /* make sure the requested data is small enough to transmit */
     failif(req->count > trans->conn->maxSize - RSREAD_HEADER, EMSGSIZE);
 
-    /* use the raw message buffer */
-    trans->out->raw = raw_new();
-    res->data = trans->out->raw + RSREAD_DATA_OFFSET;
-
-    worker_cleanup_add(worker, LOCK_RAW, trans->out->raw);
-    len = disk_read(worker, req->oid, req->time, req->offset, req->count,
-            res->data);
-    worker_cleanup_remove(worker, LOCK_RAW, trans->out->raw);
-
-    if (len < 0) {
-        raw_delete(trans->out->raw);
-        trans->out->raw = NULL;
-    }
+    /* the payload goes straight from the object file to the socket, so the
+     * raw buffer only ever holds the header */
+    len = disk_read_fd(worker, req->oid, req->time, req->offset, req->count,
+            &fd);
 
     failif(len < 0, -len);
 
+    trans->out->raw = raw_new_size(RSREAD_DATA_OFFSET);
+    res->data = trans->out->raw + RSREAD_DATA_OFFSET;
     res->count = (u32) len;
+    if (len > 0) {
+        trans->out->sendfd = fd;
+        trans->out->sendoffset = req->offset;
+        trans->out->sendcount = (u32) len;
+    }
 
     send_reply(trans);
 }
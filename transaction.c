@@ -1,11 +1,11 @@
 #include <assert.h>
-#include <gc/gc.h>
 #include <stdlib.h>
 #include "types.h"
 #include "9p.h"
 #include "vector.h"
 #include "connection.h"
 #include "transaction.h"
+#include "pool.h"
 
 /*
  * Transaction pool state
@@ -13,8 +13,7 @@
  */
 
 Transaction *trans_new(Connection *conn, Message *in, Message *out) {
-    Transaction *trans = GC_NEW(Transaction);
-    assert(trans != NULL);
+    Transaction *trans = pool_alloc(pool_transactions);
     trans->wait = NULL;
     trans->conn = conn;
     trans->in = in;
@@ -22,6 +21,12 @@ Transaction *trans_new(Connection *conn, Message *in, Message *out) {
     return trans;
 }
 
+/* only for transactions that nothing else can reach, such as a client
+ * request that has been answered */
+void trans_free(Transaction *trans) {
+    pool_free(pool_transactions, trans);
+}
+
 void trans_insert(Transaction *trans) {
     assert(trans != NULL);
     assert(trans->conn != NULL);
@@ -1,17 +1,23 @@
 #include <assert.h>
+#include <pthread.h>
 #include <gc/gc.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
 #include <netinet/in.h>
 #include <errno.h>
 #include <string.h>
 #include "types.h"
 #include "9p.h"
 #include "list.h"
+#include "vector.h"
 #include "connection.h"
 #include "handles.h"
 #include "transaction.h"
@@ -20,101 +26,286 @@
 #include "transport.h"
 #include "envoy.h"
 #include "dispatch.h"
+#include "admit.h"
 #include "worker.h"
+#include "pool.h"
+
+/* I/O reactors
+ *
+ * Each reactor is a thread with its own poller that owns a subset of the
+ * connections.  It does all socket reads and writes for those connections,
+ * including framing, packMessage and unpackMessage, without holding the big
+ * lock.  It only takes the big lock to hand finished messages over to
+ * workers (worker_create or cond_signal) and to tear down closed
+ * connections.
+ *
+ * Locks are taken in the rank order documented in worker.h: the big lock,
+ * the connection table, reactor->lock, the handles lock, then the raw pool.
+ * A reactor never acquires the big lock while holding its own lock.
+ * reactor->lock guards the conns vector and the pending_writes queues (with
+ * their depth and backpressure state) of the connections owned by the
+ * reactor; partial_in, partial_out and the receive ring are only ever
+ * touched by the owning reactor thread.
+ */
+struct reactor {
+    int index;
+    int poller;
+    pthread_mutex_t *lock;
+    int *refresh_pipe;
+    /* connections owned by this reactor, indexed by fd */
+    Vector *conns;
+    struct epoll_event *events;
+    /* scratch space for gathering a batch of outgoing messages */
+    struct iovec *iov;
+};
 
 /* state */
 
 Handles *handles_listen;
 Handles *handles_read;
 Handles *handles_write;
-int *refresh_pipe;
 
-static void write_message(Connection *conn) {
+static Reactor **reactors;
+static u32 reactor_next;
+/* the number of peers accepted on the local listener so far */
+static u32 local_peer_next;
+
+/* pack an outgoing message into a raw buffer */
+static void pack_message(Connection *conn, Message *msg) {
+    if (custom_raw(msg)) {
+        assert(msg->raw != NULL);
+    } else {
+        assert(msg->raw == NULL);
+        msg->raw = raw_new();
+    }
+    packMessage(msg, conn->maxSize);
+
+    /* print the message out if the right debug flag is set */
+    if (    (DEBUG_STORAGE && msg->id >= TSRESERVE) ||
+            (DEBUG_ENVOY_ADMIN && msg->id < TSRESERVE &&
+             msg->id > RWSTAT) ||
+            (DEBUG_CLIENT && conn->type == CONN_CLIENT_IN &&
+             msg->id <= RWSTAT) ||
+            (DEBUG_ENVOY && conn->type != CONN_CLIENT_IN &&
+             msg->id <= RWSTAT))
+    {
+        /* a shared payload is not in the header buffer, so show it from
+         * where it will be sent */
+        if (msg->sendraw != NULL && msg->id == TSWRITE)
+            msg->msg.tswrite.data = msg->sendraw + msg->sendoffset;
+        printMessage(stdout, msg);
+    }
+}
+
+/* release the buffers held by a message that has been sent or dropped */
+static void release_message(Message *msg) {
+    if (msg->raw != NULL) {
+        raw_delete(msg->raw);
+        msg->raw = NULL;
+    }
+    if (msg->sendraw != NULL) {
+        raw_delete(msg->sendraw);
+        msg->sendraw = NULL;
+        msg->sendcount = 0;
+    } else if (msg->sendcount > 0) {
+        close(msg->sendfd);
+        msg->sendfd = -1;
+        msg->sendcount = 0;
+    }
+}
+
+/* send part of a payload that comes straight from a file, or from a raw
+ * buffer shared with other messages */
+static int send_file_segment(Connection *conn, Message *msg, u32 done) {
+    static u8 zeros[BLOCK_SIZE];
+    off_t offset = msg->sendoffset + done;
+    int res;
+
+    if (msg->sendraw != NULL) {
+        return send(conn->fd, msg->sendraw + offset, msg->sendcount - done,
+                MSG_DONTWAIT);
+    }
+
+    res = sendfile(conn->fd, msg->sendfd, &offset, msg->sendcount - done);
+
+    /* the file was truncated after the reply was sized, so pad it out */
+    if (res == 0) {
+        res = send(conn->fd, zeros, min(msg->sendcount - done, BLOCK_SIZE),
+                MSG_DONTWAIT);
+    }
+
+    return res;
+}
+
+/* send as much queued output as the socket will take.  Up to
+ * TRANSPORT_WRITE_BATCH messages are packed at a time and flushed together
+ * with a single sendmsg; whatever a short send leaves behind stays in
+ * partial_out for the next writable event.  A message with a file-backed
+ * or shared payload ends the gather after its header, and the payload itself
+ * goes out with sendfile or send. */
+static void write_messages(Connection *conn) {
+    Reactor *r = conn->reactor;
+    struct msghdr hdr;
     Message *msg;
-    int bytes;
+    int i, count, res, head;
 
-    while (conn_has_pending_write(conn)) {
-        /* see if this is the continuation of a partial write */
-        if (conn->partial_out == NULL) {
-            conn->partial_out = msg = conn_get_pending_write(conn);
-            conn->partial_out_bytes = bytes = 0;
+    /* a worker may have detached the connection */
+    if (r == NULL)
+        return;
 
-            assert(msg != NULL);
+    if (conn->partial_out == NULL) {
+        conn->partial_out =
+            GC_MALLOC(sizeof(Message *) * TRANSPORT_WRITE_BATCH);
+        assert(conn->partial_out != NULL);
+        conn->partial_out_count = 0;
+    }
 
-            if (custom_raw(msg)) {
-                assert(msg->raw != NULL);
-            } else {
-                assert(msg->raw == NULL);
-                msg->raw = raw_new();
-            }
-            packMessage(msg, conn->maxSize);
-
-            /* print the message out if the right debug flag is set */
-            if (    (DEBUG_STORAGE && msg->id >= TSRESERVE) ||
-                    (DEBUG_ENVOY_ADMIN && msg->id < TSRESERVE &&
-                     msg->id > RWSTAT) ||
-                    (DEBUG_CLIENT && conn->type == CONN_CLIENT_IN &&
-                     msg->id <= RWSTAT) ||
-                    (DEBUG_ENVOY && conn->type != CONN_CLIENT_IN &&
-                     msg->id <= RWSTAT))
-            {
-                printMessage(stdout, msg);
+    for (;;) {
+        int wake = 0;
+
+        /* top up the batch from the queue */
+        count = conn->partial_out_count;
+        mutex_lock(r->lock, LOCK_RANK_REACTOR);
+        while (count < TRANSPORT_WRITE_BATCH &&
+                (msg = conn_get_pending_write(conn)) != NULL)
+        {
+            conn->partial_out[count++] = msg;
+        }
+
+        /* release backpressure once the queue has drained */
+        if (conn_queue_drained(conn)) {
+            if (conn->read_paused) {
+                handles_add(handles_read, conn->fd);
+                conn->read_paused = 0;
             }
+            wake = conn->write_waiters > 0;
+        }
+
+        if (count == 0) {
+            /* the queue is empty so stop trying to write */
+            handles_remove(handles_write, conn->fd);
+        }
+        mutex_unlock(r->lock, LOCK_RANK_REACTOR);
+
+        /* waiters check the queue while holding the big lock, so waking
+         * them under it cannot be missed */
+        if (wake) {
+            lock();
+            cond_broadcast(conn->writable);
+            unlock();
+        }
+
+        if (count == 0)
+            return;
+
+        for (i = conn->partial_out_count; i < count; i++)
+            pack_message(conn, conn->partial_out[i]);
+        conn->partial_out_count = count;
+
+        msg = conn->partial_out[0];
+        head = msg->size - msg->sendcount;
+
+        if (conn->partial_out_bytes >= head) {
+            /* we are partway through a separate payload */
+            res = send_file_segment(conn, msg,
+                    conn->partial_out_bytes - head);
         } else {
-            msg = conn->partial_out;
-            bytes = conn->partial_out_bytes;
+            /* gather the batch, skipping what already went out of the first
+             * message */
+            for (i = 0; i < count; i++) {
+                msg = conn->partial_out[i];
+                r->iov[i].iov_base = msg->raw;
+                r->iov[i].iov_len = msg->size - msg->sendcount;
+                if (msg->sendcount > 0) {
+                    i++;
+                    break;
+                }
+            }
+            r->iov[0].iov_base =
+                (u8 *) r->iov[0].iov_base + conn->partial_out_bytes;
+            r->iov[0].iov_len -= conn->partial_out_bytes;
+
+            memset(&hdr, 0, sizeof(hdr));
+            hdr.msg_iov = r->iov;
+            hdr.msg_iovlen = i;
+            res = sendmsg(conn->fd, &hdr, MSG_DONTWAIT);
         }
 
-        /* keep trying to send the message */
-        while (bytes < msg->size) {
-            int res = send(conn->fd, msg->raw + bytes, msg->size - bytes,
-                    MSG_DONTWAIT);
+        /* would we block? */
+        if (res < 0 && errno == EAGAIN)
+            return;
+
+        /* don't know how to handle any other errors... */
+        /* TODO: we should handle connect failures here */
+        assert(res > 0);
 
-            /* would we block? */
-            if (res < 0 && errno == EAGAIN)
-                return;
+        conn->totalbytesout += res;
 
-            /* don't know how to handle any other errors... */
-            /* TODO: we should handle connect failures here */
-            assert(res > 0);
+        /* retire the messages that are finished */
+        for (i = 0; i < count; i++) {
+            int left = conn->partial_out[i]->size - conn->partial_out_bytes;
+
+            if (res < left)
+                break;
 
-            /* record the bytes we sent */
-            conn->partial_out_bytes = (bytes += res);
-            conn->totalbytesout += res;
+            res -= left;
+            conn->partial_out_bytes = 0;
+            release_message(conn->partial_out[i]);
+            conn->totalmessagesout++;
         }
+        conn->partial_out_bytes += res;
+
+        /* shift the unfinished tail to the front of the batch */
+        conn->partial_out_count = count - i;
+        memmove(conn->partial_out, conn->partial_out + i,
+                sizeof(Message *) * conn->partial_out_count);
+        memset(conn->partial_out + conn->partial_out_count, 0,
+                sizeof(Message *) * i);
+    }
+}
 
-        /* that message is finished */
-        conn->partial_out = NULL;
-        conn->partial_out_bytes = 0;
-        raw_delete(msg->raw);
+/* finish a message that has been framed and decode it.  Messages that carry
+ * a payload keep their raw buffer; for all others the raw buffer is released
+ * (or, if it points into the receive ring, simply forgotten). */
+static int finish_message(Connection *conn, Message *msg, int inring) {
+    if (unpackMessage(msg) < 0) {
+        fprintf(stderr, "read_message: unpack failure\n");
+        return -1;
+    }
+
+    if (!custom_raw(msg)) {
+        if (!inring)
+            raw_delete(msg->raw);
         msg->raw = NULL;
-        conn->totalmessagesout++;
     }
+    conn->totalmessagesin++;
 
-    /* this was the last message in the queue so stop trying to write */
-    handles_remove(handles_write, conn->fd);
+    return 0;
 }
 
-static Message *read_message(Connection *conn) {
+/* read whatever is available on a connection with a single recv and return
+ * every complete message it yields, in arrival order.  Small messages are
+ * decoded straight out of the receive ring; messages with a payload are
+ * copied into a raw buffer of their own, and messages too big for the ring
+ * are read directly into their raw buffer.  *closed is set if the connection
+ * should be shut down. */
+static List *read_messages(Connection *conn, int *closed) {
+    List *msgs = NULL;
     Message *msg;
-    int bytes, size;
+    int res;
 
-    /* see if this is the continuation of a partial read */
-    if (conn->partial_in == NULL) {
-        conn->partial_in = msg = message_new();
-        conn->partial_in_bytes = bytes = 0;
-        msg->raw = raw_new();
-    } else {
-        msg = conn->partial_in;
-        bytes = conn->partial_in_bytes;
+    if (conn->ring == NULL) {
+        conn->ring = GC_MALLOC_ATOMIC(TRANSPORT_RING_SIZE);
+        assert(conn->ring != NULL);
+        conn->ring_start = conn->ring_end = 0;
     }
 
-    /* we start by reading the size field, then the whole message */
-    size = (bytes < 4) ? 4 : msg->size;
-
-    for (;;) {
-        int res =
-            recv(conn->fd, msg->raw + bytes, size - bytes, MSG_DONTWAIT);
+    /* see if this is the continuation of a large message; the ring is always
+     * empty while one is in progress */
+    if (conn->partial_in != NULL) {
+        msg = conn->partial_in;
+        res = recv(conn->fd, msg->raw + conn->partial_in_bytes,
+                msg->size - conn->partial_in_bytes, MSG_DONTWAIT);
 
         /* did we run out of data? */
         if (res < 0 && errno == EAGAIN)
@@ -124,63 +315,197 @@ static Message *read_message(Connection *conn) {
         if (res <= 0) {
             if (res < 0)
                 perror("recv error");
-            break;
+            goto fail;
         }
 
-        /* record the bytes we read */
-        conn->partial_in_bytes = (bytes += res);
+        conn->partial_in_bytes += res;
         conn->totalbytesin += res;
+        if (conn->partial_in_bytes < msg->size)
+            return NULL;
 
-        /* read the message length once it's available and check it */
-        if (bytes == 4) {
-            int index = 0;
-            if ((size = unpackU32(msg->raw, 4, &index)) > GLOBAL_MAX_SIZE) {
-                fprintf(stderr, "message too long\n");
-                break;
-            } else if (size <= 4) {
-                fprintf(stderr, "message too short\n");
-                break;
-            } else {
-                msg->size = size;
-            }
+        conn->partial_in = NULL;
+        conn->partial_in_bytes = 0;
+        if (finish_message(conn, msg, 0) < 0)
+            goto fail;
+        msgs = cons(msg, msgs);
+    }
+
+    /* slide any leftover partial message to the front of the ring */
+    if (conn->ring_start > 0) {
+        memmove(conn->ring, conn->ring + conn->ring_start,
+                conn->ring_end - conn->ring_start);
+        conn->ring_end -= conn->ring_start;
+        conn->ring_start = 0;
+    }
+
+    res = recv(conn->fd, conn->ring + conn->ring_end,
+            TRANSPORT_RING_SIZE - conn->ring_end, MSG_DONTWAIT);
+
+    /* did we run out of data? */
+    if (res < 0 && errno == EAGAIN)
+        return reverse(msgs);
+
+    /* an error or connection closed from other side? */
+    if (res <= 0) {
+        if (res < 0)
+            perror("recv error");
+        goto fail;
+    }
+
+    conn->ring_end += res;
+    conn->totalbytesin += res;
+
+    /* slice out as many complete messages as the ring holds */
+    while (conn->ring_end - conn->ring_start >= 4) {
+        u8 *head = conn->ring + conn->ring_start;
+        int avail = conn->ring_end - conn->ring_start;
+        int index = 0;
+        int size = unpackU32(head, 4, &index);
+
+        /* check the message length */
+        if (size > GLOBAL_MAX_SIZE) {
+            fprintf(stderr, "message too long\n");
+            goto fail;
+        } else if (size <= 4) {
+            fprintf(stderr, "message too short\n");
+            goto fail;
         }
 
-        /* have we read the whole message? */
-        if (bytes == size) {
-            if (unpackMessage(msg) < 0) {
-                fprintf(stderr, "read_message: unpack failure\n");
+        if (size > TRANSPORT_RING_SIZE) {
+            /* move what we have into a buffer of its own and read the rest
+             * of the message directly into it */
+            msg = pool_message_new();
+            msg->size = size;
+            msg->raw = raw_new_size(size);
+            if (avail > size)
+                avail = size;
+            memcpy(msg->raw, head, avail);
+            conn->ring_start += avail;
+
+            if (avail < size) {
+                conn->partial_in = msg;
+                conn->partial_in_bytes = avail;
                 break;
+            }
+
+            if (finish_message(conn, msg, 0) < 0)
+                goto fail;
+        } else if (avail < size) {
+            /* wait for the rest of the message */
+            break;
+        } else {
+            msg = pool_message_new();
+            msg->size = size;
+            msg->id = head[4];
+            conn->ring_start += size;
+
+            if (custom_raw(msg)) {
+                /* the payload is handed on by reference, so it cannot stay
+                 * in the ring */
+                msg->raw = raw_new_size(size);
+                memcpy(msg->raw, head, size);
+                if (finish_message(conn, msg, 0) < 0)
+                    goto fail;
             } else {
-                /* success */
-                conn->partial_in = NULL;
-                conn->partial_in_bytes = 0;
-                if (!custom_raw(msg)) {
-                    raw_delete(msg->raw);
-                    msg->raw = NULL;
-                }
-                conn->totalmessagesin++;
-                return msg;
+                msg->raw = head;
+                if (finish_message(conn, msg, 1) < 0)
+                    goto fail;
             }
         }
+
+        msgs = cons(msg, msgs);
     }
 
+    /* reset an empty ring so the next recv has the whole buffer */
+    if (conn->ring_start == conn->ring_end)
+        conn->ring_start = conn->ring_end = 0;
+
+    return reverse(msgs);
+
+fail:
     /* time to shut down this connection */
+    *closed = 1;
+
+    return reverse(msgs);
+}
+
+/* must be called with the big lock held */
+static void close_connection(Connection *conn) {
+    int fd = conn->fd;
+    int i;
+
     if (DEBUG_VERBOSE)
         printf("closing connection: %s\n", addr_to_string(conn->addr));
 
+    /* drop the batch we were in the middle of sending */
+    for (i = 0; i < conn->partial_out_count; i++)
+        release_message(conn->partial_out[i]);
+    conn->partial_out_count = 0;
+    conn->partial_out_bytes = 0;
+
     /* close down the connection */
+    admit_drop(conn);
     if (conn->type == CONN_CLIENT_IN)
         worker_create((void (*)(Worker *, void *)) client_shutdown, conn);
     conn_remove(conn);
-    handles_remove(handles_read, conn->fd);
-    if (conn_has_pending_write(conn))
-        handles_remove(handles_write, conn->fd);
-    close(conn->fd);
+    close(fd);
     /* if (DEBUG)
         exit(0); */
     conn->fd = -1;
+}
 
-    return NULL;
+/* hand a message to a worker; must be called with the big lock held */
+static void deliver_message(Connection *conn, Message *msg) {
+    Transaction *trans;
+
+    /* handle any pending errors */
+    while (!null(dispatch_error_queue)) {
+        printf("PANIC! Unhandled error\n");
+        dispatch_error_queue = cdr(dispatch_error_queue);
+    }
+
+    /* print the message out if the right debug flag is set */
+    if (    (DEBUG_STORAGE && msg->id >= TSRESERVE) ||
+            (DEBUG_ENVOY_ADMIN && msg->id < TSRESERVE &&
+             msg->id > RWSTAT) ||
+            (DEBUG_CLIENT && conn->type == CONN_CLIENT_IN &&
+             msg->id <= RWSTAT) ||
+            (DEBUG_ENVOY && conn->type != CONN_CLIENT_IN &&
+             msg->id <= RWSTAT))
+    {
+        printMessage(stdout, msg);
+    }
+
+    trans = trans_lookup_remove(conn, msg->tag);
+
+    /* what kind of request/response is this? */
+    switch (conn->type) {
+        case CONN_UNKNOWN_IN:
+        case CONN_CLIENT_IN:
+        case CONN_ENVOY_IN:
+        case CONN_STORAGE_IN:
+            /* this is a new transaction */
+            assert(trans == NULL);
+
+            trans = trans_new(conn, msg, NULL);
+
+            admit_request(trans);
+            break;
+
+        case CONN_ENVOY_OUT:
+        case CONN_STORAGE_OUT:
+            /* this is a reply to a request we made */
+            assert(trans != NULL);
+
+            trans->in = msg;
+
+            /* wake up the handler that is waiting for this message */
+            cond_signal(trans->wait);
+            break;
+
+        default:
+            assert(0);
+    }
 }
 
 static void accept_connection(int sock) {
@@ -195,93 +520,194 @@ static void accept_connection(int sock) {
     fd = accept(sock, (struct sockaddr *) netaddr, &len);
     assert(fd >= 0);
 
+    /* peers on the local listener have no network address of their own,
+     * so each one is numbered within LOCAL_PEER_NET to keep them apart */
+    if (netaddr->sin_family == AF_UNIX) {
+        u32 peer = __sync_add_and_fetch(&local_peer_next, 1);
+        netaddr->sin_family = AF_INET;
+        netaddr->sin_addr.s_addr = htonl(LOCAL_PEER_NET | (peer >> 16));
+        netaddr->sin_port = htons(peer & 0xffff);
+    }
+
+    /* sendfile has no MSG_DONTWAIT, so the descriptor itself must not block */
+    assert(fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == 0);
+
+    /* the new connection is attached to a reactor as it is inserted; the
+     * connection table has its own mutex, so the big lock is not needed */
     conn_insert_new(fd, CONN_UNKNOWN_IN, netaddr);
 
-    handles_add(handles_read, fd);
     if (DEBUG_VERBOSE)
         printf("accepted connection from %s\n", netaddr_to_string(netaddr));
 }
 
-/* select on all our open sockets and dispatch when one is ready */
-static Message *handle_socket_event(Connection **from) {
-    int high, num, fd;
-    fd_set rset, wset;
+/* service one ready descriptor owned by this reactor */
+static void reactor_service(Reactor *r, struct epoll_event *event) {
+    int fd = event->data.fd;
+    Connection *conn;
 
-    /* handles are guarded by connection lock */
-    assert(handles_listen->high >= 0);
+    /* was this a refresh request? */
+    if (fd == r->refresh_pipe[0]) {
+        char buff[16];
+        while (read(fd, buff, 16) > 0)
+            ;
+        return;
+    }
 
-    /* prepare and select on all active connections */
-    FD_ZERO(&rset);
-    high = handles_collect(handles_listen, &rset, 0);
-    high = handles_collect(handles_read, &rset, high);
-    FD_ZERO(&wset);
-    high = handles_collect(handles_write, &wset, high);
+    /* listening socket is available--accept a new incoming connection */
+    if ((event->events & EPOLLIN) && handles_member(handles_listen, fd)) {
+        accept_connection(fd);
+        return;
+    }
 
-    /* give up the lock while we wait */
-    unlock();
-    num = select(high + 1, &rset, &wset, NULL, NULL);
-    lock();
+    /* the connection may have closed earlier in this batch */
+    mutex_lock(r->lock, LOCK_RANK_REACTOR);
+    conn = vector_get(r->conns, fd);
+    mutex_unlock(r->lock, LOCK_RANK_REACTOR);
+    if (conn == NULL)
+        return;
 
-    /* writable socket is available--send a queued message */
+    /* writable socket is available--send queued messages */
     /* note: failed connects will show up here first, but they will also
-       show up in the readable set. */
-    if ((fd = handles_member(handles_write, &wset)) > -1) {
-        Connection *conn = conn_lookup_fd(fd);
-        assert(conn != NULL);
-        write_message(conn);
+       show up as readable (EPOLLERR/EPOLLHUP). */
+    if ((event->events & EPOLLOUT) && handles_member(handles_write, fd))
+        write_messages(conn);
 
-        return NULL;
+    /* readable socket is available--read messages */
+    if ((event->events & (EPOLLIN | EPOLLERR | EPOLLHUP)) &&
+            handles_member(handles_read, fd))
+    {
+        List *msgs;
+        int closed = 0;
+
+        /* frame and unpack everything one recv brings in before taking the
+         * big lock; anything left in the socket will be reported again by
+         * the poller */
+        msgs = read_messages(conn, &closed);
+
+        if (null(msgs) && !closed)
+            return;
+
+        lock();
+        for ( ; !null(msgs); msgs = cdr(msgs))
+            deliver_message(conn, car(msgs));
+        if (closed)
+            close_connection(conn);
+        unlock();
     }
+}
 
-    /* readable socket is available--read a message */
-    if ((fd = handles_member(handles_read, &rset)) > -1) {
-        /* was this a refresh request? */
-        if (fd == refresh_pipe[0]) {
-            char buff[16];
-            if (read(fd, buff, 16) < 0 && DEBUG_VERBOSE) {
-                /* perror("handle_socket_event failed to read pipe"); */
-            }
+static void *reactor_loop(Reactor *r) {
+    for (;;) {
+        int i;
+        int count = handles_wait(r->poller, r->events, HANDLES_EVENT_BATCH);
 
-            return NULL;
-        }
+        /* service every descriptor reported by this wakeup */
+        for (i = 0; i < count; i++)
+            reactor_service(r, &r->events[i]);
+    }
 
-        /* find the connection and store it for our caller */
-        *from = conn_lookup_fd(fd);
-        assert(*from != NULL);
+    return NULL;
+}
 
-        return read_message(*from);
-    }
+static Reactor *reactor_new(int index) {
+    Reactor *r = GC_NEW(Reactor);
+    int fd;
 
-    /* listening socket is available--accept a new incoming connection */
-    if ((fd = handles_member(handles_listen, &rset)) > -1) {
-        accept_connection(fd);
-        return NULL;
-    }
+    assert(r != NULL);
+    r->index = index;
+    r->poller = handles_poller_new();
+    r->lock = GC_NEW(pthread_mutex_t);
+    assert(r->lock != NULL);
+    pthread_mutex_init(r->lock, NULL);
+    r->conns = vector_create(CONN_VECTOR_SIZE);
+    r->events =
+        GC_MALLOC_ATOMIC(sizeof(struct epoll_event) * HANDLES_EVENT_BATCH);
+    assert(r->events != NULL);
+    r->iov = GC_MALLOC_ATOMIC(sizeof(struct iovec) * TRANSPORT_WRITE_BATCH);
+    assert(r->iov != NULL);
+    r->refresh_pipe = GC_MALLOC_ATOMIC(sizeof(int) * 2);
+    assert(r->refresh_pipe != NULL);
+
+    /* initialize a pipe that we can use to interrupt epoll_wait */
+    assert(pipe(r->refresh_pipe) == 0);
+    fd = r->refresh_pipe[0];
+    assert(fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == 0);
+    handles_assign(fd, r->poller);
+    handles_add(handles_read, fd);
 
-    return NULL;
+    return r;
+}
+
+static void reactor_refresh(Reactor *r) {
+    char *buff = "";
+    if (write(r->refresh_pipe[1], buff, 1) < 0)
+        perror("transport_refresh failed to write to pipe");
 }
 
 /*****************************************************************************/
 /* Public API */
 
+/* fill in the name of the local listener for a storage server port */
+static void local_path(struct sockaddr_un *localaddr, int port) {
+    memset(localaddr, 0, sizeof(struct sockaddr_un));
+    localaddr->sun_family = AF_UNIX;
+    snprintf(localaddr->sun_path, sizeof(localaddr->sun_path),
+            LOCAL_SOCKET_FORMAT, local_socket_dir, port);
+}
+
+/* storage servers also listen on a Unix-domain stream so an envoy on the
+ * same host can skip the TCP stack */
+static void local_listen(void) {
+    struct sockaddr_un localaddr;
+    struct stat info;
+    int fd;
+
+    local_path(&localaddr, my_address->port);
+
+    /* replace a socket left behind by an earlier run, but never one that
+     * another server is still accepting on (the directory is private to
+     * this user, see prepare_socket_dir) */
+    if (lstat(localaddr.sun_path, &info) == 0) {
+        assert(S_ISSOCK(info.st_mode));
+        fd = open_local_connection(my_address->port);
+        if (fd >= 0) {
+            fprintf(stderr, "%s is in use by another server\n",
+                    localaddr.sun_path);
+            close(fd);
+        }
+        assert(fd < 0);
+        unlink(localaddr.sun_path);
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert(fd >= 0);
+    assert(bind(fd, (struct sockaddr *) &localaddr,
+                sizeof(struct sockaddr_un)) == 0);
+    assert(listen(fd, 5) == 0);
+    if (DEBUG_VERBOSE)
+        printf("listening at %s\n", localaddr.sun_path);
+
+    handles_assign(fd, reactors[0]->poller);
+    handles_add(handles_listen, fd);
+}
+
 /* initialize data structures and start listening on a port */
 void transport_init() {
-    int fd;
+    int fd, i;
     struct linger ling;
     struct sockaddr_in listenaddr;
 
     /* set up the transport state */
-    handles_listen = handles_new();
-    handles_read = handles_new();
-    handles_write = handles_new();
-    refresh_pipe = GC_MALLOC_ATOMIC(sizeof(int) * 2);
-    assert(refresh_pipe != NULL);
-
-    /* initialize a pipe that we can use to interrupt select */
-    assert(pipe(refresh_pipe) == 0);
-    fd = refresh_pipe[0];
-    assert(fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == 0);
-    handles_add(handles_read, refresh_pipe[0]);
+    handles_listen = handles_new(EPOLLIN);
+    handles_read = handles_new(EPOLLIN);
+    handles_write = handles_new(EPOLLOUT);
+
+    assert(reactor_count >= 1 && reactor_count <= MAX_REACTORS);
+    reactors = GC_MALLOC(sizeof(Reactor *) * reactor_count);
+    assert(reactors != NULL);
+    for (i = 0; i < reactor_count; i++)
+        reactors[i] = reactor_new(i);
+    reactor_next = 0;
 
     /* initialize a listening port */
     assert(my_address != NULL);
@@ -300,25 +726,104 @@ void transport_init() {
     ling.l_onoff = 1;
     ling.l_linger = 0;
     setsockopt(fd, SOL_SOCKET, SO_LINGER, &ling, sizeof(ling));
+
+    /* the first reactor accepts new connections */
+    handles_assign(fd, reactors[0]->poller);
     handles_add(handles_listen, fd);
+
+    if (isstorage)
+        local_listen();
+}
+
+/* give a new connection to a reactor */
+void transport_attach(Connection *conn) {
+    Reactor *r;
+
+    assert(conn->fd >= 0);
+    assert(conn->reactor == NULL);
+
+    r = reactors[__sync_fetch_and_add(&reactor_next, 1) % reactor_count];
+
+    mutex_lock(r->lock, LOCK_RANK_REACTOR);
+    conn->reactor = r;
+    vector_set(r->conns, conn->fd, conn);
+    handles_assign(conn->fd, r->poller);
+    handles_add(handles_read, conn->fd);
+    mutex_unlock(r->lock, LOCK_RANK_REACTOR);
+}
+
+/* take a connection away from its reactor; called with the big lock held */
+void transport_detach(Connection *conn) {
+    Reactor *r = conn->reactor;
+    Message *msg;
+
+    if (r == NULL)
+        return;
+
+    mutex_lock(r->lock, LOCK_RANK_REACTOR);
+    vector_remove(r->conns, conn->fd);
+    handles_remove(handles_read, conn->fd);
+    handles_remove(handles_write, conn->fd);
+    conn->reactor = NULL;
+
+    /* queued output will never be sent, and may be holding descriptors */
+    while ((msg = conn_get_pending_write(conn)) != NULL)
+        release_message(msg);
+    mutex_unlock(r->lock, LOCK_RANK_REACTOR);
+
+    /* let workers blocked on a full queue see that it is gone */
+    cond_broadcast(conn->writable);
 }
 
 void put_message(Connection *conn, Message *msg) {
+    Reactor *r;
+
     assert(conn != NULL && msg != NULL);
 
     /* if the connection has died, drop the message */
-    if (conn->fd < 0) {
+    if (conn->fd < 0 || conn->reactor == NULL) {
         if (DEBUG_VERBOSE)
             printf("put_message: message dropped for closed connection\n");
         return;
     }
 
-    if (!conn_has_pending_write(conn)) {
-        handles_add(handles_write, conn->fd);
-        transport_refresh();
+    r = conn->reactor;
+    mutex_lock(r->lock, LOCK_RANK_REACTOR);
+
+    /* wait for the reactor to drain a full queue; the connection may be
+     * torn down while we sleep.  Control messages are small and must not
+     * wait behind bulk traffic, so they are always accepted. */
+    while (conn_queue_full(conn) && !conn_is_control(msg)) {
+        conn->write_waiters++;
+        mutex_unlock(r->lock, LOCK_RANK_REACTOR);
+        cond_wait(conn->writable);
+        mutex_lock(r->lock, LOCK_RANK_REACTOR);
+        conn->write_waiters--;
+
+        if (conn->reactor == NULL) {
+            mutex_unlock(r->lock, LOCK_RANK_REACTOR);
+            if (DEBUG_VERBOSE)
+                printf("put_message: message dropped for closed connection\n");
+            return;
+        }
     }
 
+    /* registering write interest wakes the reactor if the socket is
+     * already writable, so no explicit refresh is needed */
     conn_queue_write(conn, msg);
+    handles_add(handles_write, conn->fd);
+
+    /* stop taking new requests from a peer that is not keeping up with our
+     * replies.  Replies to our own requests are always read, since they
+     * are what lets the queues drain. */
+    if (conn_queue_full(conn) && !conn->read_paused &&
+            conn->type != CONN_ENVOY_OUT && conn->type != CONN_STORAGE_OUT)
+    {
+        handles_remove(handles_read, conn->fd);
+        conn->read_paused = 1;
+    }
+
+    mutex_unlock(r->lock, LOCK_RANK_REACTOR);
 }
 
 int open_connection(struct sockaddr_in *netaddr) {
@@ -338,7 +843,7 @@ int open_connection(struct sockaddr_in *netaddr) {
         return -1;
     }
 
-    handles_add(handles_read, fd);
+    /* the socket is registered when the connection is attached */
 
     if (DEBUG_VERBOSE)
         printf("opened connection to %s\n", netaddr_to_string(netaddr));
@@ -346,75 +851,50 @@ int open_connection(struct sockaddr_in *netaddr) {
     return fd;
 }
 
-void transport_refresh(void) {
-    char *buff = "";
-    if (write(refresh_pipe[1], buff, 1) < 0)
-        perror("transport_refresh failed to write to pipe");
-}
-
-void main_loop(void) {
-    Transaction *trans;
-    Message *msg;
-    Connection *conn;
-
-    lock();
-
-    for (;;) {
-        /* handle any pending errors */
-        if (!null(dispatch_error_queue)) {
-            printf("PANIC! Unhandled error\n");
-            dispatch_error_queue = cdr(dispatch_error_queue);
-            continue;
-        }
-
-        /* do a read or write, possibly returning a read message */
-        do
-            msg = handle_socket_event(&conn);
-        while (msg == NULL);
-
-        /* print the message out if the right debug flag is set */
-        if (    (DEBUG_STORAGE && msg->id >= TSRESERVE) ||
-                (DEBUG_ENVOY_ADMIN && msg->id < TSRESERVE &&
-                 msg->id > RWSTAT) ||
-                (DEBUG_CLIENT && conn->type == CONN_CLIENT_IN &&
-                 msg->id <= RWSTAT) ||
-                (DEBUG_ENVOY && conn->type != CONN_CLIENT_IN &&
-                 msg->id <= RWSTAT))
-        {
-            printMessage(stdout, msg);
-        }
-
-        trans = trans_lookup_remove(conn, msg->tag);
+/* connect to the local listener of a storage server on this host */
+int open_local_connection(int port) {
+    struct sockaddr_un localaddr;
+    int flags;
+    int fd;
 
-        /* what kind of request/response is this? */
-        switch (conn->type) {
-            case CONN_UNKNOWN_IN:
-            case CONN_CLIENT_IN:
-            case CONN_ENVOY_IN:
-            case CONN_STORAGE_IN:
-                /* this is a new transaction */
-                assert(trans == NULL);
+    local_path(&localaddr, port);
 
-                trans = trans_new(conn, msg, NULL);
+    if (    (fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+            connect(fd, (struct sockaddr *) &localaddr,
+                sizeof(struct sockaddr_un)) < 0 ||
+            (flags = fcntl(fd, F_GETFL)) < 0 ||
+            fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+    {
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
 
-                worker_create((void (*)(Worker *, void *)) dispatch, trans);
-                break;
+    if (DEBUG_VERBOSE)
+        printf("opened local connection to %s\n", localaddr.sun_path);
 
-            case CONN_ENVOY_OUT:
-            case CONN_STORAGE_OUT:
-                /* this is a reply to a request we made */
-                assert(trans != NULL);
+    return fd;
+}
 
-                trans->in = msg;
+void transport_refresh(void) {
+    int i;
 
-                /* wake up the handler that is waiting for this message */
-                cond_signal(trans->wait);
-                break;
+    for (i = 0; i < reactor_count; i++)
+        reactor_refresh(reactors[i]);
+}
 
-            default:
-                assert(0);
-        }
+void main_loop(void) {
+    int i;
+
+    /* the main thread runs the first reactor */
+    for (i = 1; i < reactor_count; i++) {
+        pthread_t newthread;
+        pthread_create(&newthread, NULL,
+                (void *(*)(void *)) reactor_loop, (void *) reactors[i]);
+        pthread_detach(newthread);
     }
+
+    reactor_loop(reactors[0]);
 }
 
 Transaction *connect_envoy(Connection *conn) {
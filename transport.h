@@ -10,6 +10,9 @@
 void transport_init(void);
 void put_message(Connection *conn, Message *msg);
 int open_connection(struct sockaddr_in *netaddr);
+int open_local_connection(int port);
+void transport_attach(Connection *conn);
+void transport_detach(Connection *conn);
 void transport_refresh(void);
 void main_loop(void);
 /* returns NULL on success, failed transaction on failure */
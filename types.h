@@ -5,6 +5,7 @@ typedef struct address Address;
 typedef struct transaction Transaction;
 typedef struct connection Connection;
 typedef struct worker Worker;
+typedef struct cond Cond;
 typedef struct fid Fid;
 typedef struct forward Forward;
 typedef struct message Message;
@@ -14,11 +15,13 @@ typedef struct vector Vector;
 typedef struct list List;
 typedef struct handles Handles;
 typedef struct heap Heap;
+typedef struct pool Pool;
 typedef struct lru Lru;
 typedef struct openfile Openfile;
 typedef struct objectdir Objectdir;
 typedef struct lease Lease;
 typedef struct claim Claim;
 typedef struct walk Walk;
+typedef struct reactor Reactor;
 
 #endif
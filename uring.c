@@ -0,0 +1,164 @@
+#include <assert.h>
+#include <pthread.h>
+#include <gc/gc.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <errno.h>
+#include <string.h>
+#include "types.h"
+#include "9p.h"
+#include "worker.h"
+#include "uring.h"
+
+struct uring_request {
+    Cond *wait;
+    struct iovec iov;
+    int done;
+    int res;
+};
+
+static int uring_fd = -1;
+static unsigned uring_entries;
+static unsigned uring_inflight;
+static unsigned *uring_sq_tail;
+static unsigned *uring_sq_mask;
+static unsigned *uring_sq_array;
+static struct io_uring_sqe *uring_sqes;
+static unsigned *uring_cq_head;
+static unsigned *uring_cq_tail;
+static unsigned *uring_cq_mask;
+static struct io_uring_cqe *uring_cqes;
+
+static void *uring_loop(void *arg) {
+    for (;;) {
+        unsigned head, tail;
+
+        /* block until at least one request completes */
+        if (syscall(__NR_io_uring_enter, uring_fd, 0, 1,
+                    IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+        {
+            assert(errno == EINTR);
+            continue;
+        }
+
+        lock();
+        head = *uring_cq_head;
+        tail = __atomic_load_n(uring_cq_tail, __ATOMIC_ACQUIRE);
+        for ( ; head != tail; head++) {
+            struct io_uring_cqe *cqe = &uring_cqes[head & *uring_cq_mask];
+            struct uring_request *req =
+                (struct uring_request *) (unsigned long) cqe->user_data;
+
+            req->res = cqe->res;
+            req->done = 1;
+            cond_signal(req->wait);
+        }
+        __atomic_store_n(uring_cq_head, head, __ATOMIC_RELEASE);
+        unlock();
+    }
+
+    return NULL;
+}
+
+int uring_init(unsigned entries) {
+    struct io_uring_params params;
+    pthread_t thread;
+    u8 *sq, *cq;
+    int fd;
+
+    memset(&params, 0, sizeof(params));
+    fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0)
+        return -1;
+
+    sq = mmap(NULL, params.sq_off.array + params.sq_entries * sizeof(u32),
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+            IORING_OFF_SQ_RING);
+    cq = mmap(NULL, params.cq_off.cqes +
+            params.cq_entries * sizeof(struct io_uring_cqe),
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+            IORING_OFF_CQ_RING);
+    uring_sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+            IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || uring_sqes == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+
+    uring_sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    uring_sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    uring_sq_array = (unsigned *) (sq + params.sq_off.array);
+    uring_cq_head = (unsigned *) (cq + params.cq_off.head);
+    uring_cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    uring_cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    uring_cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+    /* the completion queue is at least as big as the submission queue, so
+     * capping requests in flight at sq_entries means it never overflows */
+    uring_entries = params.sq_entries;
+    uring_inflight = 0;
+    uring_fd = fd;
+
+    pthread_create(&thread, NULL, uring_loop, NULL);
+    pthread_detach(thread);
+
+    return 0;
+}
+
+/* submit a single read or write and sleep until it completes; returns the
+ * byte count or a negative errno */
+static int uring_io(Worker *worker, int op, int fd, u64 offset, u8 *data,
+        u32 count)
+{
+    /* the request is shared with the completion thread and the kernel, so it
+     * cannot live on the worker's stack, which is swapped out while it waits */
+    struct uring_request *req = GC_NEW(struct uring_request);
+    struct io_uring_sqe *sqe;
+    unsigned tail, index;
+
+    assert(req != NULL);
+    req->wait = worker->sleep;
+    req->iov.iov_base = data;
+    req->iov.iov_len = count;
+    req->done = 0;
+    req->res = 0;
+
+    tail = *uring_sq_tail;
+    index = tail & *uring_sq_mask;
+    sqe = &uring_sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->off = offset;
+    sqe->addr = (unsigned long) &req->iov;
+    sqe->len = 1;
+    sqe->user_data = (unsigned long) req;
+    uring_sq_array[index] = index;
+    __atomic_store_n(uring_sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    uring_inflight++;
+    assert(syscall(__NR_io_uring_enter, uring_fd, 1, 0, 0, NULL, 0) == 1);
+
+    while (!req->done)
+        cond_wait(worker->sleep);
+    uring_inflight--;
+
+    return req->res;
+}
+
+int uring_available(void) {
+    return uring_fd >= 0 && uring_inflight < uring_entries;
+}
+
+int uring_read(Worker *worker, int fd, u64 offset, u8 *data, u32 count) {
+    return uring_io(worker, IORING_OP_READV, fd, offset, data, count);
+}
+
+int uring_write(Worker *worker, int fd, u64 offset, u8 *data, u32 count) {
+    return uring_io(worker, IORING_OP_WRITEV, fd, offset, data, count);
+}
@@ -0,0 +1,31 @@
+#ifndef _URING_H_
+#define _URING_H_
+
+#include "types.h"
+#include "9p.h"
+#include "worker.h"
+
+/* Asynchronous object I/O through io_uring.
+ * Reads and writes are submitted with the big lock held; the submitting
+ * worker then yields its thread on its condition variable until
+ * a completion thread reaps the result and wakes it.  Since submission is
+ * serialized by the big lock, the submission queue needs no lock of its own.
+ * uring_init fails if the kernel has no io_uring support, and
+ * uring_available is false until it succeeds or while the queue is full, so
+ * callers keep a synchronous path to fall back on.
+ *
+ * This is an experiment confined to the storage server, and it is off unless
+ * the -u option is given.  It does not yet make the server faster: each
+ * request is submitted on its own, since only one worker runs at a time, and
+ * completions still take the big lock to wake their workers.  No throughput
+ * gain has been measured.  Getting one needs workers that can submit while
+ * others wait (see the remaining steps of the lock ordering in worker.h), so
+ * that one io_uring_enter sends a batch, and a wakeup that does not wait for
+ * the big lock. */
+
+int uring_init(unsigned entries);
+int uring_available(void);
+int uring_read(Worker *worker, int fd, u64 offset, u8 *data, u32 count);
+int uring_write(Worker *worker, int fd, u64 offset, u8 *data, u32 count);
+
+#endif
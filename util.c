@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <pthread.h>
 #include <gc/gc.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -20,6 +21,8 @@
 #include "hashtable.h"
 #include "util.h"
 #include "config.h"
+#include "worker.h"
+#include "pool.h"
 
 Hashtable *group_info;
 Hashtable *user_to_uid_table;
@@ -27,8 +30,41 @@ Hashtable *uid_to_user_table;
 Hashtable *group_to_gid_table;
 Hashtable *gid_to_group_table;
 
-static List *raw_buffer;
-static int raw_buffer_count;
+/* interned path components.  The table holds its atoms through disappearing
+ * links, so a name is dropped once no claim or stat record refers to it.
+ * Links are only revealed with the allocation lock held, since the
+ * collector clears them while the world is stopped. */
+struct name_atom {
+    GC_hidden_pointer name;
+    u32 hash;
+    struct name_atom *next;
+};
+
+static struct name_atom **name_atoms;
+static u32 name_atom_size;
+static u32 name_atom_count;
+
+struct name_atom_probe {
+    char *name;
+    u32 hash;
+};
+
+/* raw buffers are handed out by the I/O reactors as well as the workers, so
+ * the pool is guarded by raw_lock instead of worker_biglock.  Buffers come
+ * in a few size classes, each with its own free list, and every buffer is
+ * preceded by a header giving its class and the number of references to it.
+ * The free lists are kept in list cells, since the buffers themselves are
+ * not scanned by the collector. */
+struct raw_header {
+    u32 class;
+    u32 refs;
+    u64 pad;
+};
+
+static pthread_mutex_t *raw_lock;
+static u32 raw_class_size[RAW_CLASSES];
+static List *raw_buffer[RAW_CLASSES];
+static int raw_buffer_count[RAW_CLASSES];
 
 /*****************************************************************************/
 
@@ -232,12 +268,100 @@ u32 generic_hash(const void *elt, int len, u32 hash) {
 }
 
 u32 string_hash(const char *str) {
-    u32 hash = 0;
+    return string_hash_continue(0, str);
+}
+
+/* the hash of a string that extends one whose hash is already known */
+u32 string_hash_continue(u32 hash, const char *str) {
     while (*str)
         hash = hash * 157 + *(str++);
     return hash;
 }
 
+/* search a bucket for a live atom, dropping entries that have been cleared;
+ * called with the allocation lock held */
+static void *name_atom_search(void *arg) {
+    struct name_atom_probe *probe = arg;
+    struct name_atom **link = &name_atoms[probe->hash % name_atom_size];
+    struct name_atom *elt;
+
+    while ((elt = *link) != NULL) {
+        char *atom;
+
+        if (elt->name == 0) {
+            *link = elt->next;
+            name_atom_count--;
+            continue;
+        }
+        atom = GC_REVEAL_POINTER(elt->name);
+        if (elt->hash == probe->hash && !strcmp(atom, probe->name))
+            return atom;
+        link = &elt->next;
+    }
+
+    return NULL;
+}
+
+static void name_atom_resize(u32 size) {
+    struct name_atom **table = GC_MALLOC(sizeof(struct name_atom *) * size);
+    u32 i;
+
+    assert(table != NULL);
+
+    for (i = 0; i < name_atom_size; i++) {
+        struct name_atom *elt = name_atoms[i];
+        while (elt != NULL) {
+            struct name_atom *next = elt->next;
+            elt->next = table[elt->hash % size];
+            table[elt->hash % size] = elt;
+            elt = next;
+        }
+    }
+
+    name_atoms = table;
+    name_atom_size = size;
+}
+
+/* return the shared copy of a path component if one is in use, or NULL */
+char *name_atom_find(char *name) {
+    struct name_atom_probe probe;
+
+    probe.name = name;
+    probe.hash = string_hash(name);
+
+    return GC_call_with_alloc_lock(name_atom_search, &probe);
+}
+
+/* return the single shared copy of a path component */
+char *intern_name(char *name) {
+    struct name_atom_probe probe;
+    struct name_atom *elt;
+    char *atom;
+
+    probe.name = name;
+    probe.hash = string_hash(name);
+
+    if ((atom = GC_call_with_alloc_lock(name_atom_search, &probe)) != NULL)
+        return atom;
+
+    if (name_atom_count >= name_atom_size * 2)
+        name_atom_resize(name_atom_size * 2);
+
+    atom = stringcopy(name);
+    elt = GC_NEW(struct name_atom);
+    assert(elt != NULL);
+    elt->name = GC_HIDE_POINTER(atom);
+    elt->hash = probe.hash;
+    elt->next = name_atoms[probe.hash % name_atom_size];
+    name_atoms[probe.hash % name_atom_size] = elt;
+    name_atom_count++;
+
+    assert(GC_general_register_disappearing_link(
+                (void **) &elt->name, atom) == 0);
+
+    return atom;
+}
+
 /* convert a u32 to a string, allocating the necessary storage */
 char *u32tostr(u32 n) {
     char *res = GC_MALLOC_ATOMIC(11);
@@ -320,11 +444,22 @@ List *parse_address_list(char *hosts, int defaultport) {
 
 Address *parse_address(char *host, int defaultport) {
     char *colon = strchr(host, ':');
+    Address *addr;
     int port;
-    if (colon == NULL)
-        return make_address(host, defaultport);
-    host = substring(host, 0, colon - host);
-    port = atoi(++colon);
+    if (colon == NULL) {
+        port = defaultport;
+    } else {
+        host = substring(host, 0, colon - host);
+        port = atoi(++colon);
+    }
+
+    /* "local" names a server on this host that we reach without TCP */
+    if (!strcmp(host, LOCAL_ADDRESS_NAME)) {
+        addr = make_address("localhost", port);
+        addr->local = 1;
+        return addr;
+    }
+
     return make_address(host, port);
 }
 
@@ -342,6 +477,7 @@ Address *make_address(char *host, int port) {
 
     addr->ip = ntohl(((struct in_addr *) ent->h_addr_list[0])->s_addr);
     addr->port = port;
+    addr->local = 0;
 
     return addr;
 }
@@ -351,6 +487,7 @@ Address *address_new(u32 ip, u16 port) {
     assert(addr != NULL);
     addr->ip = ip;
     addr->port = port;
+    addr->local = 0;
     return addr;
 }
 
@@ -372,6 +509,7 @@ Address *netaddr_to_addr(struct sockaddr_in *netaddr) {
     assert(addr != NULL);
     addr->ip = ntohl(netaddr->sin_addr.s_addr);
     addr->port = ntohs(netaddr->sin_port);
+    addr->local = 0;
     return addr;
 }
 
@@ -470,6 +608,11 @@ int randInt(int range) {
 void util_state_init(void) {
     struct group *group;
     struct passwd *passwd;
+    int i;
+
+    raw_lock = GC_NEW(pthread_mutex_t);
+    assert(raw_lock != NULL);
+    pthread_mutex_init(raw_lock, NULL);
 
     user_to_uid_table = hash_create(
             USER_HASHTABLE_SIZE,
@@ -491,6 +634,10 @@ void util_state_init(void) {
             (Hashfunc) string_hash,
             (Cmpfunc) strcmp);
 
+    name_atom_size = 0;
+    name_atom_count = 0;
+    name_atom_resize(NAME_HASHTABLE_SIZE);
+
     group_info = hash_create(
             GROUP_HASHTABLE_SIZE,
             (Hashfunc) string_hash,
@@ -511,7 +658,6 @@ void util_state_init(void) {
     /* walk the system group table */
     setgrent();
     while ((group = getgrent()) != NULL) {
-        int i;
         char *groupname = stringcopy(group->gr_name);
         u32 *gid = GC_NEW_ATOMIC(u32);
         assert(gid != NULL);
@@ -532,8 +678,13 @@ void util_state_init(void) {
     }
     endgrent();
 
-    raw_buffer = NULL;
-    raw_buffer_count = 0;
+    raw_class_size[0] = RAW_SMALL_SIZE;
+    raw_class_size[1] = RAW_BLOCK_SIZE;
+    raw_class_size[2] = GLOBAL_MAX_SIZE;
+    for (i = 0; i < RAW_CLASSES; i++) {
+        raw_buffer[i] = NULL;
+        raw_buffer_count[i] = 0;
+    }
 }
 
 int isgroupmember(char *user, char *group) {
@@ -624,33 +775,74 @@ struct qid makeqid(u32 mode, u32 mtime, u64 size, u64 oid) {
     return qid;
 }
 
-void *raw_new(void) {
-    void *raw;
-    if (null(raw_buffer)) {
-        raw = GC_MALLOC_ATOMIC(GLOBAL_MAX_SIZE);
-        assert(raw != NULL);
+/* get a buffer with room for at least size bytes, holding one reference */
+void *raw_new_size(u32 size) {
+    struct raw_header *header;
+    List *elt;
+    u32 class;
+
+    for (class = 0; class < RAW_CLASSES - 1; class++)
+        if (size <= raw_class_size[class])
+            break;
+    assert(size <= raw_class_size[class]);
+
+    mutex_lock(raw_lock, LOCK_RANK_RAW);
+    elt = raw_buffer[class];
+    if (null(elt)) {
+        header = GC_MALLOC_ATOMIC(sizeof(struct raw_header) +
+                raw_class_size[class]);
+        assert(header != NULL);
+        header->class = class;
         if (DEBUG_VERBOSE)
-            printf("raw_buffer_count = %d\n", ++raw_buffer_count);
+            printf("raw_buffer_count[%u] = %d\n", class,
+                    ++raw_buffer_count[class]);
     } else {
-        raw = car(raw_buffer);
-        raw_buffer = cdr(raw_buffer);
+        header = car(elt);
+        raw_buffer[class] = cdr(elt);
+        pool_cons_free(elt);
     }
+    header->refs = 1;
+    mutex_unlock(raw_lock, LOCK_RANK_RAW);
+
+    return header + 1;
+}
+
+/* get a buffer big enough for any message */
+void *raw_new(void) {
+    return raw_new_size(GLOBAL_MAX_SIZE);
+}
+
+/* add a reference to a buffer for another message that sends from it */
+void *raw_retain(void *raw) {
+    struct raw_header *header = (struct raw_header *) raw - 1;
+
+    mutex_lock(raw_lock, LOCK_RANK_RAW);
+    assert(header->refs > 0);
+    header->refs++;
+    mutex_unlock(raw_lock, LOCK_RANK_RAW);
+
     return raw;
 }
 
+/* drop a reference, returning the buffer to its free list with the last */
 void raw_delete(void *raw) {
-    List *raws = raw_buffer;
+    struct raw_header *header;
 
     if (raw == NULL)
         return;
 
-    /* an object sometimes gets deleted twice through the worker cleanup
-     * mechanism, but I don't have time to fix the problem properly */
-    for ( ; !null(raws); raws = cdr(raws))
-        if (car(raws) == raw)
-            return;
+    header = (struct raw_header *) raw - 1;
+
+    mutex_lock(raw_lock, LOCK_RANK_RAW);
+
+    /* a buffer already on the free list has no references left to drop */
+    assert(header->refs > 0);
+    if (--header->refs == 0) {
+        raw_buffer[header->class] =
+            pool_cons(header, raw_buffer[header->class]);
+    }
 
-    raw_buffer = cons(raw, raw_buffer);
+    mutex_unlock(raw_lock, LOCK_RANK_RAW);
 }
 
 int p9stat_cmp(const struct p9stat *a, const struct p9stat *b) {
@@ -28,6 +28,8 @@ char *filename(char *path);
 char *concatname(char *path, char *name);
 char *resolvePath(char *base, char *ext, struct stat *info);
 List *splitpath(char *path);
+char *name_atom_find(char *name);
+char *intern_name(char *name);
 
 u32 addr_hash(const Address *addr);
 int addr_cmp(const Address *a, const Address *b);
@@ -44,6 +46,7 @@ Address *get_my_address(void);
 
 u32 generic_hash(const void *elt, int len, u32 hash);
 u32 string_hash(const char *str);
+u32 string_hash_continue(u32 hash, const char *str);
 u32 u32_hash(const u32 *elt);
 int u32_cmp(const u32 *a, const u32 *b);
 u32 u64_hash(const u64 *elt);
@@ -73,6 +76,8 @@ enum path_type get_admin_path_type(char *path);
 struct qid makeqid(u32 mode, u32 mtime, u64 size, u64 oid);
 
 void *raw_new(void);
+void *raw_new_size(u32 size);
+void *raw_retain(void *raw);
 void raw_delete(void *raw);
 
 void util_state_init(void);
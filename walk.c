@@ -31,7 +31,7 @@ Lru *walk_cache;
 #define require_info(_ptr) do { \
     if ((_ptr)->info == NULL) { \
         (_ptr)->info = \
-            object_stat(worker, (_ptr)->oid, filename((_ptr)->pathname)); \
+            object_stat(worker, (_ptr)->oid, (_ptr)->name); \
     } \
 } while (0)
 
@@ -290,7 +290,7 @@ static void walk_local(Worker *worker, Transaction *trans,
             {
                 /* if there are no active fids, grant a lease to the remote
                  * envoy and start the request over */
-                if (null(env->claim->children) && null(env->claim->fids)) {
+                if (env->claim->children == NULL && null(env->claim->fids)) {
                     if (DEBUG_VERBOSE) {
                         printf("lease split for attach: %s to %s\n",
                                 env->pathname,
@@ -586,6 +586,7 @@ int walk_resurrect(Walk *walk) {
 void walk_state_init(void) {
     walk_cache = lru_new(
             WALK_CACHE_SIZE,
+            walk_cache_policy,
             (Hashfunc) string_hash,
             (Cmpfunc) strcmp,
             (int (*)(void *)) walk_resurrect,
@@ -3,8 +3,10 @@
 #include <setjmp.h>
 #include <gc/gc.h>
 #include <stdlib.h>
+#include <alloca.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <string.h>
 #include "types.h"
 #include "9p.h"
 #include "list.h"
@@ -14,6 +16,7 @@
 #include "config.h"
 #include "worker.h"
 #include "heap.h"
+#include "pool.h"
 #include "disk.h"
 #include "claim.h"
 #include "lease.h"
@@ -21,11 +24,46 @@
 
 /* Static data */
 u32 worker_next_priority;
-Heap *worker_ready_to_run;
-List *worker_thread_pool;
 pthread_mutex_t *worker_biglock;
 int worker_active;
 
+/* transactions started over after losing a race for an object, those that
+ * waited in place instead, and those of the latter that found the object
+ * changed and started over anyway */
+u32 worker_restarts;
+u32 worker_waits;
+u32 worker_waits_rechecked;
+
+/* a thread that runs workers as coroutines
+ * Workers that have started are bound to their thread and wait in its
+ * runnable heap.  New workers wait in the fresh heap of the thread they were
+ * given to, from which an idle thread may steal them.  Both heaps are ordered
+ * by worker_priority_cmp, so each thread runs the oldest worker it can.
+ *
+ * The heaps and the sleeping flag are guarded by the thread's queue lock
+ * (LOCK_RANK_QUEUE), not the big lock, so an idle thread looks for work,
+ * steals and sleeps without contending with the worker that holds the big
+ * lock.  A thread only takes the big lock to switch into the worker it has
+ * chosen.  No thread holds two queue locks at once. */
+struct worker_thread {
+    pthread_mutex_t *queue_lock;
+    pthread_cond_t *idle;
+    /* set while the thread is idle and looking for work or asleep */
+    int sleeping;
+    Heap *runnable;
+    Heap *fresh;
+    /* workers that have finished a transaction and are waiting for another */
+    List *pool;
+    Worker *current;
+    jmp_buf jmp;
+    /* every coroutine on this thread runs with its stack just below here */
+    u8 *base;
+};
+
+static struct worker_thread *worker_threads[WORKER_THREAD_COUNT];
+static int worker_thread_next;
+static __thread struct worker_thread *worker_self;
+
 int worker_priority_cmp(const Worker *a, const Worker *b) {
     if (a->priority == b->priority)
         return 0;
@@ -37,48 +75,349 @@ int worker_priority_cmp(const Worker *a, const Worker *b) {
     return 1;
 }
 
+static void *worker_thread_loop(struct worker_thread *self);
+
 void worker_state_init(void) {
+    int i;
+
     worker_next_priority = 0;
-    worker_ready_to_run =
-        heap_new(WORKER_READY_QUEUE_SIZE, (Cmpfunc) worker_priority_cmp);
-    worker_thread_pool = NULL;
     worker_biglock = GC_NEW(pthread_mutex_t);
     assert(worker_biglock != NULL);
     pthread_mutex_init(worker_biglock, NULL);
     worker_active = 0;
-}
+    worker_thread_next = 0;
+    worker_restarts = worker_waits = worker_waits_rechecked = 0;
+
+    /* the threads steal from each other, so set all of them up before any
+     * of them starts */
+    for (i = 0; i < WORKER_THREAD_COUNT; i++) {
+        struct worker_thread *thread = GC_NEW(struct worker_thread);
+        assert(thread != NULL);
+
+        thread->queue_lock = GC_NEW(pthread_mutex_t);
+        assert(thread->queue_lock != NULL);
+        pthread_mutex_init(thread->queue_lock, NULL);
+        thread->idle = GC_NEW(pthread_cond_t);
+        assert(thread->idle != NULL);
+        pthread_cond_init(thread->idle, NULL);
+        thread->sleeping = 0;
+        thread->runnable =
+            heap_new(WORKER_READY_QUEUE_SIZE, (Cmpfunc) worker_priority_cmp);
+        thread->fresh =
+            heap_new(WORKER_READY_QUEUE_SIZE, (Cmpfunc) worker_priority_cmp);
+        thread->pool = NULL;
+        thread->current = NULL;
+        worker_threads[i] = thread;
+    }
 
-void worker_wake_up_next(void) {
-    Worker *next = heap_remove(worker_ready_to_run);
-    if (next == NULL)
-        return;
-    cond_signal(next->sleep);
+    for (i = 0; i < WORKER_THREAD_COUNT; i++) {
+        pthread_t newthread;
+        pthread_attr_t attr;
+
+        pthread_attr_init(&attr);
+        pthread_attr_setstacksize(&attr,
+                max(PTHREAD_STACK_MIN, WORKER_THREAD_STACK_SIZE));
+        pthread_create(&newthread, &attr,
+                (void *(*)(void *)) worker_thread_loop,
+                (void *) worker_threads[i]);
+        pthread_detach(newthread);
+    }
 }
 
 /*
- * Worker threads
+ * Coroutines
  */
 
-static void *worker_loop(Worker *t) {
+static void worker_enqueue(List **head, List **tail, Worker *t) {
+    List *elt = pool_cons(t, NULL);
+
+    if (null(*head))
+        *head = elt;
+    else
+        setcdr(*tail, elt);
+    *tail = elt;
+}
+
+static Worker *worker_dequeue(List **head, List **tail) {
+    List *elt = *head;
+    Worker *t;
+
+    if (null(elt))
+        return NULL;
+
+    t = car(elt);
+    *head = cdr(elt);
+    if (null(*head))
+        *tail = NULL;
+    pool_cons_free(elt);
+
+    return t;
+}
+
+/* called with the thread's queue lock held */
+static int worker_wake_thread(struct worker_thread *thread) {
+    if (!thread->sleeping)
+        return 0;
+
+    thread->sleeping = 0;
+    pthread_cond_signal(thread->idle);
+
+    return 1;
+}
+
+static int worker_wake_idle(struct worker_thread *thread) {
+    int woken;
+
+    mutex_lock(thread->queue_lock, LOCK_RANK_QUEUE);
+    woken = worker_wake_thread(thread);
+    mutex_unlock(thread->queue_lock, LOCK_RANK_QUEUE);
+
+    return woken;
+}
+
+/* queue a worker that has started to run again on its own thread */
+static void worker_make_runnable(Worker *t) {
+    struct worker_thread *thread = t->thread;
+    assert(thread != NULL);
+
+    mutex_lock(thread->queue_lock, LOCK_RANK_QUEUE);
+    heap_add(thread->runnable, t);
+    worker_wake_thread(thread);
+    mutex_unlock(thread->queue_lock, LOCK_RANK_QUEUE);
+}
+
+/* queue a new worker on a thread, waking an idle one to steal it if that
+ * thread is busy */
+static void worker_make_fresh(struct worker_thread *thread, Worker *t) {
+    int woken;
     int i;
-    enum worker_transaction_states state;
 
-    lock();
+    mutex_lock(thread->queue_lock, LOCK_RANK_QUEUE);
+    heap_add(thread->fresh, t);
+    woken = worker_wake_thread(thread);
+    mutex_unlock(thread->queue_lock, LOCK_RANK_QUEUE);
+
+    for (i = 0; !woken && i < WORKER_THREAD_COUNT; i++)
+        if (worker_threads[i] != thread)
+            woken = worker_wake_idle(worker_threads[i]);
+}
 
-    if (!heap_isempty(worker_ready_to_run)) {
-        /* wait for older threads that are ready to run */
-        worker_wake_up_next();
-        heap_add(worker_ready_to_run, t);
-        cond_wait(t->sleep);
+/* new work goes to the thread that created it, or else to an idle thread */
+static struct worker_thread *worker_pick_thread(void) {
+    int i;
+
+    if (worker_self != NULL)
+        return worker_self;
+
+    for (i = 0; i < WORKER_THREAD_COUNT; i++) {
+        struct worker_thread *thread = worker_threads[i];
+        int sleeping;
+
+        mutex_lock(thread->queue_lock, LOCK_RANK_QUEUE);
+        sleeping = thread->sleeping;
+        mutex_unlock(thread->queue_lock, LOCK_RANK_QUEUE);
+
+        if (sleeping)
+            return thread;
+    }
+
+    worker_thread_next = (worker_thread_next + 1) % WORKER_THREAD_COUNT;
+    return worker_threads[worker_thread_next];
+}
+
+/* choose the oldest worker this thread can run: one bound to it, one of its
+ * own new ones, or failing that the oldest new one waiting on any thread.
+ * The other threads' heaps are peeked one lock at a time, so the one chosen
+ * may be gone by the time we come back for it, in which case we look
+ * again. */
+static Worker *worker_next(struct worker_thread *self) {
+    for (;;) {
+        struct worker_thread *victim = NULL;
+        Worker *pinned, *fresh, *t = NULL;
+        int i;
+
+        mutex_lock(self->queue_lock, LOCK_RANK_QUEUE);
+        fresh = heap_peek(self->fresh);
+        mutex_unlock(self->queue_lock, LOCK_RANK_QUEUE);
+
+        if (fresh == NULL) {
+            for (i = 0; i < WORKER_THREAD_COUNT; i++) {
+                struct worker_thread *other = worker_threads[i];
+                Worker *elt;
+
+                if (other == self)
+                    continue;
+
+                mutex_lock(other->queue_lock, LOCK_RANK_QUEUE);
+                elt = heap_peek(other->fresh);
+                if (elt != NULL && (fresh == NULL ||
+                            worker_priority_cmp(elt, fresh) < 0))
+                {
+                    fresh = elt;
+                    victim = other;
+                }
+                mutex_unlock(other->queue_lock, LOCK_RANK_QUEUE);
+            }
+        }
+
+        mutex_lock(self->queue_lock, LOCK_RANK_QUEUE);
+        pinned = heap_peek(self->runnable);
+        if (victim == NULL)
+            fresh = heap_peek(self->fresh);
+        if (pinned != NULL &&
+                (fresh == NULL || worker_priority_cmp(pinned, fresh) <= 0))
+        {
+            t = heap_remove(self->runnable);
+        } else if (victim == NULL && fresh != NULL) {
+            t = heap_remove(self->fresh);
+        }
+        mutex_unlock(self->queue_lock, LOCK_RANK_QUEUE);
+
+        if (t != NULL || victim == NULL)
+            return t;
+
+        /* steal it if nobody else has */
+        mutex_lock(victim->queue_lock, LOCK_RANK_QUEUE);
+        if (heap_peek(victim->fresh) == fresh)
+            t = heap_remove(victim->fresh);
+        mutex_unlock(victim->queue_lock, LOCK_RANK_QUEUE);
+
+        if (t != NULL)
+            return t;
+    }
+}
+
+static void worker_loop(Worker *t);
+
+/* run a new coroutine with its stack starting at the thread's base */
+static void __attribute__((noinline)) worker_run(Worker *t) {
+    worker_loop(t);
+
+    /* the worker has expired, so drop it and go back to the scheduler */
+    t->stack = NULL;
+    t->stack_size = t->stack_used = 0;
+    longjmp(t->thread->jmp, 1);
+}
+
+static void __attribute__((noinline)) worker_start(struct worker_thread *self,
+        Worker *t)
+{
+    u8 *here = __builtin_frame_address(0);
+    volatile u8 *pad;
+
+    assert(here > self->base);
+    pad = alloca(here - self->base);
+    pad[0] = 0;
+
+    t->thread = self;
+    worker_run(t);
+}
+
+/* copy the coroutine's stack back in place and jump to where it yielded;
+ * first move below the area being restored */
+static void __attribute__((noinline)) worker_resume(struct worker_thread *self,
+        Worker *t)
+{
+    u8 *here = __builtin_frame_address(0);
+    volatile u8 *pad;
+
+    assert(here > self->base);
+    pad = alloca(here - self->base + t->stack_used + WORKER_STACK_MARGIN);
+    pad[0] = 0;
+
+    memcpy(self->base - t->stack_used, t->stack, t->stack_used);
+    longjmp(t->resume, 1);
+}
+
+/* save everything from the caller's frame up to the base and return to the
+ * scheduler; the copy grows as needed and is kept for the next yield */
+static void __attribute__((noinline)) worker_suspend(Worker *t) {
+    struct worker_thread *self = t->thread;
+    u8 *top = __builtin_frame_address(0);
+    u32 used = self->base - top;
+
+    if (used > t->stack_size) {
+        u32 size = max(t->stack_size, WORKER_STACK_INITIAL_SIZE);
+        while (size < used)
+            size *= 2;
+        t->stack = GC_MALLOC(size);
+        assert(t->stack != NULL);
+        t->stack_size = size;
     }
 
-    /* let threads expire after a while so the thread pool can grow and shrink
-     * as needed without hard limits on the number of threads */
+    memcpy(t->stack, top, used);
+    t->stack_used = used;
+    longjmp(self->jmp, 1);
+}
+
+static void __attribute__((noinline)) worker_yield(Worker *t) {
+    if (setjmp(t->resume) == 0)
+        worker_suspend(t);
+}
+
+static void __attribute__((noinline)) worker_switch(struct worker_thread *self,
+        Worker *t)
+{
+    self->current = t;
+    if (setjmp(self->jmp) == 0) {
+        if (t->thread == NULL)
+            worker_start(self, t);
+        else
+            worker_resume(self, t);
+    }
+    self->current = NULL;
+}
+
+static void *worker_thread_loop(struct worker_thread *self) {
+    Worker *t;
+
+    worker_self = self;
+    self->base = (u8 *) __builtin_frame_address(0) - WORKER_STACK_MARGIN;
+
+    for (;;) {
+        /* mark the thread idle before looking, so work queued while we look
+         * wakes us instead of being missed */
+        mutex_lock(self->queue_lock, LOCK_RANK_QUEUE);
+        self->sleeping = 1;
+        mutex_unlock(self->queue_lock, LOCK_RANK_QUEUE);
+
+        t = worker_next(self);
+
+        mutex_lock(self->queue_lock, LOCK_RANK_QUEUE);
+        if (t == NULL) {
+            while (self->sleeping)
+                pthread_cond_wait(self->idle, self->queue_lock);
+        } else {
+            self->sleeping = 0;
+        }
+        mutex_unlock(self->queue_lock, LOCK_RANK_QUEUE);
+
+        if (t != NULL) {
+            lock();
+            worker_switch(self, t);
+            unlock();
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Workers
+ */
+
+static void worker_loop(Worker *t) {
+    int i;
+    enum worker_transaction_states state;
+
+    /* let workers expire after a while so the pool can grow and shrink as
+     * needed without hard limits on the number of workers */
     for (i = 0; i < THREAD_LIFETIME; i++) {
         if (i > 0) {
             /* wait in the pool for a request */
-            worker_thread_pool = append_elt(worker_thread_pool, t);
-            cond_wait(t->sleep);
+            t->thread->pool = cons(t, t->thread->pool);
+            while (t->func == NULL)
+                cond_wait(t->sleep);
         }
         worker_active++;
 
@@ -89,8 +428,8 @@ static void *worker_loop(Worker *t) {
             if (state == WORKER_BLOCKED) {
                 /* wait for the blocking transaction to finish,
                  * then start over */
+                worker_restarts++;
                 worker_cleanup(t);
-                worker_wake_up_next();
                 cond_wait(t->sleep);
             } else if (state == WORKER_MULTISTEP) {
                 /* wait for the next step in this grant/revoke op to wake us up
@@ -100,7 +439,6 @@ static void *worker_loop(Worker *t) {
                 worker_cleanup(t);
                 t->func = NULL;
                 t->arg = NULL;
-                worker_wake_up_next();
                 while (t->func == NULL)
                     cond_wait(t->sleep);
                 if (DEBUG_VERBOSE)
@@ -116,25 +454,14 @@ static void *worker_loop(Worker *t) {
         worker_cleanup(t);
         t->func = NULL;
 
-        /* make anyone waiting on this transaction ready to run, then run one */
-        if (!null(t->blocking)) {
-            for ( ; !null(t->blocking); t->blocking = cdr(t->blocking))
-                heap_add(worker_ready_to_run, car(t->blocking));
-        }
-
         worker_active--;
-        worker_wake_up_next();
     }
-
-    unlock();
-
-    return NULL;
 }
 
 void worker_create(void (*func)(Worker *, void *), void *arg) {
-    if (null(worker_thread_pool)) {
-        pthread_t newthread;
-        pthread_attr_t attr;
+    struct worker_thread *thread = worker_pick_thread();
+
+    if (null(thread->pool)) {
         Worker *t = GC_NEW(Worker);
         assert(t != NULL);
         t->sleep = cond_new();
@@ -143,34 +470,38 @@ void worker_create(void (*func)(Worker *, void *), void *arg) {
         t->arg = arg;
         t->priority = worker_next_priority++;
         t->blocking = NULL;
+        t->parked = NULL;
+        t->remote_waits = 0;
 
-        pthread_attr_init(&attr);
-        pthread_attr_setstacksize(&attr, max(PTHREAD_STACK_MIN, 1024 * 1024));
-        pthread_create(&newthread, &attr,
-                (void *(*)(void *)) worker_loop, (void *) t);
-        pthread_detach(newthread);
+        t->stack = NULL;
+        t->stack_used = t->stack_size = 0;
+        t->thread = NULL;
+        worker_make_fresh(thread, t);
     } else {
-        Worker *t = car(worker_thread_pool);
-        worker_thread_pool = cdr(worker_thread_pool);
+        Worker *t = car(thread->pool);
+        thread->pool = cdr(thread->pool);
 
         t->func = func;
         t->arg = arg;
         t->priority = worker_next_priority++;
         t->blocking = NULL;
 
-        if (!heap_isempty(worker_ready_to_run)) {
-            /* wait for older threads that are ready to run */
-            worker_wake_up_next();
-            heap_add(worker_ready_to_run, t);
-        } else {
-            cond_signal(t->sleep);
-        }
+        cond_signal(t->sleep);
+    }
+}
+
+static void worker_wake_parked(Worker *worker) {
+    while (!null(worker->parked)) {
+        List *elt = worker->parked;
+        worker->parked = cdr(elt);
+        cond_signal(((Worker *) car(elt))->sleep);
+        pool_cons_free(elt);
     }
 }
 
 static void unlock_lease_cleanup(Worker *worker, Lease *lease) {
     if (--lease->inflight == 0 && lease->wait_for_update != NULL)
-        worker->blocking = cons(lease->wait_for_update, worker->blocking);
+        worker->blocking = pool_cons(lease->wait_for_update, worker->blocking);
     /* note: we leave wait_for_update set to keep the lease locked */
 }
 
@@ -180,9 +511,12 @@ static void unlock_lease_cleanup(Worker *worker, Lease *lease) {
 
 void worker_cleanup(Worker *worker) {
     while (!null(worker->cleanup)) {
-        enum lock_types type = (enum lock_types) caar(worker->cleanup);
-        void *obj = cdar(worker->cleanup);
-        worker->cleanup = cdr(worker->cleanup);
+        List *elt = worker->cleanup;
+        enum lock_types type = (enum lock_types) caar(elt);
+        void *obj = cdar(elt);
+        worker->cleanup = cdr(elt);
+        pool_cons_free(car(elt));
+        pool_cons_free(elt);
 
         switch (type) {
             case LOCK_DIRECTORY:        cleanup(struct objectdir);      break;
@@ -213,6 +547,15 @@ void worker_cleanup(Worker *worker) {
                 assert(0);
         }
     }
+
+    /* make anyone waiting on what we held ready to run */
+    while (!null(worker->blocking)) {
+        List *elt = worker->blocking;
+        worker->blocking = cdr(elt);
+        cond_signal(((Worker *) car(elt))->sleep);
+        pool_cons_free(elt);
+    }
+    worker_wake_parked(worker);
 }
 #undef cleanup
 
@@ -222,21 +565,87 @@ Worker *worker_attempt_to_acquire(Worker *worker, Worker *other) {
         return worker;
 
     /* we lose */
-    other->blocking = cons(worker, other->blocking);
+    other->blocking = pool_cons(worker, other->blocking);
     longjmp(worker->jmp, WORKER_BLOCKED);
     assert(0);
 }
 
+/* wait in place until the holder of an object releases it, or start over if
+ * we are older than the holder or it is waiting on something outside this
+ * envoy; returns true if we had to wait */
+int worker_wait_to_acquire(Worker *worker, Worker **holder) {
+    int waited = 0;
+
+    while (*holder != NULL && *holder != worker) {
+        Worker *other = *holder;
+
+        if (worker_priority_cmp(worker, other) <= 0 || other->remote_waits > 0)
+            worker_attempt_to_acquire(worker, other);
+
+        other->parked = pool_cons(worker, other->parked);
+        cond_wait(worker->sleep);
+        waited = 1;
+    }
+
+    if (waited)
+        worker_waits++;
+
+    return waited;
+}
+
+/* the running worker is about to wait on another envoy or on other workers,
+ * which might need objects it holds, so anyone waiting in place on it must
+ * give up and start over */
+void worker_remote_wait_begin(void) {
+    Worker *t;
+
+    if (worker_self == NULL)
+        return;
+
+    t = worker_self->current;
+    t->remote_waits++;
+    worker_wake_parked(t);
+}
+
+void worker_remote_wait_end(void) {
+    if (worker_self == NULL)
+        return;
+
+    assert(worker_self->current->remote_waits > 0);
+    worker_self->current->remote_waits--;
+}
+
 void worker_retry(Worker *worker) {
     longjmp(worker->jmp, WORKER_RETRY);
 }
 
+/* the ranks of the mutexes held by this thread, one bit per rank */
+static __thread u32 worker_ranks_held;
+
+void mutex_lock(pthread_mutex_t *mutex, enum lock_ranks rank) {
+    if (DEBUG_AUDIT && (worker_ranks_held >> rank) != 0) {
+        fprintf(stderr, "lock order violation: rank %d taken with 0x%x held\n",
+                rank, worker_ranks_held);
+        assert(0);
+    }
+
+    pthread_mutex_lock(mutex);
+    worker_ranks_held |= 1 << rank;
+}
+
+void mutex_unlock(pthread_mutex_t *mutex, enum lock_ranks rank) {
+    assert(worker_ranks_held & (1 << rank));
+
+    worker_ranks_held &= ~(1 << rank);
+    pthread_mutex_unlock(mutex);
+}
+
 void lock(void) {
-    pthread_mutex_lock(worker_biglock);
+    mutex_lock(worker_biglock, LOCK_RANK_BIG);
 }
 
 void unlock(void) {
-    pthread_mutex_unlock(worker_biglock);
+    mutex_unlock(worker_biglock, LOCK_RANK_BIG);
 }
 
 void lock_lease(Worker *worker, Lease *lease) {
@@ -284,13 +693,14 @@ void lock_lease_extend_multistep(Worker *worker, Lease *lease) {
 }
 
 void lock_lease_join(Worker *worker, List *children) {
+    worker_remote_wait_begin();
     for ( ; !null(children); children = cdr(children)) {
         Lease *lease = car(children);
         while (lease->wait_for_update != worker &&
                 lease->wait_for_update != NULL)
         {
             lease->wait_for_update->blocking =
-                cons(worker, lease->wait_for_update->blocking);
+                pool_cons(worker, lease->wait_for_update->blocking);
             if (DEBUG_VERBOSE)
                 printf("lock_lease_join: sleeping\n");
             cond_wait(worker->sleep);
@@ -310,29 +720,58 @@ void lock_lease_join(Worker *worker, List *children) {
 
         worker_cleanup_add(worker, LOCK_LEASE_EXCLUSIVE, lease);
     }
+    worker_remote_wait_end();
 }
 
-void cond_signal(pthread_cond_t *cond) {
-    pthread_cond_signal(cond);
+void cond_signal(Cond *cond) {
+    Worker *t = worker_dequeue(&cond->waiters, &cond->waiters_tail);
+
+    if (t != NULL)
+        worker_make_runnable(t);
+    else
+        pthread_cond_signal(&cond->var);
 }
 
-void cond_broadcast(pthread_cond_t *cond) {
-    pthread_cond_broadcast(cond);
+void cond_broadcast(Cond *cond) {
+    Worker *t;
+
+    while ((t = worker_dequeue(&cond->waiters, &cond->waiters_tail)) != NULL)
+        worker_make_runnable(t);
+    pthread_cond_broadcast(&cond->var);
 }
 
-void cond_wait(pthread_cond_t *cond) {
-    pthread_cond_wait(cond, worker_biglock);
+void cond_wait(Cond *cond) {
+    /* sleeping with anything but the big lock held would stall others */
+    assert(!DEBUG_AUDIT || worker_ranks_held == 1 << LOCK_RANK_BIG);
+
+    if (worker_self != NULL) {
+        Worker *t = worker_self->current;
+        assert(t != NULL);
+        worker_enqueue(&cond->waiters, &cond->waiters_tail, t);
+        worker_yield(t);
+    } else {
+        pthread_cond_wait(&cond->var, worker_biglock);
+    }
 }
 
-pthread_cond_t *cond_new(void) {
-    pthread_cond_t *cond = GC_NEW(pthread_cond_t);
-    assert(cond != NULL);
-    pthread_cond_init(cond, NULL);
+Cond *cond_new(void) {
+    Cond *cond = pool_alloc(pool_conds);
+    pthread_cond_init(&cond->var, NULL);
+    cond->waiters = cond->waiters_tail = NULL;
     return cond;
 }
 
+/* return a condition variable to the pool; nothing may be waiting on it and
+ * nothing may signal it again */
+void cond_free(Cond *cond) {
+    assert(null(cond->waiters));
+    pthread_cond_destroy(&cond->var);
+    pool_free(pool_conds, cond);
+}
+
 void worker_cleanup_add(Worker *worker, enum lock_types type, void *object) {
-    worker->cleanup = cons(cons((void *) type, object), worker->cleanup);
+    worker->cleanup =
+        pool_cons(pool_cons((void *) type, object), worker->cleanup);
 }
 
 void worker_cleanup_remove(Worker *worker, enum lock_types type, void *object) {
@@ -345,6 +784,8 @@ void worker_cleanup_remove(Worker *worker, enum lock_types type, void *object) {
                 worker->cleanup = cdr(cur);
             else
                 setcdr(prev, cdr(cur));
+            pool_cons_free(car(cur));
+            pool_cons_free(cur);
 
             return;
         }
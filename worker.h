@@ -14,6 +14,9 @@
 
 #define WORKER_PRIORITY_THRESHOLD 0x80000000L
 
+/* room left above coroutine stacks for the scheduler's own frames */
+#define WORKER_STACK_MARGIN 4096
+
 enum lock_types {
     LOCK_DIRECTORY,
     LOCK_OPENFILE,
@@ -26,6 +29,59 @@ enum lock_types {
     LOCK_RAW,
 };
 
+/* Lock ordering
+ *
+ * Mutexes are ranked, and a thread may only acquire a mutex whose rank is
+ * above every mutex it already holds.  With data structure audits enabled
+ * (-d d) every acquisition is checked, as is holding anything besides the
+ * big lock across cond_wait.
+ *
+ *   LOCK_RANK_BIG      worker_biglock: transactions, fids, claims, leases,
+ *                      walks and the object caches
+ *   LOCK_RANK_QUEUE    a worker thread's run queues and idle flag
+ *   LOCK_RANK_LRU      each LRU cache's table, lists and counters; held
+ *                      while the cache's resurrect and cleanup callbacks run
+ *   LOCK_RANK_LEASE    each lease's fid table, claim cache and directory
+ *                      block cache
+ *   LOCK_RANK_CONN     the connection table: the vector of connections by
+ *                      descriptor and the address hashtables
+ *   LOCK_RANK_REACTOR  a reactor's connections and their output queues
+ *   LOCK_RANK_HANDLES  the handle sets
+ *   LOCK_RANK_RAW      the raw buffer pool
+ *   LOCK_RANK_POOL     each object pool's free list
+ *
+ * The finer locks do not give any parallelism yet: every worker still runs
+ * with the big lock held from the moment it is switched in until it yields
+ * or releases it around a system call, so at most one worker touches shared
+ * state at a time.  They only mark out what each structure's own lock must
+ * protect once the big lock narrows.  The remaining steps, in order:
+ *
+ *   1. reads and stats within a single lease: take the lease lock instead of
+ *      the big lock for Tread/Tstat on a fid whose claim and directory
+ *      blocks are already cached, falling back to the big lock on a miss
+ *   2. claims: give each claim its own lock under LOCK_RANK_LEASE, covering
+ *      its children, fids and deleted flag, so walks within a lease can
+ *      run together
+ *   3. the object paths: let object_cache_status and the storage requests
+ *      it issues run under the LRU lock alone
+ *   4. lease changes: have lease_split, lease_merge and lease_merge_exit
+ *      take the big lock only while they move whole leases
+ *
+ * Each step should come with a load-script run showing it scales before the
+ * next one starts.
+ */
+enum lock_ranks {
+    LOCK_RANK_BIG,
+    LOCK_RANK_QUEUE,
+    LOCK_RANK_LRU,
+    LOCK_RANK_LEASE,
+    LOCK_RANK_CONN,
+    LOCK_RANK_REACTOR,
+    LOCK_RANK_HANDLES,
+    LOCK_RANK_RAW,
+    LOCK_RANK_POOL,
+};
+
 enum worker_transaction_states {
     WORKER_ZERO,
     WORKER_BLOCKED,
@@ -33,9 +89,15 @@ enum worker_transaction_states {
     WORKER_MULTISTEP,
 };
 
-/* worker threads */
+/* workers
+ * Each transaction runs as a coroutine on one of a fixed set of threads.  A
+ * worker that waits on a condition variable yields its thread to the next
+ * runnable worker, saving the part of the stack it had in use; it is resumed
+ * on the same thread with the stack copied back in place.  A worker that
+ * releases the big lock around a system call keeps its thread until the call
+ * returns. */
 struct worker {
-    pthread_cond_t *sleep;
+    Cond *sleep;
     void (*func)(Worker *, void *);
     Transaction *arg;
 
@@ -45,6 +107,26 @@ struct worker {
 
     u32 priority;
     List *blocking;
+    /* younger workers waiting in place for objects this one holds, and whether
+     * this one is waiting on something that might wait on them in turn */
+    List *parked;
+    int remote_waits;
+
+    /* the coroutine: where it last yielded, a copy of the stack it had in
+     * use then, and the thread it is bound to once it has started */
+    jmp_buf resume;
+    u8 *stack;
+    u32 stack_used;
+    u32 stack_size;
+    struct worker_thread *thread;
+};
+
+/* condition variables: workers wait by yielding their threads, and anything
+ * else (the reactors) by waiting on var */
+struct cond {
+    pthread_cond_t var;
+    List *waiters;
+    List *waiters_tail;
 };
 
 #define reserve(work, kind, obj) do { \
@@ -54,15 +136,39 @@ struct worker {
     } \
 } while (0)
 
+/* Like reserve, but if the holder is older the loser waits for it to
+ * release its objects and carries on from here instead of starting over.
+ * Since workers only wait in place for older ones, these waits cannot form a
+ * cycle.
+ * After waiting, valid must still be true of obj or the transaction starts
+ * over after all.  obj is evaluated again after waiting, so it must not
+ * depend on anything the holder may change. */
+#define reserve_wait(work, kind, obj, valid) do { \
+    if (work != obj->lock) { \
+        if (worker_wait_to_acquire(work, &obj->lock) && !(valid)) { \
+            worker_waits_rechecked++; \
+            worker_retry(work); \
+        } \
+        obj->lock = work; \
+        worker_cleanup_add(work, kind, obj); \
+    } \
+} while (0)
+
 #define release(work, kind, obj) do { \
     obj->lock = NULL; \
     worker_cleanup_remove(work, kind, obj); \
 } while (0)
 
+extern u32 worker_restarts;
+extern u32 worker_waits;
+extern u32 worker_waits_rechecked;
+
 void worker_create(void (*func)(Worker *, void *), void *arg);
 void worker_cleanup(Worker *worker);
 void worker_retry(Worker *worker);
 
+void mutex_lock(pthread_mutex_t *mutex, enum lock_ranks rank);
+void mutex_unlock(pthread_mutex_t *mutex, enum lock_ranks rank);
 void lock(void);
 void unlock(void);
 void lock_lease(Worker *worker, Lease *lease);
@@ -70,12 +176,16 @@ void lock_lease_exclusive(Worker *worker, Lease *lease);
 void lock_lease_extend_multistep(Worker *worker, Lease *lease);
 void lock_lease_join(Worker *worker, List *children);
 
-void cond_signal(pthread_cond_t *var);
-void cond_broadcast(pthread_cond_t *var);
-void cond_wait(pthread_cond_t *var);
-pthread_cond_t *cond_new(void);
+void cond_signal(Cond *cond);
+void cond_broadcast(Cond *cond);
+void cond_wait(Cond *cond);
+Cond *cond_new(void);
+void cond_free(Cond *cond);
 
 Worker *worker_attempt_to_acquire(Worker *worker, Worker *other);
+int worker_wait_to_acquire(Worker *worker, Worker **holder);
+void worker_remote_wait_begin(void);
+void worker_remote_wait_end(void);
 void worker_cleanup_add(Worker *worker, enum lock_types type, void *object);
 void worker_cleanup_remove(Worker *worker, enum lock_types type, void *object);
 